@@ -0,0 +1,122 @@
+#pragma once
+/* Streams of keys for the benchmarks: uniform or Zipf over `cardinality`
+ * ranks, every element unique, or a single repeated element. Ranks are
+ * spread over the key space with a bijection, so the exact number of distinct
+ * keys is the number of distinct ranks.
+ * */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+enum gen_dist {
+	GEN_UNIFORM,
+	GEN_ZIPF,
+	GEN_UNIQUE,
+	GEN_DUP,
+};
+
+struct gen {
+	enum gen_dist dist;
+	uint64_t cardinality;
+	uint64_t state;
+	uint64_t count; // elements drawn so far
+	double *cdf; // Zipf only, one entry per rank
+};
+
+static inline uint64_t gen_next(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* return: -EINVAL for a zero cardinality, -ENOMEM if the Zipf table does not
+ * fit (it takes 8 bytes per rank)
+ * */
+static inline int gen_init(struct gen *g, enum gen_dist dist,
+		uint64_t cardinality, double zipf_s, uint64_t seed)
+{
+	memset(g, 0, sizeof(*g));
+	if (cardinality == 0)
+		return -EINVAL;
+	g->dist = dist;
+	g->cardinality = cardinality;
+	g->state = seed;
+	if (dist != GEN_ZIPF)
+		return 0;
+	g->cdf = malloc(cardinality * sizeof(double));
+	if (g->cdf == NULL)
+		return -ENOMEM;
+	double sum = 0;
+	for (uint64_t r = 0; r < cardinality; r++) {
+		sum += pow((double)(r + 1), -zipf_s);
+		g->cdf[r] = sum;
+	}
+	for (uint64_t r = 0; r < cardinality; r++)
+		g->cdf[r] /= sum;
+	return 0;
+}
+
+static inline void gen_free(struct gen *g)
+{
+	free(g->cdf);
+	g->cdf = NULL;
+}
+
+static inline uint64_t gen_rank(struct gen *g)
+{
+	uint64_t i = g->count++;
+	switch (g->dist) {
+	case GEN_UNIQUE:
+		return i;
+	case GEN_DUP:
+		return 0;
+	case GEN_UNIFORM:
+		return gen_next(&g->state) % g->cardinality;
+	case GEN_ZIPF:
+	default: {
+		double u = (gen_next(&g->state) >> 11) * 0x1.0p-53;
+		uint64_t lo = 0, hi = g->cardinality - 1;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (g->cdf[mid] <= u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+	}
+}
+
+/* bijections of 32 and 64-bit integers (the finalizers of MurmurHash3) */
+static inline uint32_t gen_mix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint64_t gen_mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* the key of a rank for keys of `bits` bits (distinct ranks give distinct
+ * keys as long as they fit the width)
+ * */
+static inline uint64_t gen_key(uint64_t rank, int bits)
+{
+	return bits == 32 ? gen_mix32(rank) : gen_mix64(rank);
+}
@@ -0,0 +1,176 @@
+/* Latency of single buffer operations (insert, delete and replace-top) for the
+ * treap and the heap, as percentiles of the time of each call. The timer
+ * itself costs about `timer_ns`, which is included in every sample. The
+ * results are written as JSON on stdout.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../treap/treap.h"
+#include "../heap/heap.h"
+#include "../treap/bench/bench.h"
+#include "gen.h"
+
+#define MAX_SIZES 32
+// samples of each operation per size
+#define SAMPLES (1 << 20)
+
+enum op {
+	OP_INSERT,
+	OP_DELETE,
+	OP_REPLACE_TOP,
+	COUNT_OPS,
+};
+
+static const char *op_names[] = {"insert", "delete", "replace_top"};
+
+struct samples {
+	uint32_t *ns;
+	uint32_t count;
+};
+
+static inline void record(struct samples *s, uint64_t start)
+{
+	uint64_t d = bench_now_ns() - start;
+	if (s->count < SAMPLES)
+		s->ns[s->count++] = d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+/* Fill the buffer with distinct keys, replace the top 4 times per slot with
+ * a priority below it (the steady state of CVM), then delete every key in
+ * random order. Repeated until every operation has enough samples.
+ * */
+#define OPS_RUN(name, prefix, key_t) \
+static int name(uint32_t size, struct samples *out) \
+{ \
+	key_t k; \
+	uint64_t seed = 7, next_key = 0; \
+	struct prefix *t = prefix##_new_sized(size); \
+	key_t *keys = malloc(size * sizeof(key_t)); \
+	uint32_t *prios = malloc(size * sizeof(uint32_t)); \
+	if (t == NULL || keys == NULL || prios == NULL) \
+		return -ENOMEM; \
+	while (out[OP_INSERT].count < SAMPLES || \
+			out[OP_REPLACE_TOP].count < SAMPLES) { \
+		for (uint32_t i = 0; i < size; i++) { \
+			prefix##_key_set(&k, gen_mix32(next_key++)); \
+			uint32_t u = bench_rand(&seed); \
+			uint64_t start = bench_now_ns(); \
+			prefix##_insert(t, &k, u); \
+			record(&out[OP_INSERT], start); \
+		} \
+		for (uint32_t i = 0; i < 4 * size; i++) { \
+			uint32_t top = prefix##_priority(t, prefix##_top(t)); \
+			uint32_t u = top ? bench_rand(&seed) % top : 0; \
+			prefix##_key_set(&k, gen_mix32(next_key++)); \
+			uint64_t start = bench_now_ns(); \
+			prefix##_replace_top(t, &k, u); \
+			record(&out[OP_REPLACE_TOP], start); \
+		} \
+		uint32_t used = t->used; \
+		prefix##_export_sorted(t, keys, prios); \
+		for (uint32_t i = used; i > 1; i--) { \
+			uint32_t j = bench_rand(&seed) % i; \
+			key_t tmp = keys[i - 1]; \
+			keys[i - 1] = keys[j]; \
+			keys[j] = tmp; \
+		} \
+		for (uint32_t i = 0; i < used; i++) { \
+			uint64_t start = bench_now_ns(); \
+			prefix##_delete(t, &keys[i]); \
+			record(&out[OP_DELETE], start); \
+		} \
+	} \
+	free(keys); \
+	free(prios); \
+	prefix##_destroy(t); \
+	return 0; \
+}
+
+OPS_RUN(run_treap, treap, struct treap_key)
+OPS_RUN(run_heap, heap, struct heap_key)
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_op(struct samples *s)
+{
+	double sum = 0;
+	for (uint32_t i = 0; i < s->count; i++)
+		sum += s->ns[i];
+	qsort(s->ns, s->count, sizeof(uint32_t), cmp_u32);
+#define PCT(q) s->ns[(uint32_t)((q) * (s->count - 1))]
+	printf("{\"samples\": %u, \"mean\": %.1f, \"p50\": %u, \"p90\": %u, "
+		"\"p99\": %u, \"p999\": %u, \"max\": %u}", s->count,
+		sum / s->count, PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999),
+		s->ns[s->count - 1]);
+#undef PCT
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	uint32_t sizes[MAX_SIZES] = {1 << 10, 1 << 16}, count_sizes = 2;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's': {
+			char *s = optarg;
+			for (count_sizes = 0; count_sizes < MAX_SIZES && *s;) {
+				sizes[count_sizes++] = strtoul(s, &s, 10);
+				if (*s == ',')
+					s++;
+			}
+			break;
+		}
+		default:
+			fprintf(stderr, "usage: %s [-s size[,size...]]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	struct samples out[COUNT_OPS];
+	for (int o = 0; o < COUNT_OPS; o++) {
+		out[o].ns = malloc(SAMPLES * sizeof(uint32_t));
+		if (out[o].ns == NULL) {
+			fprintf(stderr, "failed to allocate the samples\n");
+			return 1;
+		}
+	}
+	// cost of the timer, the smallest of many back to back reads
+	uint64_t timer = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t start = bench_now_ns();
+		uint64_t d = bench_now_ns() - start;
+		timer = d < timer ? d : timer;
+	}
+
+	printf("{\n  \"timer_ns\": %lu,\n  \"results\": [", timer);
+	const char *backends[] = {"treap", "heap"};
+	int (*runs[])(uint32_t, struct samples *) = {run_treap, run_heap};
+	for (uint32_t s = 0; s < count_sizes; s++) {
+		for (int b = 0; b < 2; b++) {
+			for (int o = 0; o < COUNT_OPS; o++)
+				out[o].count = 0;
+			if (sizes[s] == 0 || runs[b](sizes[s], out) != 0) {
+				fprintf(stderr, "failed to run size %u\n", sizes[s]);
+				return 1;
+			}
+			printf("%s\n    {\"backend\": \"%s\", \"size\": %u",
+				s || b ? "," : "", backends[b], sizes[s]);
+			for (int o = 0; o < COUNT_OPS; o++) {
+				printf(",\n     \"%s\": ", op_names[o]);
+				print_op(&out[o]);
+			}
+			printf("}");
+		}
+	}
+	printf("\n  ]\n}\n");
+	for (int o = 0; o < COUNT_OPS; o++)
+		free(out[o].ns);
+	return 0;
+}
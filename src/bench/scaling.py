@@ -0,0 +1,64 @@
+"""
+Thread scaling of the parallel driver: run ./build/main with an increasing
+number of workers on the same input and report the throughput.
+
+usage: python3 scaling.py [--keys N] [--max-threads T] [--input FILE]
+(run `make` in src first)
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+binary = os.path.join(here, '..', 'build', 'main')
+
+
+def gen_input(path, count_keys):
+    # raw little-endian u32 keys, parsing is not what we measure here
+    with open(path, 'wb') as f:
+        left = count_keys
+        while left > 0:
+            n = min(left, 1 << 20)
+            f.write(os.urandom(4 * n))
+            left -= n
+
+
+def run(path, threads):
+    out = subprocess.run([binary, '-f', 'u32', '-k', '1', '-j', str(threads),
+                          path], check=True, capture_output=True,
+                         text=True).stdout
+    total = float(re.search(r'total:\s+([\d.]+)', out).group(1))
+    merge = float(re.search(r'merge:\s+([\d.]+)', out).group(1))
+    estimate = int(re.search(r'Estimate: (\d+)', out).group(1))
+    return total, merge, estimate
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--keys', type=int, default=100000000)
+    parser.add_argument('--max-threads', type=int, default=os.cpu_count())
+    parser.add_argument('--input', default='/tmp/cvm_scaling.u32')
+    args = parser.parse_args()
+
+    if not os.path.exists(args.input) or \
+            os.path.getsize(args.input) != 4 * args.keys:
+        print('generating', args.input, file=sys.stderr)
+        gen_input(args.input, args.keys)
+
+    threads = 1
+    base = None
+    print('threads  Mkeys/s  speedup  merge_ms  estimate')
+    while True:
+        total, merge, estimate = run(args.input, threads)
+        base = base or total
+        print(f'{threads:7d}  {total:7.2f}  {total / base:7.2f}  '
+              f'{merge:8.3f}  {estimate}')
+        if threads >= args.max_threads:
+            break
+        threads = min(threads * 2, args.max_threads)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,195 @@
+/* Throughput and accuracy of the estimator on generated streams. For every
+ * buffer size the stream is replayed with a number of seeds, each run reports
+ * the cost per element and the error against the exact count. The results are
+ * written as JSON on stdout.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cvm.h"
+#include "../treap/bench/bench.h"
+#include "gen.h"
+
+#define MAX_SIZES 32
+
+// fewer seeds put the 95th percentile on the largest error, the output has
+// no p95 then (null) and the tail is the max
+#define P95_MIN_SEEDS 20
+
+static const char *dist_names[] = {"uniform", "zipf", "unique", "dup"};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n stream_len] [-c cardinality]\n"
+		"       [-d uniform|zipf|unique|dup] [-z exponent]\n"
+		"       [-s size[,size...]] [-r seeds] [-k]\n"
+		"  -n  elements per stream (default: %d)\n"
+		"  -c  number of possible keys of uniform and zipf streams\n"
+		"  -z  exponent of the zipf distribution (default: 1.1)\n"
+		"  -s  buffer sizes, one result per size (default: 1024)\n"
+		"  -r  number of seeds per size (default: %d, the error p95\n"
+		"      needs at least %d)\n"
+		"  -k  hashed priorities instead of random ones\n",
+		prog, 1 << 22, P95_MIN_SEEDS, P95_MIN_SEEDS);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* generate the stream of a seed, return the exact number of distinct keys */
+static uint64_t fill_stream(struct gen *g, cvm_key_t *keys, uint64_t n,
+		uint8_t *seen)
+{
+	uint64_t distinct = 0;
+	memset(seen, 0, (g->cardinality + 7) / 8);
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t r = gen_rank(g);
+		keys[i] = gen_key(r, CVM_KEY_BITS);
+		if (g->dist == GEN_UNIQUE) {
+			distinct++;
+		} else if (!(seen[r / 8] & (1 << (r % 8)))) {
+			seen[r / 8] |= 1 << (r % 8);
+			distinct++;
+		}
+	}
+	return distinct;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	uint64_t n = 1 << 22, cardinality = 1 << 20;
+	enum gen_dist dist = GEN_UNIFORM;
+	double zipf_s = 1.1;
+	uint32_t sizes[MAX_SIZES] = {1024}, count_sizes = 1;
+	uint32_t seeds = P95_MIN_SEEDS;
+	int hashed = 0;
+	while ((opt = getopt(argc, argv, "n:c:d:z:s:r:kh")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			cardinality = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			for (dist = 0; dist <= GEN_DUP; dist++)
+				if (strcmp(optarg, dist_names[dist]) == 0)
+					break;
+			if (dist > GEN_DUP) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'z':
+			zipf_s = strtod(optarg, NULL);
+			break;
+		case 's': {
+			char *s = optarg;
+			for (count_sizes = 0; count_sizes < MAX_SIZES && *s;) {
+				sizes[count_sizes++] = strtoul(s, &s, 10);
+				if (*s == ',')
+					s++;
+			}
+			break;
+		}
+		case 'r':
+			seeds = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			hashed = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (n == 0 || seeds == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	// unique streams have as many ranks as elements
+	if (dist == GEN_UNIQUE)
+		cardinality = n;
+	if (CVM_KEY_BITS == 32 && cardinality > (1ULL << 32)) {
+		fprintf(stderr, "cardinality does not fit 32-bit keys\n");
+		return 1;
+	}
+
+	cvm_key_t *keys = malloc(n * sizeof(cvm_key_t));
+	uint8_t *seen = malloc((cardinality + 7) / 8);
+	double *ns = malloc(seeds * sizeof(double));
+	double *err = malloc(seeds * sizeof(double));
+	if (keys == NULL || seen == NULL || ns == NULL || err == NULL) {
+		fprintf(stderr, "failed to allocate the stream\n");
+		return 1;
+	}
+
+	printf("{\n  \"config\": {\"stream_len\": %lu, \"cardinality\": %lu, "
+		"\"dist\": \"%s\", \"zipf_s\": %g, \"seeds\": %u, "
+		"\"hashed\": %s, \"key_bits\": %d},\n  \"results\": [",
+		n, cardinality, dist_names[dist], zipf_s, seeds,
+		hashed ? "true" : "false", CVM_KEY_BITS);
+	for (uint32_t s = 0; s < count_sizes; s++) {
+		double exact_sum = 0;
+		for (uint32_t r = 0; r < seeds; r++) {
+			struct gen g;
+			if (gen_init(&g, dist, cardinality, zipf_s, r + 1) != 0) {
+				fprintf(stderr, "failed to set up the stream\n");
+				return 1;
+			}
+			uint64_t exact = fill_stream(&g, keys, n, seen);
+			gen_free(&g);
+			struct cvm_impl *c = cvm_new(sizes[s]);
+			if (c == NULL) {
+				fprintf(stderr, "failed to allocate the estimator\n");
+				return 1;
+			}
+			cvm_seed(c, r + 1);
+			if (hashed)
+				cvm_set_hash_priority(c, r + 1);
+			uint64_t start = bench_now_ns();
+			cvm_add_batch(c, keys, n);
+			ns[r] = (double)(bench_now_ns() - start) / n;
+			err[r] = ((double)cvm_estimate(c) - exact) / exact;
+			exact_sum += exact;
+			cvm_destroy(c);
+		}
+
+		double ns_sum = 0, bias = 0, sq = 0;
+		for (uint32_t r = 0; r < seeds; r++) {
+			ns_sum += ns[r];
+			bias += err[r];
+			sq += err[r] * err[r];
+			err[r] = fabs(err[r]);
+		}
+		qsort(ns, seeds, sizeof(double), cmp_double);
+		qsort(err, seeds, sizeof(double), cmp_double);
+		// nearest rank
+		char p95[32] = "null";
+		if (seeds >= P95_MIN_SEEDS)
+			snprintf(p95, sizeof(p95), "%.6f",
+				err[(seeds * 95 + 99) / 100 - 1]);
+		printf("%s\n    {\"buffer_size\": %u, \"exact_mean\": %.1f,\n"
+			"     \"ns_per_element\": {\"mean\": %.3f, \"min\": %.3f, "
+			"\"median\": %.3f},\n"
+			"     \"rel_error\": {\"bias\": %.6f, \"rms\": %.6f, "
+			"\"median\": %.6f, \"p95\": %s, \"max\": %.6f}}",
+			s ? "," : "", sizes[s], exact_sum / seeds,
+			ns_sum / seeds, ns[0], ns[seeds / 2],
+			bias / seeds, sqrt(sq / seeds), err[seeds / 2],
+			p95, err[seeds - 1]);
+	}
+	printf("\n  ]\n}\n");
+	free(keys);
+	free(seen);
+	free(ns);
+	free(err);
+	return 0;
+}
@@ -7,93 +7,1528 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <assert.h>
-#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
-// The buffer size we want to use for CVM (|B| in the Knuth's CVM paper)
-#define TREAP_MAX_SIZE (1 << 10)
-#define TREAP_MAX_HEIGHT 32
+#include "cvm.h"
+#include "fixed_point/fp.h"
+#include "hash/hash.h"
+#include "filter/filter.h"
+
+// the buffer stores the keys as they are
+#define TREAP_KEY_SIZE (CVM_KEY_BITS / 8)
+#define HEAP_KEY_SIZE (CVM_KEY_BITS / 8)
 
+/* The buffer B is a treap, or an indexed heap with a hash map when built with
+ * CVM_BUFFER_HEAP. Both have the same interface, buf_* is the one in use.
+ * */
+#ifdef CVM_BUFFER_HEAP
+#define HEAP_PRIO_BITS FP_BITS
+#include "heap/heap.h"
+#define buf_t struct heap
+#define buf_key_t struct heap_key
+#define buf_node_t struct heap_node
+#define buf_prio_t heap_prio_t
+#define BUF_KEY_SIZE HEAP_KEY_SIZE
+#define BUF_UPSERT_INSERTED HEAP_UPSERT_INSERTED
+#define BUF_UPSERT_ABSENT HEAP_UPSERT_ABSENT
+#define BUF_UPSERT_DELETED HEAP_UPSERT_DELETED
+#define BUF_UPSERT_UPDATED HEAP_UPSERT_UPDATED
+#define buf_new_sized heap_new_sized
+#define buf_destroy heap_destroy
+#define buf_reset heap_reset
+#define buf_top heap_top
+#define buf_priority heap_priority
+#define buf_find heap_find
+#define buf_insert heap_insert
+#define buf_upsert heap_upsert
+#define buf_replace_top heap_replace_top
+#define buf_pop_top heap_pop_top
+#define buf_has_space heap_has_space
+#define buf_export_sorted heap_export_sorted
+#define buf_build_sorted heap_build_sorted
+#define buf_key_less_than heap_key_less_than
+#else
+#ifdef CVM_STATS
+#define TREAP_STATS
+#endif
+#define TREAP_PRIO_BITS FP_BITS
 #include "treap/treap.h"
-#include "fixed_point/fp.h"
+#define buf_t struct treap
+#define buf_key_t struct treap_key
+#define buf_node_t struct treap_node
+#define buf_prio_t treap_prio_t
+#define BUF_KEY_SIZE TREAP_KEY_SIZE
+#define BUF_UPSERT_INSERTED TREAP_UPSERT_INSERTED
+#define BUF_UPSERT_ABSENT TREAP_UPSERT_ABSENT
+#define BUF_UPSERT_DELETED TREAP_UPSERT_DELETED
+#define BUF_UPSERT_UPDATED TREAP_UPSERT_UPDATED
+#define buf_new_sized treap_new_sized
+#define buf_destroy treap_destroy
+#define buf_reset treap_reset
+#define buf_top treap_top
+#define buf_priority treap_priority
+#define buf_find treap_find
+#define buf_insert treap_insert
+#define buf_upsert treap_upsert
+#define buf_replace_top treap_replace_top
+#define buf_pop_top treap_pop_top
+#define buf_has_space treap_has_space
+#define buf_export_sorted treap_export_sorted
+#define buf_build_sorted treap_build_sorted
+#define buf_key_less_than treap_key_less_than
+#endif
 
 struct cvm_impl {
-	struct treap *t;
+	buf_t *t;
 	fp_t p;
+	struct prng rng;
+	uint8_t hashed; // priorities are a hash of the key
+	uint64_t hash_seed;
+	// keys in the buffer, lets an element with u >= p skip the buffer
+	// search when it is surely absent (random priorities only)
+	struct filter members;
+#ifdef CVM_STATS
+	// written on every element, kept off the cache lines of the fields
+	// above (the owner of the sketch is the only writer)
+	uint8_t __pad0[64];
+	struct cvm_stats stats;
+	uint8_t __pad1[64];
+#endif
 };
 
-struct cvm_impl *cvm_new()
+#ifdef CVM_STATS
+#define __cvm_stat(c, field, v) ((c)->stats.field += (v))
+#else
+#define __cvm_stat(c, field, v) do {} while (0)
+#endif
+
+// seed of the hash used by the membership filter
+#define CVM_FILTER_SEED 0x2545f4914f6cdd1dULL
+// seeds of the fingerprints of strings
+#define CVM_FINGERPRINT_SEED 0x6a09e667f3bcc909ULL
+#define CVM_FINGERPRINT_SEED_HI 0xbb67ae8584caa73bULL
+
+static __always_inline uint64_t __cvm_key_hash(cvm_key_t key, uint64_t seed)
+{
+#if CVM_KEY_BITS == 32
+	return hash_u32(key, seed);
+#elif CVM_KEY_BITS == 64
+	return hash_u64(key, seed);
+#else
+	return hash_u128(key, seed);
+#endif
+}
+
+static inline void __cvm_key_hash_batch(const cvm_key_t *keys, size_t n,
+		uint64_t seed, uint64_t *out)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = __cvm_key_hash(keys[i], seed);
+}
+
+static inline uint64_t __cvm_filter_hash(cvm_key_t key)
 {
-	// allocating the CVM struct and treap struct
+	return __cvm_key_hash(key, CVM_FILTER_SEED);
+}
+
+static inline void __cvm_member_add(struct cvm_impl *cvm,
+		const buf_key_t *k)
+{
+	cvm_key_t key;
+	if (cvm->members.c == NULL)
+		return;
+	memcpy(&key, k->data, sizeof(key));
+	filter_add(&cvm->members, __cvm_filter_hash(key));
+}
+
+static inline void __cvm_member_del(struct cvm_impl *cvm,
+		const buf_key_t *k)
+{
+	cvm_key_t key;
+	if (cvm->members.c == NULL)
+		return;
+	memcpy(&key, k->data, sizeof(key));
+	filter_del(&cvm->members, __cvm_filter_hash(key));
+}
+
+// estimators that are not seeded explicitly get distinct streams, derived
+// from the order they were created in
+static uint64_t __cvm_instances;
+
+struct cvm_impl *cvm_new(uint32_t buffer_size)
+{
+	// allocating the CVM struct and the buffer
 	struct cvm_impl *c = calloc(1, sizeof(struct cvm_impl));
 	if (c == NULL) return NULL;
-	c->t = treap_new();
+	c->t = buf_new_sized(buffer_size);
 	if (c->t == NULL) {
 		free(c);
 		return NULL;
 	}
+	if (filter_init(&c->members, buffer_size) != 0) {
+		buf_destroy(c->t);
+		free(c);
+		return NULL;
+	}
 	c->p = FP_ONE;
+	uint64_t n = __atomic_fetch_add(&__cvm_instances, 1, __ATOMIC_RELAXED);
+	prng_seed(&c->rng, prng_splitmix64(&n));
 	return c;
 }
 
-uint64_t cvm_estimate(struct cvm_impl *cvm)
+void cvm_seed(struct cvm_impl *cvm, uint64_t seed)
+{
+	prng_seed(&cvm->rng, seed);
+}
+
+int cvm_set_hash_priority(struct cvm_impl *cvm, uint64_t seed)
 {
-	return (uint64_t)((double)cvm->t->used / fp_to_float(cvm->p));
+	if (cvm->t->used != 0)
+		return -EBUSY;
+	cvm->hashed = 1;
+	cvm->hash_seed = hash_seed(seed);
+	// hashed priorities reject on u >= p alone
+	filter_free(&cvm->members);
+	return 0;
+}
+
+uint32_t cvm_buffer_size(double epsilon, double delta, uint64_t stream_len)
+{
+	if (!(epsilon > 0 && epsilon < 1) || !(delta > 0 && delta < 1) ||
+			stream_len == 0)
+		return 0;
+	double s = ceil(12.0 / (epsilon * epsilon) *
+			log(8.0 * (double)stream_len / delta));
+	if (s > UINT32_MAX)
+		return 0;
+	return (uint32_t)s;
 }
 
-int main(int argc, char *argv[])
+struct cvm_impl *cvm_new_accuracy(double epsilon, double delta,
+		uint64_t stream_len)
+{
+	uint32_t s = cvm_buffer_size(epsilon, delta, stream_len);
+	if (s == 0)
+		return NULL;
+	return cvm_new(s);
+}
+
+void cvm_destroy(struct cvm_impl *cvm)
+{
+	buf_destroy(cvm->t);
+	filter_free(&cvm->members);
+	free(cvm);
+}
+
+void cvm_reset(struct cvm_impl *cvm)
+{
+	buf_reset(cvm->t);
+	if (cvm->members.c != NULL)
+		filter_clear(&cvm->members);
+	cvm->p = FP_ONE;
+}
+
+/* the key is not in the buffer, u < p and |B| = s: keep the s smallest
+ * priorities and lower p to the largest one that does not fit
+ * */
+static inline int __cvm_full(struct cvm_impl *cvm, buf_key_t *k, fp_t u)
+{
+	buf_node_t *top = buf_top(cvm->t);
+	__cvm_stat(cvm, p_reductions, 1);
+	if (u > buf_priority(cvm->t, top)) {
+		__cvm_stat(cvm, rejected, 1);
+		cvm->p = u;
+		return 0;
+	}
+	__cvm_stat(cvm, replace_tops, 1);
+	cvm->p = buf_priority(cvm->t, top);
+	__cvm_member_del(cvm, &top->key);
+	__cvm_member_add(cvm, k);
+	return buf_replace_top(cvm->t, k, u);
+}
+
+static inline int __cvm_step(struct cvm_impl *cvm, cvm_key_t key, fp_t u)
 {
-	srand(time(0));
-	struct cvm_impl *cvm = cvm_new();
 	int ret;
+	buf_key_t k;
+	memcpy(k.data, &key, BUF_KEY_SIZE);
 
-	// read the stream of keys from a file
-	FILE *f = fopen("./test/data.txt", "r");
-	assert(f != NULL);
-	struct treap_key key;
-	/* int line_counter = 0; */
-	while (fscanf(f, "%d", (int *)&key.data) > 0) {
-		/* printf("%d: %d\n", line_counter++, *(int *)key.data); */
-
-		// if we have the element in the buffer, remove it
-		ret = treap_delete(cvm->t, &key);
-		/* if (ret == 0) { */
-		/* 	printf("delete key: %d\n", *(uint32_t *)key.data); */
-		/* } */
-		fp_t u = fp_random();
-		/* printf("rand: %f | %f\n", fp_to_float(u), 1/fp_to_float(u)); */
-		if (u >= cvm->p)
-			continue;
-		if (treap_has_space(cvm->t)) {
-			ret = treap_insert(cvm->t, &key, u);
-			assert(ret == 0);
+	// every buffered priority is below p, a hashed priority at or above p
+	// means the key is not in the buffer and it will not be (the same
+	// test as the mask of cvm_add_batch)
+	if (cvm->hashed && u >= cvm->p) {
+		__cvm_stat(cvm, rejected, 1);
+		__cvm_stat(cvm, filtered, 1);
+		return 0;
+	}
+
+	// search the buffer once: if the element survives sampling (u < p)
+	// it is (re-)inserted with the new priority, otherwise it is removed
+	ret = buf_upsert(cvm->t, &k, u, u < cvm->p);
+	switch (ret) {
+	case BUF_UPSERT_INSERTED:
+		__cvm_stat(cvm, inserts, 1);
+		__cvm_member_add(cvm, &k);
+		return 0;
+	case BUF_UPSERT_DELETED:
+		__cvm_stat(cvm, hits, 1);
+		__cvm_stat(cvm, deletes, 1);
+		__cvm_member_del(cvm, &k);
+		return 0;
+	case BUF_UPSERT_ABSENT:
+		__cvm_stat(cvm, rejected, 1);
+		return 0;
+	case BUF_UPSERT_UPDATED:
+		__cvm_stat(cvm, hits, 1);
+		return 0;
+	case -ENOSPC:
+		return __cvm_full(cvm, &k, u);
+	default:
+		return ret < 0 ? ret : 0;
+	}
+}
+
+static inline fp_t __cvm_hash_to_fp(uint64_t h)
+{
+	return (fp_t)(h >> (64 - FIX_FRACTION_BITS));
+}
+
+int cvm_add(struct cvm_impl *cvm, cvm_key_t key)
+{
+	fp_t u;
+	if (cvm->hashed)
+		u = __cvm_hash_to_fp(__cvm_key_hash(key, cvm->hash_seed));
+	else
+		u = fp_random_r(&cvm->rng);
+	__cvm_stat(cvm, seen, 1);
+	if (!cvm->hashed && u >= cvm->p &&
+			!filter_maybe(&cvm->members, __cvm_filter_hash(key))) {
+		__cvm_stat(cvm, rejected, 1);
+		__cvm_stat(cvm, filtered, 1);
+		return 0;
+	}
+	return __cvm_step(cvm, key, u);
+}
+
+// number of priorities drawn at once by cvm_add_batch
+#define CVM_BATCH 64
+
+static inline void __cvm_priorities(struct cvm_impl *cvm, const cvm_key_t *keys,
+		fp_t *u, size_t n)
+{
+	if (!cvm->hashed) {
+		fp_random_batch(&cvm->rng, u, n);
+		return;
+	}
+	uint64_t h[CVM_BATCH];
+	__cvm_key_hash_batch(keys, n, cvm->hash_seed, h);
+	for (size_t i = 0; i < n; i++)
+		u[i] = __cvm_hash_to_fp(h[i]);
+}
+
+/* bit i is set if u[i] < p (u is padded to CVM_BATCH entries)
+ * */
+static inline uint64_t __cvm_below(const fp_t *u, fp_t p)
+{
+	uint64_t mask = 0;
+#if defined(__AVX512F__) && FP_BITS == 32
+	const __m512i vp = _mm512_set1_epi32(p);
+	for (int i = 0; i < CVM_BATCH; i += 16) {
+		__m512i v = _mm512_loadu_si512((const void *)(u + i));
+		mask |= (uint64_t)_mm512_cmplt_epu32_mask(v, vp) << i;
+	}
+#elif defined(__AVX512F__) && FP_BITS == 64
+	const __m512i vp = _mm512_set1_epi64(p);
+	for (int i = 0; i < CVM_BATCH; i += 8) {
+		__m512i v = _mm512_loadu_si512((const void *)(u + i));
+		mask |= (uint64_t)_mm512_cmplt_epu64_mask(v, vp) << i;
+	}
+#elif defined(__AVX2__) && FP_BITS == 32
+	// no unsigned compare: flip the sign bits and compare signed
+	const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+	const __m256i vp = _mm256_xor_si256(_mm256_set1_epi32(p), sign);
+	for (int i = 0; i < CVM_BATCH; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(u + i));
+		__m256i lt = _mm256_cmpgt_epi32(vp, _mm256_xor_si256(v, sign));
+		mask |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(lt)) << i;
+	}
+#elif defined(__AVX2__) && FP_BITS == 64
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	const __m256i vp = _mm256_xor_si256(_mm256_set1_epi64x(p), sign);
+	for (int i = 0; i < CVM_BATCH; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(u + i));
+		__m256i lt = _mm256_cmpgt_epi64(vp, _mm256_xor_si256(v, sign));
+		mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(lt)) << i;
+	}
+#else
+	for (int i = 0; i < CVM_BATCH; i++)
+		mask |= (uint64_t)(u[i] < p) << i;
+#endif
+	return mask;
+}
+
+// From this buffer size on the treap does not fit the caches: the keys of a
+// block that reach the buffer are first searched with interleaved walks
+// (treap_find_batch), so their paths are in cache when the steps run.
+#ifndef CVM_PREFETCH_MIN
+#define CVM_PREFETCH_MIN (1 << 17)
+#endif
+
+/* pull the paths of the keys selected by `probe` into the cache */
+static inline void __cvm_prefetch_paths(struct cvm_impl *cvm,
+		const cvm_key_t *keys, uint64_t probe)
+{
+#ifndef CVM_BUFFER_HEAP
+	buf_key_t k[CVM_BATCH];
+	size_t w = 0;
+	if (cvm->t->capacity < CVM_PREFETCH_MIN)
+		return;
+	for (; probe != 0; probe &= probe - 1)
+		memcpy(k[w++].data, &keys[__builtin_ctzll(probe)], BUF_KEY_SIZE);
+	treap_prefetch_batch(cvm->t, k, w);
+#else
+	// a heap is not searched
+	(void)cvm;
+	(void)keys;
+	(void)probe;
+#endif
+}
+
+int cvm_add_batch(struct cvm_impl *cvm, const cvm_key_t *keys, size_t n)
+{
+	int ret;
+	fp_t u[CVM_BATCH];
+	uint64_t h[CVM_BATCH];
+	for (size_t i = 0; i < n; i += CVM_BATCH) {
+		size_t m = n - i < CVM_BATCH ? n - i : CVM_BATCH;
+		__cvm_priorities(cvm, keys + i, u, m);
+		for (size_t j = m; j < CVM_BATCH; j++)
+			u[j] = (fp_t)-1;
+		// p only decreases while the block is processed, elements
+		// outside the mask stay at or above it
+		uint64_t mask = __cvm_below(u, cvm->p);
+		__cvm_stat(cvm, seen, m);
+		if (cvm->hashed) {
+			__cvm_stat(cvm, rejected, m - __builtin_popcountll(mask));
+			__cvm_stat(cvm, filtered, m - __builtin_popcountll(mask));
+			__cvm_prefetch_paths(cvm, keys + i, mask);
+			for (; mask != 0; mask &= mask - 1) {
+				size_t j = __builtin_ctzll(mask);
+				ret = __cvm_step(cvm, keys[i + j], u[j]);
+				if (ret != 0)
+					return ret;
+			}
 			continue;
 		}
-		// u < p and |B| = s
-		assert(u < cvm->p);
-		assert(cvm->t->used == TREAP_MAX_SIZE);
-		struct treap_node *top = treap_top(cvm->t);
-		if (u > top->priority) {
-			/* printf("(1) p: %f --> %f\n", fp_to_float(cvm->p), fp_to_float(u)); */
-			cvm->p = u;
+		// with random priorities an element above p is removed if it
+		// is in the buffer, the filter tells which ones to look up.
+		// It is probed in stream order since earlier elements of the
+		// block change it.
+		__cvm_key_hash_batch(keys + i, m, CVM_FILTER_SEED, h);
+#ifndef CVM_BUFFER_HEAP
+		if (cvm->t->capacity >= CVM_PREFETCH_MIN) {
+			// the filter as of the start of the block is close enough
+			// to pick the keys to prefetch
+			uint64_t probe = mask;
+			for (size_t j = 0; j < m; j++)
+				probe |= (uint64_t)filter_maybe(&cvm->members, h[j]) << j;
+			__cvm_prefetch_paths(cvm, keys + i, probe);
+		}
+#endif
+		for (size_t j = 0; j < m; j++) {
+			if (!((mask >> j) & 1) && !filter_maybe(&cvm->members, h[j])) {
+				__cvm_stat(cvm, rejected, 1);
+				__cvm_stat(cvm, filtered, 1);
+				continue;
+			}
+			ret = __cvm_step(cvm, keys[i + j], u[j]);
+			if (ret != 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+cvm_key_t cvm_fingerprint(const void *data, size_t len)
+{
+	cvm_key_t key = hash_bytes(data, len, CVM_FINGERPRINT_SEED);
+#if CVM_KEY_BITS == 128
+	key |= (cvm_key_t)hash_bytes(data, len, CVM_FINGERPRINT_SEED_HI) << 64;
+#endif
+	return key;
+}
+
+int cvm_add_bytes(struct cvm_impl *cvm, const void *data, size_t len)
+{
+	return cvm_add(cvm, cvm_fingerprint(data, len));
+}
+
+/* the k-th smallest of `n` priorities (quickselect, reorders the array) */
+static buf_prio_t __cvm_select(buf_prio_t *a, uint32_t n, uint32_t k)
+{
+	int64_t lo = 0, hi = n - 1;
+	while (lo < hi) {
+		buf_prio_t pivot = a[lo + (hi - lo) / 2];
+		int64_t i = lo, j = hi;
+		while (i <= j) {
+			while (a[i] < pivot)
+				i++;
+			while (a[j] > pivot)
+				j--;
+			if (i <= j) {
+				buf_prio_t tmp = a[i];
+				a[i++] = a[j];
+				a[j--] = tmp;
+			}
+		}
+		// [lo, j] <= pivot, (j, i) == pivot, [i, hi] >= pivot
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			return a[k];
+	}
+	return a[k];
+}
+
+int cvm_merge(struct cvm_impl *dst, struct cvm_impl *src)
+{
+	int ret;
+	if (dst == src)
+		return 0;
+	if (dst->hashed != src->hashed ||
+			(dst->hashed && dst->hash_seed != src->hash_seed))
+		return -EINVAL;
+
+	// Offering every element of src to dst like a stream element with a
+	// fixed priority leaves the elements of both below the smaller p,
+	// with the smaller priority of a key seen by both, and if they do not
+	// fit, the s smallest of them with p lowered to the next priority. The
+	// result is built from both sorted buffers in linear time.
+	uint32_t nd = dst->t->used, ns = src->t->used;
+	buf_key_t *keys = malloc((2 * (size_t)(nd + ns) + 1) * sizeof(buf_key_t));
+	buf_prio_t *prios = malloc((2 * (size_t)(nd + ns) + 1) *
+			sizeof(buf_prio_t));
+	if (keys == NULL || prios == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	// the two exports, followed by the merged sequence
+	buf_key_t *dk = keys, *sk = keys + nd, *mk = keys + nd + ns;
+	buf_prio_t *dp = prios, *sp = prios + nd, *mp = prios + nd + ns;
+	ret = buf_export_sorted(dst->t, dk, dp);
+	if (ret == 0)
+		ret = buf_export_sorted(src->t, sk, sp);
+	if (ret != 0)
+		goto out;
+
+	fp_t p = src->p < dst->p ? src->p : dst->p;
+	uint32_t i = 0, j = 0, m = 0;
+	while (i < nd || j < ns) {
+		fp_t u;
+		if (j == ns || (i < nd && buf_key_less_than(&dk[i], &sk[j]))) {
+			mk[m] = dk[i];
+			u = dp[i++];
+		} else if (i == nd || buf_key_less_than(&sk[j], &dk[i])) {
+			mk[m] = sk[j];
+			u = sp[j++];
+		} else {
+			// in both sketches, keep the smaller priority (they are
+			// equal with hashed priorities)
+			mk[m] = dk[i];
+			u = dp[i] < sp[j] ? dp[i] : sp[j];
+			i++;
+			j++;
+		}
+		if (u < p)
+			mp[m++] = u;
+	}
+
+	uint32_t s = dst->t->capacity;
+	if (m > s) {
+		// the exports are no longer needed, select on a copy there
+		memcpy(dp, mp, m * sizeof(buf_prio_t));
+		p = __cvm_select(dp, m, s);
+		uint32_t below = 0;
+		for (i = 0; i < m; i++)
+			below += mp[i] < p;
+		// ties with the new p fill what is left of the buffer
+		uint32_t ties = s - below, n = 0;
+		for (i = 0; i < m; i++) {
+			if (mp[i] > p || (mp[i] == p && ties == 0))
+				continue;
+			ties -= mp[i] == p;
+			mk[n] = mk[i];
+			mp[n++] = mp[i];
+		}
+		m = n;
+	}
+	dst->p = p;
+	ret = buf_build_sorted(dst->t, mk, mp, m);
+	if (ret != 0)
+		goto out;
+	if (dst->members.c != NULL) {
+		filter_clear(&dst->members);
+		for (i = 0; i < m; i++)
+			__cvm_member_add(dst, &mk[i]);
+	}
+out:
+	free(keys);
+	free(prios);
+	return ret;
+}
+
+int cvm_merge_many(struct cvm_impl **sketches, size_t n)
+{
+	int ret;
+	// pairwise rounds: 0 <- 1, 2 <- 3, ... then 0 <- 2, 4 <- 6, ...
+	for (size_t step = 1; step < n; step *= 2) {
+		for (size_t i = 0; i + step < n; i += 2 * step) {
+			ret = cvm_merge(sketches[i], sketches[i + step]);
+			if (ret != 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Serialized sketch, integers are little-endian and the varints are LEB128:
+ *   "CVM" version key_bits fraction_bits flags (version 1 has no
+ *   fraction_bits, they are 31)
+ *   varint buffer_size, varint p
+ *   hashed:  8 byte hash seed
+ *   random:  prng engine, number of words, the words (8 bytes each)
+ *   varint n, the n keys in increasing order (the first one, then the gaps
+ *   minus one), the n priorities (in the order of the keys)
+ * */
+#define CVM_SER_MAGIC "CVM"
+#define CVM_SER_VERSION 2
+#define CVM_SER_HASHED 1
+// the longest varints of a key and of a priority
+#define CVM_SER_VARINT ((CVM_KEY_BITS + 6) / 7)
+#define CVM_SER_VARINT_FP ((FP_BITS + 6) / 7)
+
+// wide enough for the keys and the priorities
+#if CVM_KEY_BITS > 64
+typedef cvm_key_t __cvm_uint_t;
+#else
+typedef uint64_t __cvm_uint_t;
+#endif
+
+struct __cvm_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	int err;
+};
+
+static inline uint8_t *__cvm_put_varint(uint8_t *o, __cvm_uint_t v)
+{
+	while (v >= 0x80) {
+		*o++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*o++ = (uint8_t)v;
+	return o;
+}
+
+static inline uint8_t *__cvm_put_u64(uint8_t *o, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		*o++ = v >> (8 * i);
+	return o;
+}
+
+/* read a varint of up to `bits` bits */
+static inline __cvm_uint_t __cvm_get_varint(struct __cvm_reader *r,
+		uint32_t bits)
+{
+	__cvm_uint_t v = 0;
+	for (uint32_t shift = 0; shift < bits; shift += 7) {
+		if (r->p == r->end)
+			break;
+		uint8_t b = *r->p++;
+		// the bits that do not fit should be zero
+		if (shift + 7 > bits && (b & 0x7f) >> (bits - shift))
+			break;
+		v |= (__cvm_uint_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return v;
+	}
+	r->err = 1;
+	return 0;
+}
+
+static inline uint64_t __cvm_get_u64(struct __cvm_reader *r)
+{
+	uint64_t v = 0;
+	if (r->end - r->p < 8) {
+		r->err = 1;
+		return 0;
+	}
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t)*r->p++ << (8 * i);
+	return v;
+}
+
+static inline uint8_t __cvm_get_u8(struct __cvm_reader *r)
+{
+	if (r->p == r->end) {
+		r->err = 1;
+		return 0;
+	}
+	return *r->p++;
+}
+
+size_t cvm_serialized_size(struct cvm_impl *cvm)
+{
+	return 8 + 3 * 10 + 8 + 2 + 8 * PRNG_STATE_WORDS +
+		(size_t)cvm->t->used * (CVM_SER_VARINT + CVM_SER_VARINT_FP);
+}
+
+ssize_t cvm_serialize(struct cvm_impl *cvm, void *buf, size_t len)
+{
+	uint32_t n = cvm->t->used;
+	if (len < cvm_serialized_size(cvm))
+		return -ENOSPC;
+	buf_key_t *keys = malloc(n * sizeof(buf_key_t) + 1);
+	buf_prio_t *prios = malloc(n * sizeof(buf_prio_t) + 1);
+	ssize_t ret = -ENOMEM;
+	if (keys == NULL || prios == NULL)
+		goto out;
+	ret = buf_export_sorted(cvm->t, keys, prios);
+	if (ret != 0)
+		goto out;
+
+	uint8_t *o = buf;
+	memcpy(o, CVM_SER_MAGIC, 3);
+	o += 3;
+	*o++ = CVM_SER_VERSION;
+	*o++ = CVM_KEY_BITS;
+	*o++ = FIX_FRACTION_BITS;
+	*o++ = cvm->hashed ? CVM_SER_HASHED : 0;
+	o = __cvm_put_varint(o, cvm->t->capacity);
+	o = __cvm_put_varint(o, cvm->p);
+	if (cvm->hashed) {
+		o = __cvm_put_u64(o, cvm->hash_seed);
+	} else {
+		uint64_t words[PRNG_STATE_WORDS];
+		prng_save(&cvm->rng, words);
+		*o++ = PRNG_ENGINE;
+		*o++ = PRNG_STATE_WORDS;
+		for (uint32_t i = 0; i < PRNG_STATE_WORDS; i++)
+			o = __cvm_put_u64(o, words[i]);
+	}
+	o = __cvm_put_varint(o, n);
+	cvm_key_t prev = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		cvm_key_t key;
+		memcpy(&key, keys[i].data, sizeof(key));
+		o = __cvm_put_varint(o, i == 0 ? key : key - prev - 1);
+		prev = key;
+	}
+	for (uint32_t i = 0; i < n; i++)
+		o = __cvm_put_varint(o, prios[i]);
+	ret = o - (uint8_t *)buf;
+out:
+	free(keys);
+	free(prios);
+	return ret;
+}
+
+struct cvm_impl *cvm_deserialize(const void *buf, size_t len)
+{
+	struct __cvm_reader r = {buf, (const uint8_t *)buf + len, 0};
+	if (len < 6 || memcmp(buf, CVM_SER_MAGIC, 3) != 0)
+		return NULL;
+	r.p += 3;
+	uint8_t version = __cvm_get_u8(&r);
+	if ((version != 1 && version != CVM_SER_VERSION) ||
+			__cvm_get_u8(&r) != CVM_KEY_BITS)
+		return NULL;
+	// the priorities are not converted between fixed point widths
+	uint8_t fraction_bits = version == 1 ? 31 : __cvm_get_u8(&r);
+	if (fraction_bits != FIX_FRACTION_BITS)
+		return NULL;
+	uint8_t flags = __cvm_get_u8(&r);
+	__cvm_uint_t capacity = __cvm_get_varint(&r, 32);
+	__cvm_uint_t p = __cvm_get_varint(&r, FP_BITS);
+	if (r.err || capacity == 0 || capacity > CVM_SER_MAX_CAPACITY ||
+			p == 0 || p > FP_ONE)
+		return NULL;
+
+	// everything up to the keys is read before allocating
+	uint64_t seed = 0, words[256];
+	uint8_t engine = 0, count = 0;
+	if (flags & CVM_SER_HASHED) {
+		seed = __cvm_get_u64(&r);
+	} else {
+		engine = __cvm_get_u8(&r);
+		count = __cvm_get_u8(&r);
+		for (uint32_t i = 0; i < count; i++)
+			words[i] = __cvm_get_u64(&r);
+	}
+	__cvm_uint_t n = __cvm_get_varint(&r, 32);
+	// every key and every priority takes at least one byte
+	if (r.err || n > capacity || n > (size_t)(r.end - r.p) / 2)
+		return NULL;
+
+	struct cvm_impl *cvm = cvm_new(capacity);
+	buf_key_t *keys = NULL;
+	buf_prio_t *prios = NULL;
+	if (cvm == NULL)
+		return NULL;
+	cvm->p = p;
+	if (flags & CVM_SER_HASHED) {
+		cvm->hashed = 1;
+		cvm->hash_seed = seed;
+		filter_free(&cvm->members);
+	} else if (engine == PRNG_ENGINE && count == PRNG_STATE_WORDS) {
+		prng_load(&cvm->rng, words);
+	} else {
+		// written by another generator, only the stream differs
+		prng_seed(&cvm->rng, hash_bytes(words, count * 8, 0));
+	}
+	keys = malloc(n * sizeof(buf_key_t) + 1);
+	prios = malloc(n * sizeof(buf_prio_t) + 1);
+	if (keys == NULL || prios == NULL)
+		goto fail;
+	cvm_key_t key = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		cvm_key_t gap = __cvm_get_varint(&r, CVM_KEY_BITS);
+		if (i > 0) {
+			// the keys are strictly increasing and should not wrap
+			if (gap >= (cvm_key_t)~key)
+				goto fail;
+			gap += key + 1;
+		}
+		key = gap;
+		memcpy(keys[i].data, &key, sizeof(key));
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		__cvm_uint_t u = __cvm_get_varint(&r, FP_BITS);
+		// at most p: a replace-top or a merge with ties can leave
+		// priorities equal to p in the buffer
+		if (u > p)
+			goto fail;
+		prios[i] = u;
+	}
+	if (r.err || r.p != r.end || buf_build_sorted(cvm->t, keys, prios, n) != 0)
+		goto fail;
+	for (uint32_t i = 0; i < n; i++)
+		__cvm_member_add(cvm, &keys[i]);
+	free(keys);
+	free(prios);
+	return cvm;
+fail:
+	free(keys);
+	free(prios);
+	cvm_destroy(cvm);
+	return NULL;
+}
+
+/* A sketch shared by many producer threads. The sketch itself is only touched
+ * under the lock, `p` and `estimate` are copies published after every flush
+ * so they can be read without taking it.
+ * */
+struct cvm_shared {
+	pthread_mutex_t lock;
+	struct cvm_impl *cvm;
+	fp_t p;
+	uint64_t estimate;
+};
+
+// number of candidates a producer stages before taking the lock
+#define CVM_STAGE 256
+
+struct cvm_producer {
+	struct cvm_shared *s;
+	// p at the last flush. p never grows, so filtering with an old value
+	// only lets more candidates through, they are checked again under the
+	// lock
+	fp_t p;
+	uint32_t n;
+	cvm_key_t keys[CVM_STAGE];
+	fp_t u[CVM_STAGE];
+#ifdef CVM_STATS
+	// counters of the elements dropped before the lock, added to the
+	// shared sketch on flush (a producer lives on one thread)
+	uint8_t __pad0[64];
+	struct cvm_stats stats;
+	uint8_t __pad1[64];
+#endif
+};
+
+struct cvm_shared *cvm_shared_new(uint32_t buffer_size, uint64_t hash_seed)
+{
+	struct cvm_shared *s = calloc(1, sizeof(struct cvm_shared));
+	if (s == NULL)
+		return NULL;
+	s->cvm = cvm_new(buffer_size);
+	if (s->cvm == NULL) {
+		free(s);
+		return NULL;
+	}
+	cvm_set_hash_priority(s->cvm, hash_seed);
+	pthread_mutex_init(&s->lock, NULL);
+	s->p = s->cvm->p;
+	return s;
+}
+
+void cvm_shared_destroy(struct cvm_shared *s)
+{
+	pthread_mutex_destroy(&s->lock);
+	cvm_destroy(s->cvm);
+	free(s);
+}
+
+struct cvm_producer *cvm_producer_new(struct cvm_shared *s)
+{
+	struct cvm_producer *w = calloc(1, sizeof(struct cvm_producer));
+	if (w == NULL)
+		return NULL;
+	w->s = s;
+	w->p = __atomic_load_n(&s->p, __ATOMIC_RELAXED);
+	return w;
+}
+
+int cvm_producer_flush(struct cvm_producer *w)
+{
+	int ret = 0;
+	struct cvm_shared *s = w->s;
+	pthread_mutex_lock(&s->lock);
+#ifdef CVM_STATS
+	s->cvm->stats.seen += w->stats.seen;
+	s->cvm->stats.rejected += w->stats.rejected;
+	s->cvm->stats.filtered += w->stats.filtered;
+	memset(&w->stats, 0, sizeof(w->stats));
+#endif
+	for (uint32_t i = 0; i < w->n; i++) {
+		ret = __cvm_step(s->cvm, w->keys[i], w->u[i]);
+		if (ret != 0)
+			break;
+	}
+	__atomic_store_n(&s->p, s->cvm->p, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->estimate, cvm_estimate(s->cvm), __ATOMIC_RELAXED);
+	w->p = s->cvm->p;
+	pthread_mutex_unlock(&s->lock);
+	w->n = 0;
+	return ret;
+}
+
+void cvm_producer_destroy(struct cvm_producer *w)
+{
+	cvm_producer_flush(w);
+	free(w);
+}
+
+static inline int __cvm_stage(struct cvm_producer *w, cvm_key_t key, fp_t u)
+{
+	// hashed priorities: a key with u >= p is not in the buffer and will
+	// never be, no need to look at the shared sketch
+	if (u >= w->p) {
+		__cvm_stat(w, rejected, 1);
+		__cvm_stat(w, filtered, 1);
+		return 0;
+	}
+	w->keys[w->n] = key;
+	w->u[w->n] = u;
+	w->n++;
+	if (w->n == CVM_STAGE)
+		return cvm_producer_flush(w);
+	return 0;
+}
+
+int cvm_producer_add(struct cvm_producer *w, cvm_key_t key)
+{
+	fp_t u = __cvm_hash_to_fp(__cvm_key_hash(key, w->s->cvm->hash_seed));
+	__cvm_stat(w, seen, 1);
+	return __cvm_stage(w, key, u);
+}
+
+int cvm_producer_add_batch(struct cvm_producer *w, const cvm_key_t *keys,
+		size_t n)
+{
+	int ret;
+	fp_t u[CVM_BATCH];
+	__cvm_stat(w, seen, n);
+	for (size_t i = 0; i < n; i += CVM_BATCH) {
+		size_t m = n - i < CVM_BATCH ? n - i : CVM_BATCH;
+		__cvm_priorities(w->s->cvm, keys + i, u, m);
+		for (size_t j = 0; j < m; j++) {
+			ret = __cvm_stage(w, keys[i + j], u[j]);
+			if (ret != 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+uint64_t cvm_shared_estimate(struct cvm_shared *s)
+{
+	return __atomic_load_n(&s->estimate, __ATOMIC_RELAXED);
+}
+
+int cvm_get_stats(struct cvm_impl *cvm, struct cvm_stats *out)
+{
+#ifdef CVM_STATS
+	*out = cvm->stats;
+#if !defined(CVM_BUFFER_HEAP)
+	out->searches = cvm->t->stats.searches;
+	out->search_steps = cvm->t->stats.search_steps;
+	out->split_steps = cvm->t->stats.split_steps;
+	out->merge_steps = cvm->t->stats.merge_steps;
+	out->max_depth = cvm->t->stats.max_depth;
+	out->height_bound = treap_height_bound(cvm->t->capacity);
+#endif
+	return 0;
+#else
+	(void)cvm;
+	(void)out;
+	return -ENOTSUP;
+#endif
+}
+
+int cvm_shared_get_stats(struct cvm_shared *s, struct cvm_stats *out)
+{
+	pthread_mutex_lock(&s->lock);
+	int ret = cvm_get_stats(s->cvm, out);
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+uint64_t cvm_estimate(struct cvm_impl *cvm)
+{
+	return fp_int_div(cvm->t->used, cvm->p);
+}
+
+uint32_t cvm_buffer_used(struct cvm_impl *cvm)
+{
+	return cvm->t->used;
+}
+
+double cvm_probability(struct cvm_impl *cvm)
+{
+	return fp_to_float(cvm->p);
+}
+
+/* A table of sketches, one per group. A group starts as an exact set of its
+ * keys, inline in its entry, then in blocks from per size slabs, and becomes
+ * a full CVM estimator when the set reaches the buffer size. Removed groups
+ * give their blocks and estimators back to free lists for the next groups.
+ * */
+enum {
+	CVM_GROUP_EMPTY = 0, // free slot of the table
+	CVM_GROUP_INLINE,
+	CVM_GROUP_SET,
+	CVM_GROUP_FULL,
+};
+
+// keys that fit in the entry itself
+#define CVM_TABLE_INLINE (16 / sizeof(cvm_key_t))
+// the slabs blocks are carved from
+#define CVM_SLAB_BYTES (64 * 1024)
+// a set of 2^k keys, up to 2^31
+#define CVM_TABLE_CLASSES 32
+#define CVM_TABLE_SEED 0x510e527fade682d1ULL
+
+struct cvm_group {
+	uint64_t id;
+	uint32_t n; // number of keys in the exact set
+	uint8_t kind;
+	uint8_t log2cap; // capacity of the set block
+	union {
+		cvm_key_t inl[CVM_TABLE_INLINE];
+		cvm_key_t *set; // sorted
+		struct cvm_impl *cvm;
+	};
+};
+_Static_assert(sizeof(struct cvm_group) == 32, "a group entry should stay small");
+
+struct cvm_table {
+	uint32_t buffer_size;
+	uint64_t mask; // slots - 1
+	uint64_t count; // groups in the table
+	struct cvm_group *slots;
+	// free blocks of each size class (the first word links them)
+	void *free_blocks[CVM_TABLE_CLASSES];
+	void *slabs; // every slab starts with a link to the previous one
+	uint8_t *slab_cur; // unused part of the newest slab
+	size_t slab_left;
+	// estimators of removed groups
+	struct cvm_impl **free_cvm;
+	uint32_t free_cvm_count;
+	uint32_t free_cvm_size;
+};
+
+#define CVM_TABLE_MIN_SLOTS 64
+
+struct cvm_table *cvm_table_new(uint32_t buffer_size)
+{
+	if (buffer_size == 0)
+		return NULL;
+	struct cvm_table *tb = calloc(1, sizeof(struct cvm_table));
+	if (tb == NULL)
+		return NULL;
+	tb->buffer_size = buffer_size;
+	tb->mask = CVM_TABLE_MIN_SLOTS - 1;
+	tb->slots = calloc(CVM_TABLE_MIN_SLOTS, sizeof(struct cvm_group));
+	if (tb->slots == NULL) {
+		free(tb);
+		return NULL;
+	}
+	return tb;
+}
+
+void cvm_table_destroy(struct cvm_table *tb)
+{
+	for (uint64_t i = 0; i <= tb->mask; i++)
+		if (tb->slots[i].kind == CVM_GROUP_FULL)
+			cvm_destroy(tb->slots[i].cvm);
+	for (uint32_t i = 0; i < tb->free_cvm_count; i++)
+		cvm_destroy(tb->free_cvm[i]);
+	while (tb->slabs != NULL) {
+		void *prev = *(void **)tb->slabs;
+		free(tb->slabs);
+		tb->slabs = prev;
+	}
+	free(tb->free_cvm);
+	free(tb->slots);
+	free(tb);
+}
+
+static void *__cvm_block_alloc(struct cvm_table *tb, uint8_t log2cap)
+{
+	void *b = tb->free_blocks[log2cap];
+	if (b != NULL) {
+		tb->free_blocks[log2cap] = *(void **)b;
+		return b;
+	}
+	size_t sz = sizeof(cvm_key_t) << log2cap;
+	if (tb->slab_left < sz) {
+		// the rest of the old slab is lost, it is smaller than a block
+		size_t slab = sz + 16 > CVM_SLAB_BYTES ? sz + 16 : CVM_SLAB_BYTES;
+		uint8_t *s = malloc(slab);
+		if (s == NULL)
+			return NULL;
+		*(void **)s = tb->slabs;
+		tb->slabs = s;
+		tb->slab_cur = s + 16;
+		tb->slab_left = slab - 16;
+	}
+	b = tb->slab_cur;
+	tb->slab_cur += sz;
+	tb->slab_left -= sz;
+	return b;
+}
+
+static void __cvm_block_free(struct cvm_table *tb, void *b, uint8_t log2cap)
+{
+	*(void **)b = tb->free_blocks[log2cap];
+	tb->free_blocks[log2cap] = b;
+}
+
+static inline uint64_t __cvm_group_home(struct cvm_table *tb, uint64_t id)
+{
+	return hash_u64(id, CVM_TABLE_SEED) & tb->mask;
+}
+
+/* the slot of the group, or the empty slot where it would go */
+static inline struct cvm_group *__cvm_table_slot(struct cvm_table *tb,
+		uint64_t id)
+{
+	uint64_t i = __cvm_group_home(tb, id);
+	for (;;) {
+		struct cvm_group *g = &tb->slots[i];
+		if (g->kind == CVM_GROUP_EMPTY || g->id == id)
+			return g;
+		i = (i + 1) & tb->mask;
+	}
+}
+
+static int __cvm_table_grow(struct cvm_table *tb)
+{
+	uint64_t old_mask = tb->mask;
+	struct cvm_group *old = tb->slots;
+	tb->slots = calloc((old_mask + 1) * 2, sizeof(struct cvm_group));
+	if (tb->slots == NULL) {
+		tb->slots = old;
+		return -ENOMEM;
+	}
+	tb->mask = old_mask * 2 + 1;
+	for (uint64_t i = 0; i <= old_mask; i++)
+		if (old[i].kind != CVM_GROUP_EMPTY)
+			*__cvm_table_slot(tb, old[i].id) = old[i];
+	free(old);
+	return 0;
+}
+
+/* the exact set is full: replay it in an estimator */
+static int __cvm_group_promote(struct cvm_table *tb, struct cvm_group *g,
+		const cvm_key_t *keys)
+{
+	struct cvm_impl *c;
+	if (tb->free_cvm_count > 0) {
+		c = tb->free_cvm[--tb->free_cvm_count];
+	} else {
+		c = cvm_new(tb->buffer_size);
+		if (c == NULL)
+			return -ENOMEM;
+	}
+	int ret = cvm_add_batch(c, keys, g->n);
+	if (ret != 0) {
+		cvm_destroy(c);
+		return ret;
+	}
+	if (g->kind == CVM_GROUP_SET)
+		__cvm_block_free(tb, g->set, g->log2cap);
+	g->kind = CVM_GROUP_FULL;
+	g->cvm = c;
+	return 0;
+}
+
+/* position of the first key >= key in the sorted set */
+static inline uint32_t __cvm_set_lower(const cvm_key_t *set, uint32_t n,
+		cvm_key_t key)
+{
+	uint32_t lo = 0;
+	while (n > 0) {
+		uint32_t half = n / 2;
+		if (set[lo + half] < key) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+int cvm_table_add(struct cvm_table *tb, uint64_t group, cvm_key_t key)
+{
+	int ret;
+	struct cvm_group *g = __cvm_table_slot(tb, group);
+	if (g->kind == CVM_GROUP_EMPTY) {
+		// keep the load under 1/2
+		if (2 * (tb->count + 1) > tb->mask + 1) {
+			ret = __cvm_table_grow(tb);
+			if (ret != 0)
+				return ret;
+			g = __cvm_table_slot(tb, group);
+		}
+		memset(g, 0, sizeof(*g));
+		g->id = group;
+		g->kind = CVM_GROUP_INLINE;
+		tb->count++;
+	}
+
+	if (g->kind == CVM_GROUP_FULL)
+		return cvm_add(g->cvm, key);
+
+	if (g->kind == CVM_GROUP_INLINE) {
+		for (uint32_t i = 0; i < g->n; i++)
+			if (g->inl[i] == key)
+				return 0;
+		if (g->n < CVM_TABLE_INLINE && g->n < tb->buffer_size) {
+			g->inl[g->n++] = key;
+			return 0;
+		}
+		cvm_key_t keys[CVM_TABLE_INLINE + 1];
+		memcpy(keys, g->inl, g->n * sizeof(cvm_key_t));
+		keys[g->n] = key;
+		if (g->n >= tb->buffer_size) {
+			g->n++;
+			return __cvm_group_promote(tb, g, keys);
+		}
+		// move to a sorted block twice as large
+		uint8_t log2cap = __builtin_ctz(CVM_TABLE_INLINE) + 1;
+		cvm_key_t *set = __cvm_block_alloc(tb, log2cap);
+		if (set == NULL)
+			return -ENOMEM;
+		uint32_t n = 0;
+		for (uint32_t i = 0; i <= g->n; i++) {
+			uint32_t pos = __cvm_set_lower(set, n, keys[i]);
+			memmove(set + pos + 1, set + pos, (n - pos) * sizeof(cvm_key_t));
+			set[pos] = keys[i];
+			n++;
+		}
+		g->kind = CVM_GROUP_SET;
+		g->set = set;
+		g->log2cap = log2cap;
+		g->n = n;
+		return 0;
+	}
+
+	uint32_t pos = __cvm_set_lower(g->set, g->n, key);
+	if (pos < g->n && g->set[pos] == key)
+		return 0;
+	if (g->n >= tb->buffer_size) {
+		// the set of the buffer size is the state of an estimator that
+		// has not sampled yet, the new key is replayed last
+		ret = __cvm_group_promote(tb, g, g->set);
+		return ret != 0 ? ret : cvm_add(g->cvm, key);
+	}
+	if (g->n == (1U << g->log2cap)) {
+		cvm_key_t *set = __cvm_block_alloc(tb, g->log2cap + 1);
+		if (set == NULL)
+			return -ENOMEM;
+		memcpy(set, g->set, g->n * sizeof(cvm_key_t));
+		__cvm_block_free(tb, g->set, g->log2cap);
+		g->set = set;
+		g->log2cap++;
+	}
+	memmove(g->set + pos + 1, g->set + pos, (g->n - pos) * sizeof(cvm_key_t));
+	g->set[pos] = key;
+	g->n++;
+	return 0;
+}
+
+static inline uint64_t __cvm_group_estimate(struct cvm_group *g)
+{
+	switch (g->kind) {
+	case CVM_GROUP_FULL:
+		return cvm_estimate(g->cvm);
+	case CVM_GROUP_EMPTY:
+		return 0;
+	default:
+		return g->n;
+	}
+}
+
+uint64_t cvm_table_estimate(struct cvm_table *tb, uint64_t group)
+{
+	return __cvm_group_estimate(__cvm_table_slot(tb, group));
+}
+
+int cvm_table_remove(struct cvm_table *tb, uint64_t group)
+{
+	struct cvm_group *g = __cvm_table_slot(tb, group);
+	if (g->kind == CVM_GROUP_EMPTY)
+		return -ENOENT;
+	if (g->kind == CVM_GROUP_SET) {
+		__cvm_block_free(tb, g->set, g->log2cap);
+	} else if (g->kind == CVM_GROUP_FULL) {
+		if (tb->free_cvm_count == tb->free_cvm_size) {
+			uint32_t sz = tb->free_cvm_size ? 2 * tb->free_cvm_size : 16;
+			void *a = realloc(tb->free_cvm, sz * sizeof(*tb->free_cvm));
+			if (a == NULL) {
+				cvm_destroy(g->cvm);
+				goto unlink;
+			}
+			tb->free_cvm = a;
+			tb->free_cvm_size = sz;
+		}
+		cvm_reset(g->cvm);
+		tb->free_cvm[tb->free_cvm_count++] = g->cvm;
+	}
+unlink:
+	// shift the following entries of the probe run back
+	g->kind = CVM_GROUP_EMPTY;
+	uint64_t hole = g - tb->slots;
+	uint64_t i = (hole + 1) & tb->mask;
+	while (tb->slots[i].kind != CVM_GROUP_EMPTY) {
+		uint64_t home = __cvm_group_home(tb, tb->slots[i].id);
+		// move it if the hole is between its home and its slot
+		if (((i - home) & tb->mask) >= ((i - hole) & tb->mask)) {
+			tb->slots[hole] = tb->slots[i];
+			tb->slots[i].kind = CVM_GROUP_EMPTY;
+			hole = i;
+		}
+		i = (i + 1) & tb->mask;
+	}
+	tb->count--;
+	return 0;
+}
+
+uint64_t cvm_table_groups(struct cvm_table *tb)
+{
+	return tb->count;
+}
+
+void cvm_table_foreach(struct cvm_table *tb,
+		void (*fn)(uint64_t group, uint64_t estimate, void *arg),
+		void *arg)
+{
+	for (uint64_t i = 0; i <= tb->mask; i++) {
+		struct cvm_group *g = &tb->slots[i];
+		if (g->kind != CVM_GROUP_EMPTY)
+			fn(g->id, __cvm_group_estimate(g), arg);
+	}
+}
+
+/* A sliding window of `intervals` sketches with hashed priorities, so that
+ * merging them gives the sketch of the union of their streams. The intervals
+ * are kept as two stacks: the oldest ones (the front) are stored with the
+ * merge of every newer front interval (their suffix), the ones after them
+ * (the back) are merged in a single sketch as they close. A query merges the
+ * oldest suffix, the back and the live interval. When the front runs out the
+ * back becomes the front, its suffixes are rebuilt once every `intervals`
+ * advances.
+ * */
+struct cvm_window {
+	uint32_t k;
+	// sequence number of the live interval, the front is [f0, f1) and the
+	// back is [f1, live)
+	uint64_t live;
+	uint64_t f0;
+	uint64_t f1;
+	struct cvm_impl **slots; // the stream of each interval (ring)
+	struct cvm_impl **suffix; // merge of the front from an interval (ring)
+	struct cvm_impl *back;
+	// merge of the front and the back (valid until the next advance), and
+	// the result of the last query
+	struct cvm_impl *base;
+	uint8_t base_valid;
+	struct cvm_impl *scratch;
+};
+
+static struct cvm_impl *__cvm_window_sketch(uint32_t buffer_size,
+		uint64_t hash_seed)
+{
+	struct cvm_impl *c = cvm_new(buffer_size);
+	if (c != NULL)
+		cvm_set_hash_priority(c, hash_seed);
+	return c;
+}
+
+/* dst = src (both are sketches of the window) */
+static inline int __cvm_window_copy(struct cvm_impl *dst, struct cvm_impl *src)
+{
+	cvm_reset(dst);
+	return cvm_merge(dst, src);
+}
+
+struct cvm_window *cvm_window_new(uint32_t buffer_size, uint32_t intervals,
+		uint64_t hash_seed)
+{
+	if (buffer_size == 0 || intervals == 0)
+		return NULL;
+	struct cvm_window *w = calloc(1, sizeof(struct cvm_window));
+	if (w == NULL)
+		return NULL;
+	w->k = intervals;
+	w->slots = calloc(intervals, sizeof(struct cvm_impl *));
+	w->suffix = calloc(intervals, sizeof(struct cvm_impl *));
+	if (w->slots == NULL || w->suffix == NULL)
+		goto fail;
+	for (uint32_t i = 0; i < intervals; i++) {
+		w->slots[i] = __cvm_window_sketch(buffer_size, hash_seed);
+		w->suffix[i] = __cvm_window_sketch(buffer_size, hash_seed);
+		if (w->slots[i] == NULL || w->suffix[i] == NULL)
+			goto fail;
+	}
+	w->back = __cvm_window_sketch(buffer_size, hash_seed);
+	w->base = __cvm_window_sketch(buffer_size, hash_seed);
+	w->scratch = __cvm_window_sketch(buffer_size, hash_seed);
+	if (w->back == NULL || w->base == NULL || w->scratch == NULL)
+		goto fail;
+	return w;
+fail:
+	cvm_window_destroy(w);
+	return NULL;
+}
+
+void cvm_window_destroy(struct cvm_window *w)
+{
+	for (uint32_t i = 0; i < w->k; i++) {
+		if (w->slots != NULL && w->slots[i] != NULL)
+			cvm_destroy(w->slots[i]);
+		if (w->suffix != NULL && w->suffix[i] != NULL)
+			cvm_destroy(w->suffix[i]);
+	}
+	if (w->back != NULL)
+		cvm_destroy(w->back);
+	if (w->base != NULL)
+		cvm_destroy(w->base);
+	if (w->scratch != NULL)
+		cvm_destroy(w->scratch);
+	free(w->slots);
+	free(w->suffix);
+	free(w);
+}
+
+int cvm_window_add(struct cvm_window *w, cvm_key_t key)
+{
+	return cvm_add(w->slots[w->live % w->k], key);
+}
+
+int cvm_window_add_batch(struct cvm_window *w, const cvm_key_t *keys, size_t n)
+{
+	return cvm_add_batch(w->slots[w->live % w->k], keys, n);
+}
+
+/* the back becomes the front: suffix[i] = slots[i] + ... + slots[live - 1] */
+static int __cvm_window_flip(struct cvm_window *w)
+{
+	int ret;
+	for (uint64_t i = w->live; i-- > w->f1;) {
+		struct cvm_impl *s = w->suffix[i % w->k];
+		if (i + 1 == w->live) {
+			ret = __cvm_window_copy(s, w->slots[i % w->k]);
 		} else {
-			/* printf("(2) p: %f --> %f\n", fp_to_float(cvm->p), fp_to_float(top->priority)); */
-			cvm->p = top->priority;
-			// TODO: I may be able to implement a better node replace code than remove and add
-			/* printf("old top key: %d (%f)\n", *(uint32_t *)&top->key, fp_to_float(top->priority)); */
-			/* top->priority = u; */
-			/* memcpy(top->key.data, key.data, TREAP_KEY_SIZE); */
-			/* printf("new top key: %d (%f)\n", *(uint32_t *)&top->key, fp_to_float(top->priority)); */
-
-			ret = treap_delete(cvm->t, &top->key);
-			assert(ret == 0);
-			ret = treap_insert(cvm->t, &key, u);
-			if (ret == -2)
-				printf("height issue: %d\n", ret);
-			assert(ret == 0);
-		}
-	}
-	printf("|B|: %d   p: %f\n", cvm->t->used, fp_to_float(cvm->p));
-	printf("Estimate: %ld\n", cvm_estimate(cvm));
+			ret = __cvm_window_copy(s, w->suffix[(i + 1) % w->k]);
+			if (ret == 0)
+				ret = cvm_merge(s, w->slots[i % w->k]);
+		}
+		if (ret != 0)
+			return ret;
+	}
+	w->f1 = w->live;
+	cvm_reset(w->back);
+	return 0;
+}
+
+int cvm_window_advance(struct cvm_window *w)
+{
+	int ret = cvm_merge(w->back, w->slots[w->live % w->k]);
+	if (ret != 0)
+		return ret;
+	w->live++;
+	w->base_valid = 0;
+	if (w->live < w->k)
+		return 0;
+	// the oldest interval leaves the window, its slot takes the live one
+	if (w->f0 == w->f1) {
+		ret = __cvm_window_flip(w);
+		if (ret != 0)
+			return ret;
+	}
+	w->f0++;
+	cvm_reset(w->slots[w->live % w->k]);
+	return 0;
+}
+
+int cvm_window_estimate(struct cvm_window *w, uint64_t *out)
+{
+	int ret;
+	if (!w->base_valid) {
+		cvm_reset(w->base);
+		if (w->f0 < w->f1) {
+			ret = cvm_merge(w->base, w->suffix[w->f0 % w->k]);
+			if (ret != 0)
+				return ret;
+		}
+		ret = cvm_merge(w->base, w->back);
+		if (ret != 0)
+			return ret;
+		w->base_valid = 1;
+	}
+	struct cvm_impl *live = w->slots[w->live % w->k];
+	if (live->t->used == 0) {
+		*out = cvm_estimate(w->base);
+		return 0;
+	}
+	ret = __cvm_window_copy(w->scratch, w->base);
+	if (ret == 0)
+		ret = cvm_merge(w->scratch, live);
+	if (ret != 0)
+		return ret;
+	*out = cvm_estimate(w->scratch);
 	return 0;
 }
@@ -0,0 +1,221 @@
+#pragma once
+/* A streaming API for the CVM distinct elements estimator.
+ *
+ * The estimator keeps a buffer of at most `buffer_size` keys (|B| in the
+ * Knuth's CVM note). Adding a key does no allocation and no I/O, so it can be
+ * called inline on the ingestion path.
+ *
+ * @author: Farbod Shahinfar
+ * @date: March, 2025
+ * */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CVM_API __attribute__((visibility("default")))
+
+// Width of the keys: 32, 64 or 128 bits. The library and the code using it
+// should be built with the same value (make KEY_BITS=64).
+#ifndef CVM_KEY_BITS
+#define CVM_KEY_BITS 32
+#endif
+#if CVM_KEY_BITS == 32
+typedef uint32_t cvm_key_t;
+#elif CVM_KEY_BITS == 64
+typedef uint64_t cvm_key_t;
+#elif CVM_KEY_BITS == 128
+typedef unsigned __int128 cvm_key_t;
+#else
+#error "CVM_KEY_BITS should be 32, 64 or 128"
+#endif
+
+struct cvm_impl;
+struct cvm_shared;
+struct cvm_producer;
+struct cvm_table;
+struct cvm_window;
+
+/* allocate an estimator with a buffer of `buffer_size` keys (returns NULL on
+ * failure or if the size is zero)
+ * */
+CVM_API struct cvm_impl *cvm_new(uint32_t buffer_size);
+
+/* The buffer size needed for an estimate within a factor of (1 +- epsilon)
+ * with probability at least 1 - delta on a stream of up to `stream_len`
+ * elements: s = ceil(12 / epsilon^2 * ln(8 m / delta)), the bound quoted in
+ * Knuth's CVM note. Returns zero for invalid arguments.
+ * */
+CVM_API uint32_t cvm_buffer_size(double epsilon, double delta, uint64_t stream_len);
+/* allocate an estimator sized with cvm_buffer_size() */
+CVM_API struct cvm_impl *cvm_new_accuracy(double epsilon, double delta,
+		uint64_t stream_len);
+CVM_API void cvm_destroy(struct cvm_impl *cvm);
+
+/* restart the random stream of the estimator from `seed` (estimators start
+ * with distinct streams that depend on the order they were created in)
+ * */
+CVM_API void cvm_seed(struct cvm_impl *cvm, uint64_t seed);
+
+/* Derive the priority of each element from a seeded hash of its key instead
+ * of a random draw. Sampling becomes deterministic per key: replays give the
+ * same estimate, sketches with the same seed can be merged and a duplicate
+ * whose priority is unchanged costs a single search. Only allowed on an
+ * empty estimator (-EBUSY otherwise).
+ * */
+CVM_API int cvm_set_hash_priority(struct cvm_impl *cvm, uint64_t seed);
+
+/* forget every element seen so far */
+CVM_API void cvm_reset(struct cvm_impl *cvm);
+
+/* feed one element of the stream (returns zero on success) */
+CVM_API int cvm_add(struct cvm_impl *cvm, cvm_key_t key);
+/* feed `n` elements of the stream, stops at the first error */
+CVM_API int cvm_add_batch(struct cvm_impl *cvm, const cvm_key_t *keys, size_t n);
+
+/* Key of a variable length element (a URL, a name, ...): a fingerprint of
+ * its bytes as wide as the key. Two of n distinct strings collide with
+ * probability about n^2 / 2^(CVM_KEY_BITS + 1), so use 64 or 128-bit keys
+ * for large streams of strings.
+ * */
+CVM_API cvm_key_t cvm_fingerprint(const void *data, size_t len);
+/* cvm_add() of the fingerprint */
+CVM_API int cvm_add_bytes(struct cvm_impl *cvm, const void *data, size_t len);
+
+/* Merge the sketch `src` into `dst` so that `dst` estimates the union of both
+ * streams. The buffer sizes may differ, `dst` keeps its own. Sketches with
+ * hashed priorities need the same seed (-EINVAL otherwise) and then the
+ * result is the same as one sketch that saw both streams, however the stream
+ * was split. With random priorities a key seen by both sketches has two
+ * independent chances to be sampled, so the streams should be partitioned by
+ * key (e.g. key % workers) for the estimate to stay unbiased. The merge runs
+ * over the buffers in key order: linear with the treap, O(n log n) with the
+ * heap buffer (BUFFER=heap) that sorts its keys first.
+ * */
+CVM_API int cvm_merge(struct cvm_impl *dst, struct cvm_impl *src);
+/* Merge `n` sketches into sketches[0] with a tree reduction (the other
+ * sketches are used as intermediate results and left modified)
+ * */
+CVM_API int cvm_merge_many(struct cvm_impl **sketches, size_t n);
+
+/* Checkpoint of a sketch in a compact, versioned binary format: the sampling
+ * state, the random stream and the buffered keys (sorted and delta encoded)
+ * with their priorities. cvm_serialized_size() is an upper bound of the
+ * size, cvm_serialize() returns the number of bytes written (-ENOSPC if `len`
+ * is below the bound).
+ * */
+CVM_API size_t cvm_serialized_size(struct cvm_impl *cvm);
+CVM_API ssize_t cvm_serialize(struct cvm_impl *cvm, void *buf, size_t len);
+/* Rebuild a sketch from cvm_serialize() in linear time, it continues the
+ * stream as the original one would. Returns NULL if the data is invalid, was
+ * written with other key widths or has a buffer larger than
+ * CVM_SER_MAX_CAPACITY (the image sets the size of the allocation, so it is
+ * bounded for untrusted input).
+ * */
+#ifndef CVM_SER_MAX_CAPACITY
+#define CVM_SER_MAX_CAPACITY (1U << 22)
+#endif
+CVM_API struct cvm_impl *cvm_deserialize(const void *buf, size_t len);
+
+/* estimated number of distinct elements seen so far */
+CVM_API uint64_t cvm_estimate(struct cvm_impl *cvm);
+
+/* A sketch fed by many threads. It always uses hashed priorities (with the
+ * given seed): an element whose priority is above p can not be in the buffer,
+ * so producers drop most of the stream without touching shared state. Each
+ * thread feeds the sketch through its own producer, which stages the
+ * survivors and inserts them in batches under a short lock.
+ * */
+CVM_API struct cvm_shared *cvm_shared_new(uint32_t buffer_size,
+		uint64_t hash_seed);
+/* all producers must be destroyed first */
+CVM_API void cvm_shared_destroy(struct cvm_shared *s);
+/* Estimate as of the last flush of any producer, does not block the
+ * producers (elements still staged are not counted)
+ * */
+CVM_API uint64_t cvm_shared_estimate(struct cvm_shared *s);
+
+/* a producer is owned by a single thread */
+CVM_API struct cvm_producer *cvm_producer_new(struct cvm_shared *s);
+/* flushes the staged elements */
+CVM_API void cvm_producer_destroy(struct cvm_producer *w);
+CVM_API int cvm_producer_add(struct cvm_producer *w, cvm_key_t key);
+CVM_API int cvm_producer_add_batch(struct cvm_producer *w,
+		const cvm_key_t *keys, size_t n);
+/* insert the staged elements in the shared sketch */
+CVM_API int cvm_producer_flush(struct cvm_producer *w);
+
+/* Counters of the paths taken by the elements, collected when the library is
+ * built with CVM_STATS (make STATS=1), since the sketch was created. The
+ * counters of the buffer walks are only kept by the treap.
+ * */
+struct cvm_stats {
+	uint64_t seen; // elements fed
+	uint64_t rejected; // left no trace: u >= p or above the top of a full buffer
+	uint64_t filtered; // rejected without searching the buffer
+	uint64_t hits; // found in the buffer (updated, or deleted when u >= p)
+	uint64_t deletes;
+	uint64_t inserts; // new elements while the buffer has space
+	uint64_t replace_tops; // new elements taking the place of the top
+	uint64_t p_reductions;
+	// buffer: walks down from the root, their nodes, the nodes re-linked
+	// below an insert and by a delete, and the deepest walk against the
+	// expected bound on the height (treap_height_bound())
+	uint64_t searches;
+	uint64_t search_steps;
+	uint64_t split_steps;
+	uint64_t merge_steps;
+	uint32_t max_depth;
+	uint32_t height_bound;
+};
+
+/* snapshot of the counters (-ENOTSUP if they are not compiled in) */
+CVM_API int cvm_get_stats(struct cvm_impl *cvm, struct cvm_stats *out);
+/* the counters of the shared sketch, with those of the producers as of their
+ * last flush
+ * */
+CVM_API int cvm_shared_get_stats(struct cvm_shared *s, struct cvm_stats *out);
+
+/* current number of elements in the buffer and the sampling probability */
+CVM_API uint32_t cvm_buffer_used(struct cvm_impl *cvm);
+CVM_API double cvm_probability(struct cvm_impl *cvm);
+
+/* A table of sketches, one per group id (e.g. distinct destinations per
+ * source). A group is an exact set of its keys until it has `buffer_size`
+ * of them and only then gets an estimator. Small groups take a 32 byte entry
+ * (up to 16 bytes of keys inline) or a block from a slab, and the memory of
+ * removed groups is reused by the next ones.
+ * */
+CVM_API struct cvm_table *cvm_table_new(uint32_t buffer_size);
+CVM_API void cvm_table_destroy(struct cvm_table *tb);
+/* feed one element of the stream of a group, adding the group if needed */
+CVM_API int cvm_table_add(struct cvm_table *tb, uint64_t group, cvm_key_t key);
+/* the estimate of a group (zero for an unknown group) */
+CVM_API uint64_t cvm_table_estimate(struct cvm_table *tb, uint64_t group);
+/* drop a group (-ENOENT if it is not in the table) */
+CVM_API int cvm_table_remove(struct cvm_table *tb, uint64_t group);
+CVM_API uint64_t cvm_table_groups(struct cvm_table *tb);
+/* call `fn` for every group, in no particular order */
+CVM_API void cvm_table_foreach(struct cvm_table *tb,
+		void (*fn)(uint64_t group, uint64_t estimate, void *arg),
+		void *arg);
+
+/* Distinct elements over a sliding window of the last `intervals` intervals
+ * (e.g. 300 intervals of a second for the last 5 minutes). The caller closes
+ * the live interval with cvm_window_advance(), which forgets the oldest one.
+ * Each interval has its own sketch (with hashed priorities, the seed of
+ * cvm_set_hash_priority()), the window takes 2 * intervals + 3 of them. A
+ * query merges three sketches, the merges behind it are shared by the
+ * following queries and advances.
+ * */
+CVM_API struct cvm_window *cvm_window_new(uint32_t buffer_size,
+		uint32_t intervals, uint64_t hash_seed);
+CVM_API void cvm_window_destroy(struct cvm_window *w);
+/* feed the live interval */
+CVM_API int cvm_window_add(struct cvm_window *w, cvm_key_t key);
+CVM_API int cvm_window_add_batch(struct cvm_window *w, const cvm_key_t *keys,
+		size_t n);
+/* start a new interval */
+CVM_API int cvm_window_advance(struct cvm_window *w);
+/* estimate over the live interval and the intervals - 1 before it, stored in
+ * `out`; returns 0 or the error of the merges behind it */
+CVM_API int cvm_window_estimate(struct cvm_window *w, uint64_t *out);
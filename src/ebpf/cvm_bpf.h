@@ -0,0 +1,356 @@
+#pragma once
+/* The CVM estimator for eBPF (e.g. distinct flows in XDP). The treap lives in
+ * a single struct that fits a map value (one per CPU in a per-CPU array):
+ * nodes are linked by their index, every walk is bounded by the number of
+ * nodes and nothing calls libc.
+ *
+ * Priorities are a seeded hash of the key instead of random draws, so the
+ * sketches of the CPUs can be merged in userspace (cvm_bpf_merge) whatever
+ * CPU saw a key, and the estimate is the one of the library built with
+ * cvm_set_hash_priority() and the same seed.
+ *
+ * Include it after the BPF headers, or after shim.h to run the same code in
+ * userspace.
+ * */
+
+// number of keys in the buffer, one less than a power of two: indexes are
+// masked with it, a bound the verifier keeps (it loses the one of a compare).
+// The sketch takes 18 bytes per key and the kernel limits the values of
+// per-CPU maps to 32 KiB, so at most 1023.
+#ifndef CVM_BPF_SIZE
+#define CVM_BPF_SIZE 511
+#endif
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+// index zero is never allocated, it plays the role of NULL
+#define CVM_BPF_NIL 0
+// 31 fraction bits, like fp_t of the library
+#define CVM_BPF_FRACTION_BITS 31
+#define CVM_BPF_ONE (1U << CVM_BPF_FRACTION_BITS)
+
+struct cvm_bpf_node {
+	__u64 key;
+	__u32 prio;
+	__u16 left;
+	__u16 right;
+};
+
+/* a zeroed struct is an empty sketch */
+struct cvm_bpf {
+	__u32 p; // zero until the first element, then p of the library
+	__u32 used;
+	__u16 root;
+	__u16 next; // nodes below it were allocated once
+	__u16 nfree;
+	__u16 pad;
+	__u16 free[CVM_BPF_SIZE + 1]; // stack of the nodes freed by deletes
+	struct cvm_bpf_node nodes[CVM_BPF_SIZE + 1];
+};
+
+_Static_assert((CVM_BPF_SIZE & (CVM_BPF_SIZE + 1)) == 0,
+		"CVM_BPF_SIZE is not one less than a power of two");
+// PCPU_MIN_UNIT_SIZE, the largest value of a per-CPU map
+_Static_assert(sizeof(struct cvm_bpf) <= 32768,
+		"struct cvm_bpf does not fit a per-CPU map value, lower CVM_BPF_SIZE");
+
+static __always_inline __u64 __cvm_bpf_fmix64(__u64 k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/* expand a user seed, the same as the library does */
+static __always_inline __u64 cvm_bpf_hash_seed(__u64 seed)
+{
+	return __cvm_bpf_fmix64(seed + 0x9e3779b97f4a7c15ULL);
+}
+
+/* priority of a key, `seed` comes from cvm_bpf_hash_seed() */
+static __always_inline __u32 cvm_bpf_prio(__u64 key, __u64 seed)
+{
+	return __cvm_bpf_fmix64(key ^ seed) >> (64 - CVM_BPF_FRACTION_BITS);
+}
+
+/* the node of an index, NULL for CVM_BPF_NIL */
+static __always_inline struct cvm_bpf_node *
+__cvm_bpf_node(struct cvm_bpf *s, __u32 i)
+{
+	if (i == CVM_BPF_NIL)
+		return NULL;
+	return &s->nodes[i & CVM_BPF_SIZE];
+}
+
+static __always_inline __u32 __cvm_bpf_alloc(struct cvm_bpf *s)
+{
+	if (s->used >= CVM_BPF_SIZE)
+		return CVM_BPF_NIL;
+	s->used++;
+	if (s->nfree > 0) {
+		__u32 top = --s->nfree;
+		return s->free[top & CVM_BPF_SIZE];
+	}
+	return ++s->next;
+}
+
+static __always_inline void __cvm_bpf_release(struct cvm_bpf *s, __u32 i)
+{
+	__u32 top = s->nfree;
+	if (top >= CVM_BPF_SIZE)
+		return;
+	s->free[top & CVM_BPF_SIZE] = i;
+	s->nfree++;
+	s->used--;
+}
+
+/* The walks run in bpf_loop() (kernel 5.17): the verifier checks a step once
+ * instead of every iteration of a bounded loop, which took more than its
+ * million instructions for the walks of one element. A step returns one to
+ * stop.
+ * */
+struct __cvm_bpf_walk {
+	struct cvm_bpf *s;
+	__u16 *link;
+	__u16 *right; // split: where the keys above go
+	__u64 key;
+	__u32 a; // merge: the sub-trees, split: the node
+	__u32 b;
+	__u32 prio; // place: the priority of the node
+	__u32 found;
+};
+
+static long __cvm_bpf_find_step(__u64 k, void *data)
+{
+	struct __cvm_bpf_walk *w = data;
+	(void)k;
+	struct cvm_bpf_node *n = __cvm_bpf_node(w->s, *w->link);
+	if (n == NULL)
+		return 1;
+	if (w->key == n->key) {
+		w->found = *w->link;
+		return 1;
+	}
+	w->link = w->key < n->key ? &n->left : &n->right;
+	return 0;
+}
+
+/* search the key, `link` is set to the link that points to it (or where it
+ * would be linked)
+ * return: the index of the node, CVM_BPF_NIL if absent
+ * */
+static __always_inline __u32 __cvm_bpf_find(struct cvm_bpf *s, __u64 key,
+		__u16 **link)
+{
+	struct __cvm_bpf_walk w = {.s = s, .link = &s->root, .key = key};
+	bpf_loop(CVM_BPF_SIZE + 1, __cvm_bpf_find_step, &w, 0);
+	*link = w.link;
+	return w.found;
+}
+
+static long __cvm_bpf_merge_step(__u64 k, void *data)
+{
+	struct __cvm_bpf_walk *w = data;
+	(void)k;
+	struct cvm_bpf_node *na = __cvm_bpf_node(w->s, w->a);
+	struct cvm_bpf_node *nb = __cvm_bpf_node(w->s, w->b);
+	if (na == NULL) {
+		*w->link = w->b;
+		return 1;
+	}
+	if (nb == NULL) {
+		*w->link = w->a;
+		return 1;
+	}
+	if (na->prio >= nb->prio) {
+		*w->link = w->a;
+		w->link = &na->right;
+		w->a = na->right;
+	} else {
+		*w->link = w->b;
+		w->link = &nb->left;
+		w->b = nb->left;
+	}
+	return 0;
+}
+
+/* link the sub-trees `a` (smaller keys) and `b` at `link` */
+static __always_inline void __cvm_bpf_merge(struct cvm_bpf *s, __u16 *link,
+		__u32 a, __u32 b)
+{
+	struct __cvm_bpf_walk w = {.s = s, .link = link, .a = a, .b = b};
+	bpf_loop(CVM_BPF_SIZE + 1, __cvm_bpf_merge_step, &w, 0);
+}
+
+static long __cvm_bpf_split_step(__u64 k, void *data)
+{
+	struct __cvm_bpf_walk *w = data;
+	(void)k;
+	struct cvm_bpf_node *n = __cvm_bpf_node(w->s, w->a);
+	if (n == NULL)
+		return 1;
+	if (n->key < w->key) {
+		*w->link = w->a;
+		w->link = &n->right;
+		w->a = n->right;
+	} else {
+		*w->right = w->a;
+		w->right = &n->left;
+		w->a = n->left;
+	}
+	return 0;
+}
+
+/* split the sub-tree `i` between the keys below `key` (at `l`) and above */
+static __always_inline void __cvm_bpf_split(struct cvm_bpf *s, __u32 i,
+		__u64 key, __u16 *l, __u16 *r)
+{
+	struct __cvm_bpf_walk w = {.s = s, .link = l, .right = r, .key = key,
+		.a = i};
+	bpf_loop(CVM_BPF_SIZE + 1, __cvm_bpf_split_step, &w, 0);
+	*w.link = CVM_BPF_NIL;
+	*w.right = CVM_BPF_NIL;
+}
+
+static long __cvm_bpf_place_step(__u64 k, void *data)
+{
+	struct __cvm_bpf_walk *w = data;
+	(void)k;
+	struct cvm_bpf_node *m = __cvm_bpf_node(w->s, *w->link);
+	if (m == NULL || m->prio < w->prio)
+		return 1;
+	w->link = w->key < m->key ? &m->left : &m->right;
+	return 0;
+}
+
+/* place the detached node `i`: below the ancestors with higher priorities,
+ * the sub-tree it lands on is split between its children
+ * */
+static __always_inline void __cvm_bpf_place(struct cvm_bpf *s, __u32 i)
+{
+	struct cvm_bpf_node *n = __cvm_bpf_node(s, i);
+	if (n == NULL)
+		return;
+	struct __cvm_bpf_walk w = {.s = s, .link = &s->root, .key = n->key,
+		.prio = n->prio};
+	bpf_loop(CVM_BPF_SIZE + 1, __cvm_bpf_place_step, &w, 0);
+	__cvm_bpf_split(s, *w.link, n->key, &n->left, &n->right);
+	*w.link = i;
+}
+
+/* remove the node at `link` */
+static __always_inline void __cvm_bpf_unlink(struct cvm_bpf *s, __u16 *link)
+{
+	struct cvm_bpf_node *n = __cvm_bpf_node(s, *link);
+	if (n != NULL)
+		__cvm_bpf_merge(s, link, n->left, n->right);
+}
+
+/* feed an element with priority `u` (cvm_bpf_prio() of the key), the same
+ * steps as cvm_add() with hashed priorities
+ * */
+static __always_inline void cvm_bpf_add_prio(struct cvm_bpf *s, __u64 key,
+		__u32 u)
+{
+	__u16 *link;
+	if (s->p == 0)
+		s->p = CVM_BPF_ONE;
+	// every buffered priority is at most p
+	if (u > s->p)
+		return;
+	__u32 i = __cvm_bpf_find(s, key, &link);
+	if (i != CVM_BPF_NIL) {
+		// the priority of a key never changes, at p it leaves
+		if (u == s->p) {
+			__cvm_bpf_unlink(s, link);
+			__cvm_bpf_release(s, i);
+		}
+		return;
+	}
+	if (u == s->p)
+		return;
+	i = __cvm_bpf_alloc(s);
+	if (i == CVM_BPF_NIL) {
+		// full: keep the smallest priorities, p is the largest of the
+		// others
+		struct cvm_bpf_node *top = __cvm_bpf_node(s, s->root);
+		if (top == NULL)
+			return;
+		if (u > top->prio) {
+			s->p = u;
+			return;
+		}
+		s->p = top->prio;
+		i = s->root;
+		__cvm_bpf_unlink(s, &s->root);
+	}
+	struct cvm_bpf_node *n = __cvm_bpf_node(s, i);
+	if (n == NULL)
+		return;
+	n->key = key;
+	n->prio = u;
+	n->left = n->right = CVM_BPF_NIL;
+	__cvm_bpf_place(s, i);
+}
+
+static __always_inline void cvm_bpf_add(struct cvm_bpf *s, __u64 key,
+		__u64 seed)
+{
+	cvm_bpf_add_prio(s, key, cvm_bpf_prio(key, seed));
+}
+
+/* used / p, in integer arithmetic */
+static __always_inline __u64 cvm_bpf_estimate(struct cvm_bpf *s)
+{
+	if (s->p == 0)
+		return 0;
+	return ((__u64)s->used << CVM_BPF_FRACTION_BITS) / s->p;
+}
+
+#ifndef __bpf__
+/* Merge the sketch of a CPU into `dst` (userspace only, the walk keeps a
+ * stack of CVM_BPF_SIZE entries). Offering every key of `src` with its
+ * priority gives the sketch of the union of the streams, in any order. A copy
+ * read while the program updates it may be torn: the walk visits at most
+ * CVM_BPF_SIZE nodes and never overflows its stack, whatever the links.
+ * */
+static inline void cvm_bpf_merge(struct cvm_bpf *dst, struct cvm_bpf *src)
+{
+	__u16 stack[CVM_BPF_SIZE + 1];
+	__u32 sz = 0;
+	if (src->p == 0)
+		return;
+	if (dst->p == 0)
+		dst->p = CVM_BPF_ONE;
+	if (src->p < dst->p) {
+		// the buffer only keeps priorities below the smaller p
+		dst->p = src->p;
+		for (__u32 k = 0; k <= CVM_BPF_SIZE; k++) {
+			struct cvm_bpf_node *top = __cvm_bpf_node(dst, dst->root);
+			if (top == NULL || top->prio < dst->p)
+				break;
+			__u32 i = dst->root;
+			__cvm_bpf_unlink(dst, &dst->root);
+			__cvm_bpf_release(dst, i);
+		}
+	}
+	if (src->root != CVM_BPF_NIL)
+		stack[sz++] = src->root;
+	for (__u32 k = 0; k < CVM_BPF_SIZE && sz > 0; k++) {
+		struct cvm_bpf_node *n = __cvm_bpf_node(src, stack[--sz]);
+		if (n == NULL)
+			continue;
+		if (n->left != CVM_BPF_NIL && sz < CVM_BPF_SIZE + 1)
+			stack[sz++] = n->left;
+		if (n->right != CVM_BPF_NIL && sz < CVM_BPF_SIZE + 1)
+			stack[sz++] = n->right;
+		if (n->prio < dst->p)
+			cvm_bpf_add_prio(dst, n->key, n->prio);
+	}
+}
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+/* Count the distinct flows of an XDP frame: the 5-tuple of IPv4 and IPv6
+ * packets (ports for TCP and UDP only) is folded into a 64-bit key. Every
+ * header is checked against `data_end` before it is read.
+ * */
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+
+#include "cvm_bpf.h"
+
+static __always_inline __u64 __cvm_xdp_fold(__u64 h, __u64 v)
+{
+	return (h ^ v) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* fold the ports of TCP and UDP into `h` (other protocols have none)
+ * return: zero if the header is truncated
+ * */
+static __always_inline int __cvm_xdp_ports(void *l4, void *data_end,
+		__u8 proto, __u64 *h)
+{
+	if (proto == IPPROTO_TCP) {
+		struct tcphdr *tcp = l4;
+		if ((void *)(tcp + 1) > data_end)
+			return 0;
+		*h = __cvm_xdp_fold(*h, ((__u64)tcp->source << 16) | tcp->dest);
+	} else if (proto == IPPROTO_UDP) {
+		struct udphdr *udp = l4;
+		if ((void *)(udp + 1) > data_end)
+			return 0;
+		*h = __cvm_xdp_fold(*h, ((__u64)udp->source << 16) | udp->dest);
+	}
+	return 1;
+}
+
+/* the flow key of a frame
+ * return: zero if the frame is not IP or is truncated, one otherwise
+ * */
+static __always_inline int cvm_xdp_flow(void *data, void *data_end,
+		__u64 *key)
+{
+	struct ethhdr *eth = data;
+	__u64 h = 0;
+	if ((void *)(eth + 1) > data_end)
+		return 0;
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *ip = (void *)(eth + 1);
+		if ((void *)(ip + 1) > data_end || ip->ihl < 5)
+			return 0;
+		h = __cvm_xdp_fold(h, ((__u64)ip->saddr << 32) | ip->daddr);
+		h = __cvm_xdp_fold(h, ip->protocol);
+		if (!__cvm_xdp_ports((__u8 *)ip + ip->ihl * 4, data_end,
+					ip->protocol, &h))
+			return 0;
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6 = (void *)(eth + 1);
+		if ((void *)(ip6 + 1) > data_end)
+			return 0;
+		for (int i = 0; i < 4; i++) {
+			h = __cvm_xdp_fold(h, ip6->saddr.s6_addr32[i]);
+			h = __cvm_xdp_fold(h, ip6->daddr.s6_addr32[i]);
+		}
+		h = __cvm_xdp_fold(h, ip6->nexthdr);
+		if (!__cvm_xdp_ports(ip6 + 1, data_end, ip6->nexthdr, &h))
+			return 0;
+	} else {
+		return 0;
+	}
+	*key = h;
+	return 1;
+}
+
+/* feed the flow of a frame to the sketch, `seed` comes from
+ * cvm_bpf_hash_seed()
+ * */
+static __always_inline void cvm_xdp_count(void *data, void *data_end,
+		struct cvm_bpf *s, __u64 seed)
+{
+	__u64 key;
+	if (cvm_xdp_flow(data, data_end, &key))
+		cvm_bpf_add(s, key, seed);
+}
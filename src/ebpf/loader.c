@@ -0,0 +1,112 @@
+/* Attach xdp_cvm to an interface and print the number of distinct flows
+ * every second: the per-CPU sketches are read from the map and merged. The
+ * object is xdp_cvm.bpf.o next to the loader unless a path is given.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <net/if.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "shim.h"
+#include "cvm_bpf.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* xdp_cvm.bpf.o in the directory of the loader */
+static int default_object(char *path, size_t size)
+{
+	char exe[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len < 0)
+		return -1;
+	exe[len] = '\0';
+	if (snprintf(path, size, "%s/xdp_cvm.bpf.o", dirname(exe)) >= (int)size)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[PATH_MAX];
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s interface [seed] [object]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		snprintf(path, sizeof(path), "%s", argv[3]);
+	else if (default_object(path, sizeof(path)) != 0) {
+		fprintf(stderr, "failed to locate xdp_cvm.bpf.o\n");
+		return 1;
+	}
+	int ifindex = if_nametoindex(argv[1]);
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+	if (ifindex == 0) {
+		fprintf(stderr, "unknown interface %s\n", argv[1]);
+		return 1;
+	}
+
+	struct bpf_object *obj = bpf_object__open_file(path, NULL);
+	if (obj == NULL) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return 1;
+	}
+	struct bpf_map *rodata = bpf_object__find_map_by_name(obj, ".rodata");
+	size_t sz;
+	uint64_t *cfg = rodata ? bpf_map__initial_value(rodata, &sz) : NULL;
+	if (cfg == NULL || sz < sizeof(*cfg)) {
+		fprintf(stderr, "failed to set the seed\n");
+		return 1;
+	}
+	*cfg = cvm_bpf_hash_seed(seed);
+	if (bpf_object__load(obj) != 0) {
+		fprintf(stderr, "failed to load the BPF object\n");
+		return 1;
+	}
+	struct bpf_program *prog = bpf_object__find_program_by_name(obj, "xdp_cvm");
+	int map_fd = bpf_object__find_map_fd_by_name(obj, "cvm_sketch");
+	if (prog == NULL || map_fd < 0 ||
+			bpf_xdp_attach(ifindex, bpf_program__fd(prog), 0, NULL) != 0) {
+		fprintf(stderr, "failed to attach to %s\n", argv[1]);
+		return 1;
+	}
+
+	int cpus = libbpf_num_possible_cpus();
+	struct cvm_bpf *percpu = calloc(cpus, sizeof(struct cvm_bpf));
+	struct cvm_bpf *total = malloc(sizeof(struct cvm_bpf));
+	if (cpus <= 0 || percpu == NULL || total == NULL) {
+		fprintf(stderr, "failed to allocate the sketches\n");
+		bpf_xdp_detach(ifindex, 0, NULL);
+		return 1;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	while (!stop) {
+		__u32 zero = 0;
+		sleep(1);
+		if (bpf_map_lookup_elem(map_fd, &zero, percpu) != 0)
+			continue;
+		memset(total, 0, sizeof(*total));
+		for (int i = 0; i < cpus; i++)
+			cvm_bpf_merge(total, &percpu[i]);
+		printf("%s: %llu flows\n", argv[1],
+			(unsigned long long)cvm_bpf_estimate(total));
+		fflush(stdout);
+	}
+	bpf_xdp_detach(ifindex, 0, NULL);
+	bpf_object__close(obj);
+	free(percpu);
+	free(total);
+	return 0;
+}
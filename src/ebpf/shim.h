@@ -0,0 +1,30 @@
+#pragma once
+/* What the BPF headers provide, for building the BPF code in userspace (the
+ * tests and the loader)
+ * */
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+#include <linux/bpf.h>
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#ifndef bpf_htons
+#define bpf_htons(x) htons(x)
+#define bpf_ntohs(x) ntohs(x)
+#endif
+
+/* the helper runs the steps until one returns non-zero */
+static inline long bpf_loop(__u32 nr_loops, void *callback_fn,
+		void *callback_ctx, __u64 flags)
+{
+	long (*step)(__u64, void *) = (long (*)(__u64, void *))callback_fn;
+	(void)flags;
+	for (__u32 i = 0; i < nr_loops; i++)
+		if (step(i, callback_ctx))
+			return i + 1;
+	return nr_loops;
+}
@@ -0,0 +1,459 @@
+/* Load the BPF object (path in argv[1]) through the verifier and run frames
+ * through it with BPF_PROG_TEST_RUN: the merged per-CPU sketches must match
+ * the same code run in userspace. Raw bpf() calls, so that it does not need
+ * libbpf; the relocations of the program are the ones of xdp_cvm.bpf.c (the
+ * sketch map, the seed in .rodata and the steps of bpf_loop() in .text).
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/btf.h>
+#include "../shim.h"
+#include "../cvm_xdp.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+#define SEED 7
+#define LOG_SIZE (1 << 20)
+
+typedef bool(*test_fn)(void);
+
+static const char *obj_path;
+static int prog_fd = -1;
+static int sketch_fd = -1;
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(__u32 type, __u32 value_size, __u32 flags)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = sizeof(__u32);
+	attr.value_size = value_size;
+	attr.max_entries = 1;
+	attr.map_flags = flags;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_update(int fd, const void *value)
+{
+	union bpf_attr attr;
+	__u32 zero = 0;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (__u64)(long)&zero;
+	attr.value = (__u64)(long)value;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_lookup(int fd, void *value)
+{
+	union bpf_attr attr;
+	__u32 zero = 0;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (__u64)(long)&zero;
+	attr.value = (__u64)(long)value;
+	return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static int cpu_count(void)
+{
+	// per-CPU values are returned for every possible CPU
+	int n = 0, a, b;
+	FILE *f = fopen("/sys/devices/system/cpu/possible", "r");
+	if (f == NULL)
+		return -1;
+	while (fscanf(f, "%d", &a) == 1) {
+		b = a;
+		if (fscanf(f, "-%d", &b) != 1)
+			b = a;
+		n += b - a + 1;
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return n;
+}
+
+static const Elf64_Shdr *section(const uint8_t *elf, const char *name)
+{
+	const Elf64_Ehdr *eh = (const void *)elf;
+	const Elf64_Shdr *sh = (const void *)(elf + eh->e_shoff);
+	const char *names = (const char *)elf + sh[eh->e_shstrndx].sh_offset;
+	for (int i = 0; i < eh->e_shnum; i++)
+		if (strcmp(names + sh[i].sh_name, name) == 0)
+			return &sh[i];
+	return NULL;
+}
+
+static const Elf64_Sym *symbol(const uint8_t *elf, const char *name)
+{
+	const Elf64_Ehdr *eh = (const void *)elf;
+	const Elf64_Shdr *sh = (const void *)(elf + eh->e_shoff);
+	const Elf64_Shdr *symtab = section(elf, ".symtab");
+	const Elf64_Sym *syms = (const void *)(elf + symtab->sh_offset);
+	const char *names = (const char *)elf + sh[symtab->sh_link].sh_offset;
+	for (size_t i = 0; i < symtab->sh_size / sizeof(*syms); i++)
+		if (strcmp(names + syms[i].st_name, name) == 0)
+			return &syms[i];
+	return NULL;
+}
+
+/* clang leaves the sizes of the sections and the offsets of their variables
+ * to the loader, like libbpf set them from the ELF
+ * */
+static void btf_fix_datasec(uint8_t *elf, struct btf_header *bh)
+{
+	uint8_t *types = (uint8_t *)bh + bh->hdr_len + bh->type_off;
+	const char *strs = (const char *)bh + bh->hdr_len + bh->str_off;
+	struct btf_type *byid[256] = {NULL};
+	__u32 id = 1;
+	for (uint8_t *p = types; p < types + bh->type_len; id++) {
+		struct btf_type *t = (void *)p;
+		__u32 vlen = BTF_INFO_VLEN(t->info);
+		if (id < 256)
+			byid[id] = t;
+		p += sizeof(*t);
+		switch (BTF_INFO_KIND(t->info)) {
+		case BTF_KIND_INT:
+		case BTF_KIND_VAR:
+		case BTF_KIND_DECL_TAG:
+			p += 4;
+			break;
+		case BTF_KIND_ARRAY:
+			p += sizeof(struct btf_array);
+			break;
+		case BTF_KIND_STRUCT:
+		case BTF_KIND_UNION:
+			p += vlen * sizeof(struct btf_member);
+			break;
+		case BTF_KIND_ENUM:
+			p += vlen * sizeof(struct btf_enum);
+			break;
+		case BTF_KIND_ENUM64:
+			p += vlen * sizeof(struct btf_enum64);
+			break;
+		case BTF_KIND_FUNC_PROTO:
+			p += vlen * sizeof(struct btf_param);
+			break;
+		case BTF_KIND_DATASEC: {
+			struct btf_var_secinfo *v = (void *)p;
+			const Elf64_Shdr *sec = section(elf, strs + t->name_off);
+			p += vlen * sizeof(*v);
+			if (sec != NULL)
+				t->size = sec->sh_size;
+			for (__u32 i = 0; i < vlen; i++) {
+				struct btf_type *var = v[i].type < 256 ?
+					byid[v[i].type] : NULL;
+				const Elf64_Sym *sym = var ? symbol(elf,
+						strs + var->name_off) : NULL;
+				if (sym != NULL)
+					v[i].offset = sym->st_value;
+			}
+			break;
+		}
+		}
+	}
+}
+
+/* the types of the object, the kernel needs them for the steps of bpf_loop()
+ * return: the fd of the BTF, negative on error
+ * */
+static int btf_load(uint8_t *elf, char *log, size_t log_size)
+{
+	const Elf64_Shdr *btf = section(elf, ".BTF");
+	union bpf_attr attr;
+	if (btf == NULL)
+		return -1;
+	btf_fix_datasec(elf, (void *)(elf + btf->sh_offset));
+	memset(&attr, 0, sizeof(attr));
+	attr.btf = (__u64)(long)(elf + btf->sh_offset);
+	attr.btf_size = btf->sh_size;
+	attr.btf_log_buf = (__u64)(long)log;
+	attr.btf_log_size = log_size;
+	attr.btf_log_level = 1;
+	return sys_bpf(BPF_BTF_LOAD, &attr);
+}
+
+/* the func_info of .BTF.ext for the program and .text (placed after `count`
+ * instructions), offsets turned from bytes to instructions
+ * return: the number of records in `out`
+ * */
+static size_t btf_func_info(const uint8_t *elf, size_t count,
+		struct bpf_func_info *out, size_t max)
+{
+	const Elf64_Shdr *btf = section(elf, ".BTF");
+	const Elf64_Shdr *ext = section(elf, ".BTF.ext");
+	size_t n = 0;
+	if (btf == NULL || ext == NULL)
+		return 0;
+	const struct btf_header *bh = (const void *)(elf + btf->sh_offset);
+	const char *strs = (const char *)bh + bh->hdr_len + bh->str_off;
+	// the header of .BTF.ext: magic, version, flags, hdr_len, then the
+	// offset and length of func_info
+	const uint8_t *eh = elf + ext->sh_offset;
+	const __u32 *hdr = (const void *)eh;
+	const uint8_t *p = eh + hdr[1] + hdr[2];
+	const uint8_t *end = p + hdr[3];
+	__u32 rec_size = *(const __u32 *)p;
+	for (p += 4; p < end;) {
+		const __u32 *sec = (const void *)p;
+		const char *name = strs + sec[0];
+		size_t base = strcmp(name, ".text") == 0 ? count : 0;
+		p += 8;
+		for (__u32 i = 0; i < sec[1]; i++, p += rec_size) {
+			const struct bpf_func_info *fi = (const void *)p;
+			if (n < max) {
+				out[n].insn_off = base +
+					fi->insn_off / sizeof(struct bpf_insn);
+				out[n].type_id = fi->type_id;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/* open the object, create its maps and load the program */
+bool test_load(void)
+{
+	static char log[LOG_SIZE];
+	int fd = open(obj_path, O_RDONLY);
+	struct stat st;
+	ASSERT(fd >= 0 && fstat(fd, &st) == 0, "failed to open %s", obj_path);
+	uint8_t *elf = malloc(st.st_size);
+	ASSERT(elf != NULL && read(fd, elf, st.st_size) == st.st_size,
+		"failed to read %s", obj_path);
+	close(fd);
+
+	const Elf64_Ehdr *eh = (const void *)elf;
+	const Elf64_Shdr *sh = (const void *)(elf + eh->e_shoff);
+	const Elf64_Shdr *text = section(elf, "xdp");
+	const Elf64_Shdr *rel = section(elf, ".relxdp");
+	const Elf64_Shdr *symtab = section(elf, ".symtab");
+	const Elf64_Shdr *rodata = section(elf, ".rodata");
+	const Elf64_Shdr *sub = section(elf, ".text");
+	ASSERT(text != NULL && symtab != NULL, "no xdp program in %s", obj_path);
+	const Elf64_Sym *syms = (const void *)(elf + symtab->sh_offset);
+
+	sketch_fd = map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(struct cvm_bpf), 0);
+	if (sketch_fd < 0 && (errno == EPERM || errno == EACCES)) {
+		printf("no permission for bpf(), the program is not loaded\n");
+		exit(0);
+	}
+	ASSERT(sketch_fd >= 0, "failed to create the sketch map: %s",
+		strerror(errno));
+	int rodata_fd = -1;
+	if (rodata != NULL) {
+		uint64_t seed = cvm_bpf_hash_seed(SEED);
+		uint8_t *value = calloc(1, rodata->sh_size);
+		ASSERT(value != NULL && rodata->sh_size >= sizeof(seed),
+			"unexpected .rodata");
+		memcpy(value, &seed, sizeof(seed));
+		rodata_fd = map_create(BPF_MAP_TYPE_ARRAY, rodata->sh_size,
+				BPF_F_RDONLY_PROG);
+		ASSERT(rodata_fd >= 0 && map_update(rodata_fd, value) == 0,
+			"failed to create .rodata: %s", strerror(errno));
+		union bpf_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = rodata_fd;
+		ASSERT(sys_bpf(BPF_MAP_FREEZE, &attr) == 0,
+			"failed to freeze .rodata: %s", strerror(errno));
+		free(value);
+	}
+
+	// the functions in .text follow the program
+	size_t count = text->sh_size / sizeof(struct bpf_insn);
+	size_t total = count + (sub ? sub->sh_size / sizeof(struct bpf_insn) : 0);
+	struct bpf_insn *insns = malloc(total * sizeof(*insns));
+	ASSERT(insns != NULL, "failed to allocate the program");
+	memcpy(insns, elf + text->sh_offset, text->sh_size);
+	if (sub != NULL)
+		memcpy(insns + count, elf + sub->sh_offset, sub->sh_size);
+	for (size_t i = 0; rel != NULL && i < rel->sh_size / sizeof(Elf64_Rel);
+			i++) {
+		const Elf64_Rel *r = (const Elf64_Rel *)(elf + rel->sh_offset) + i;
+		const Elf64_Sym *sym = &syms[ELF64_R_SYM(r->r_info)];
+		struct bpf_insn *insn = &insns[r->r_offset / sizeof(*insn)];
+		const Elf64_Shdr *target = &sh[sym->st_shndx];
+		if (target == rodata) {
+			insn[0].src_reg = BPF_PSEUDO_MAP_VALUE;
+			insn[0].imm = rodata_fd;
+			insn[1].imm += sym->st_value;
+		} else if (target == sub) {
+			// the address of a step, relative to the next instruction
+			long at = insn - insns;
+			long to = count + (sym->st_value + insn[0].imm) /
+				sizeof(*insn);
+			insn[0].src_reg = BPF_PSEUDO_FUNC;
+			insn[0].imm = to - at - 1;
+		} else {
+			// .maps only holds the sketch
+			insn[0].src_reg = BPF_PSEUDO_MAP_FD;
+			insn[0].imm = sketch_fd;
+		}
+	}
+
+	struct bpf_func_info funcs[16];
+	size_t nfuncs = btf_func_info(elf, count, funcs, 16);
+	int btf_fd = btf_load(elf, log, sizeof(log));
+	if (btf_fd < 0)
+		printf("%s", log);
+	ASSERT(btf_fd >= 0, "failed to load the BTF: %s", strerror(errno));
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.prog_btf_fd = btf_fd;
+	attr.func_info = (__u64)(long)funcs;
+	attr.func_info_cnt = nfuncs;
+	attr.func_info_rec_size = sizeof(*funcs);
+	attr.insns = (__u64)(long)insns;
+	attr.insn_cnt = total;
+	attr.license = (__u64)(long)"GPL";
+	attr.log_buf = (__u64)(long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd < 0) {
+		// the last lines of the log say why
+		size_t len = strlen(log);
+		printf("%s", len > 4096 ? log + len - 4096 : log);
+	}
+	ASSERT(prog_fd >= 0, "the verifier rejected the program: %s",
+		strerror(errno));
+
+	struct bpf_prog_info info;
+	memset(&info, 0, sizeof(info));
+	memset(&attr, 0, sizeof(attr));
+	attr.info.bpf_fd = prog_fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info = (__u64)(long)&info;
+	if (sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) == 0)
+		printf("%zu instructions, %u processed by the verifier\n",
+			total, info.verified_insns);
+	free(insns);
+	free(elf);
+	return true;
+}
+
+#define FRAME_MAX 96
+
+/* an Ethernet/IPv4/UDP frame, or IPv6/TCP when `v6` */
+static size_t frame(uint8_t *buf, uint32_t src, uint16_t sport, bool v6)
+{
+	struct ethhdr *eth = (void *)buf;
+	memset(buf, 0, FRAME_MAX);
+	if (v6) {
+		struct ipv6hdr *ip6 = (void *)(eth + 1);
+		struct tcphdr *tcp = (void *)(ip6 + 1);
+		eth->h_proto = htons(ETH_P_IPV6);
+		ip6->version = 6;
+		ip6->nexthdr = IPPROTO_TCP;
+		ip6->saddr.s6_addr32[3] = htonl(src);
+		tcp->source = htons(sport);
+		tcp->dest = htons(443);
+		return (uint8_t *)(tcp + 1) - buf;
+	}
+	struct iphdr *ip = (void *)(eth + 1);
+	struct udphdr *udp = (void *)(ip + 1);
+	eth->h_proto = htons(ETH_P_IP);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = htonl(src);
+	ip->daddr = htonl(0x0a000001);
+	udp->source = htons(sport);
+	udp->dest = htons(53);
+	return (uint8_t *)(udp + 1) - buf;
+}
+
+/* frames of many more flows than the buffer holds: the sketch of the program
+ * is the one of the same code in userspace
+ * */
+bool test_run(void)
+{
+	static struct cvm_bpf ref, total;
+	static uint8_t buf[128] __attribute__((aligned(8)));
+	uint8_t *data = buf + 2;
+	uint64_t seed = cvm_bpf_hash_seed(SEED);
+	const uint32_t flows = 8 * CVM_BPF_SIZE;
+	int cpus = cpu_count();
+	ASSERT(prog_fd >= 0 && cpus > 0, "the program is not loaded");
+	memset(&ref, 0, sizeof(ref));
+	for (int r = 0; r < 2; r++) {
+		for (uint32_t f = 0; f < flows; f++) {
+			size_t len = frame(data, 0xc0a80000 + f / 16,
+					1000 + f % 16, f % 3 == 0);
+			union bpf_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.test.prog_fd = prog_fd;
+			attr.test.data_in = (__u64)(long)data;
+			attr.test.data_size_in = len;
+			attr.test.repeat = 1;
+			ASSERT(sys_bpf(BPF_PROG_TEST_RUN, &attr) == 0,
+				"test run failed: %s", strerror(errno));
+			ASSERT(attr.test.retval == XDP_PASS, "frame not passed");
+			cvm_xdp_count(data, data + len, &ref, seed);
+		}
+	}
+	struct cvm_bpf *percpu = calloc(cpus, sizeof(struct cvm_bpf));
+	ASSERT(percpu != NULL, "failed to allocate the sketches");
+	ASSERT(map_lookup(sketch_fd, percpu) == 0, "failed to read the sketches");
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < cpus; i++)
+		cvm_bpf_merge(&total, &percpu[i]);
+	free(percpu);
+	ASSERT(total.used == ref.used && total.p == ref.p,
+		"sketch of the program differs from the userspace one");
+	ASSERT(cvm_bpf_estimate(&total) == cvm_bpf_estimate(&ref),
+		"estimate %llu instead of %llu",
+		(unsigned long long)cvm_bpf_estimate(&total),
+		(unsigned long long)cvm_bpf_estimate(&ref));
+	printf("%u flows, estimate %llu\n", flows,
+		(unsigned long long)cvm_bpf_estimate(&total));
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING CVM (BPF program)\n"
+		"...........................................\n");
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s object\n", argv[0]);
+		return 1;
+	}
+	obj_path = argv[1];
+	bool res;
+	test_fn suite[] = {test_load, test_run,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../shim.h"
+#include "../cvm_xdp.h"
+#include "../../cvm.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+#define COUNT_KEYS 200000
+#define COUNT_DISTINCT 50000
+#define CPUS 4
+#define SEED 7
+
+typedef bool(*test_fn)(void);
+
+/* a stream with repetitions of COUNT_DISTINCT distinct keys */
+static uint32_t stream_key(uint32_t i)
+{
+	return (i * 2654435761u) % COUNT_DISTINCT;
+}
+
+/* same steps as the library with hashed priorities and the same seed */
+bool test_library(void)
+{
+	static struct cvm_bpf s;
+	uint64_t seed = cvm_bpf_hash_seed(SEED);
+	struct cvm_impl *c = cvm_new(CVM_BPF_SIZE);
+	ASSERT(c != NULL, "failed to allocate the sketch");
+	cvm_set_hash_priority(c, SEED);
+	memset(&s, 0, sizeof(s));
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		cvm_add(c, stream_key(i));
+		cvm_bpf_add(&s, stream_key(i), seed);
+	}
+	ASSERT(s.used == cvm_buffer_used(c), "wrong number of buffered keys");
+	ASSERT((double)s.p / CVM_BPF_ONE == cvm_probability(c),
+		"wrong probability");
+	ASSERT(cvm_bpf_estimate(&s) == cvm_estimate(c),
+		"estimate %lu instead of %lu", cvm_bpf_estimate(&s),
+		cvm_estimate(c));
+	cvm_destroy(c);
+	return true;
+}
+
+/* sketches of a stream spread over the CPUs merge into the sketch of the
+ * whole stream
+ * */
+bool test_merge(void)
+{
+	static struct cvm_bpf percpu[CPUS], total, all;
+	uint64_t seed = cvm_bpf_hash_seed(SEED);
+	memset(percpu, 0, sizeof(percpu));
+	memset(&total, 0, sizeof(total));
+	memset(&all, 0, sizeof(all));
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		cvm_bpf_add(&percpu[i % CPUS], stream_key(i), seed);
+		cvm_bpf_add(&all, stream_key(i), seed);
+	}
+	for (int i = 0; i < CPUS; i++)
+		cvm_bpf_merge(&total, &percpu[i]);
+	ASSERT(total.used == all.used && total.p == all.p,
+		"merged sketch differs from the sketch of the stream");
+	ASSERT(cvm_bpf_estimate(&total) == cvm_bpf_estimate(&all),
+		"wrong merged estimate");
+	return true;
+}
+
+/* a copy torn by concurrent updates may link nodes in cycles, the merge
+ * still ends without overflowing its stack
+ * */
+bool test_merge_torn(void)
+{
+	static struct cvm_bpf src, dst;
+	memset(&src, 0, sizeof(src));
+	memset(&dst, 0, sizeof(dst));
+	src.p = CVM_BPF_ONE / 2;
+	src.root = 1;
+	for (__u32 i = 1; i <= CVM_BPF_SIZE; i++) {
+		src.nodes[i].key = i;
+		src.nodes[i].prio = i;
+		// every node points back to the first ones
+		src.nodes[i].left = 1;
+		src.nodes[i].right = i % 2 + 1;
+	}
+	cvm_bpf_merge(&dst, &src);
+	ASSERT(dst.p == src.p && dst.used <= CVM_BPF_SIZE,
+		"wrong sketch after merging a torn copy");
+	return true;
+}
+
+/* an Ethernet/IPv4/UDP frame */
+static size_t udp_frame(uint8_t *buf, uint32_t saddr, uint16_t sport)
+{
+	struct ethhdr *eth = (void *)buf;
+	struct iphdr *ip = (void *)(eth + 1);
+	struct udphdr *udp = (void *)(ip + 1);
+	memset(buf, 0, sizeof(*eth) + sizeof(*ip) + sizeof(*udp));
+	eth->h_proto = htons(ETH_P_IP);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = htonl(saddr);
+	ip->daddr = htonl(0x0a000001);
+	udp->source = htons(sport);
+	udp->dest = htons(53);
+	return (uint8_t *)(udp + 1) - buf;
+}
+
+bool test_xdp(void)
+{
+	static struct cvm_bpf s;
+	// the frame starts 2 bytes in, so that the IP header is aligned like in
+	// the buffers of the drivers
+	static uint8_t buf[128] __attribute__((aligned(8)));
+	uint8_t *frame = buf + 2;
+	uint64_t seed = cvm_bpf_hash_seed(SEED);
+	const uint32_t flows = CVM_BPF_SIZE / 2;
+	memset(&s, 0, sizeof(s));
+	// every flow sends 3 frames, the buffer holds them all
+	for (int r = 0; r < 3; r++) {
+		for (uint32_t f = 0; f < flows; f++) {
+			size_t len = udp_frame(frame, 0xc0a80000 + f / 8,
+					1000 + f % 8);
+			cvm_xdp_count(frame, frame + len, &s, seed);
+		}
+	}
+	ASSERT(cvm_bpf_estimate(&s) == flows, "estimate %lu instead of %u",
+		cvm_bpf_estimate(&s), flows);
+	// frames cut in the middle of a header are not counted
+	size_t len = udp_frame(frame, 0x01020304, 1);
+	cvm_xdp_count(frame, frame + len - 1, &s, seed);
+	cvm_xdp_count(frame, frame + 20, &s, seed);
+	ASSERT(cvm_bpf_estimate(&s) == flows, "truncated frame counted");
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING CVM (eBPF)\n"
+		"...........................................\n");
+	bool res;
+	test_fn suite[] = {test_library, test_merge, test_merge_torn, test_xdp,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
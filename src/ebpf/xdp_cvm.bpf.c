@@ -0,0 +1,33 @@
+/* XDP program that counts the distinct flows seen by an interface: one
+ * sketch per CPU, merged by the loader. Every frame is passed on.
+ * */
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "cvm_xdp.h"
+
+// seed of the priorities, cvm_bpf_hash_seed() of the user seed (set by the
+// loader before the program is loaded)
+const volatile __u64 cvm_seed = 0;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct cvm_bpf);
+} cvm_sketch SEC(".maps");
+
+SEC("xdp")
+int xdp_cvm(struct xdp_md *ctx)
+{
+	__u32 zero = 0;
+	struct cvm_bpf *s = bpf_map_lookup_elem(&cvm_sketch, &zero);
+	if (s == NULL)
+		return XDP_PASS;
+	cvm_xdp_count((void *)(long)ctx->data, (void *)(long)ctx->data_end, s,
+			cvm_seed);
+	return XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "GPL";
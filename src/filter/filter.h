@@ -0,0 +1,92 @@
+#pragma once
+/* *
+ * Counting membership filter
+ *
+ * A Bloom filter with two probes and 8-bit counters so that keys can also be
+ * removed. It answers "maybe present" or "surely absent". Counters that
+ * saturate are never decremented, which only costs false positives.
+ * The caller provides a 64-bit hash of the key; the two probes come from its
+ * halves.
+ *
+ * author: Farbod Shahinfar
+ * LICENSE: MIT
+ * */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+// counters per expected key, about 5% false positives when full
+#define FILTER_SLOTS_PER_KEY 8
+
+struct filter {
+	uint32_t mask;
+	uint8_t *c;
+};
+
+/* size the filter for up to `expected` keys present at once
+ * */
+static inline int filter_init(struct filter *f, uint32_t expected)
+{
+	uint64_t slots = 64;
+	while (slots < (uint64_t)expected * FILTER_SLOTS_PER_KEY)
+		slots <<= 1;
+	if (slots > (1ULL << 32))
+		slots = 1ULL << 32;
+	f->mask = slots - 1;
+	f->c = calloc(slots, 1);
+	if (f->c == NULL)
+		return -1;
+	return 0;
+}
+
+static inline void filter_free(struct filter *f)
+{
+	free(f->c);
+	f->c = NULL;
+}
+
+static inline void filter_clear(struct filter *f)
+{
+	memset(f->c, 0, (uint64_t)f->mask + 1);
+}
+
+static __always_inline
+void __filter_inc(uint8_t *c)
+{
+	if (*c != UINT8_MAX)
+		(*c)++;
+}
+
+static __always_inline
+void __filter_dec(uint8_t *c)
+{
+	if (*c != UINT8_MAX)
+		(*c)--;
+}
+
+static __always_inline
+void filter_add(struct filter *f, uint64_t h)
+{
+	__filter_inc(&f->c[h & f->mask]);
+	__filter_inc(&f->c[(h >> 32) & f->mask]);
+}
+
+/* remove a key that was added before
+ * */
+static __always_inline
+void filter_del(struct filter *f, uint64_t h)
+{
+	__filter_dec(&f->c[h & f->mask]);
+	__filter_dec(&f->c[(h >> 32) & f->mask]);
+}
+
+static __always_inline
+int filter_maybe(struct filter *f, uint64_t h)
+{
+	return f->c[h & f->mask] != 0 && f->c[(h >> 32) & f->mask] != 0;
+}
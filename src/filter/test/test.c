@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "../filter.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+#define COUNT_KEYS 1000
+
+typedef bool(*test_fn)(void);
+
+/* a hash whose two probes land on slots `a` and `b` */
+static uint64_t probes(uint32_t a, uint32_t b)
+{
+	return ((uint64_t)b << 32) | a;
+}
+
+static uint64_t key_hash(uint32_t i)
+{
+	uint64_t h = i * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+bool test_add_del(void)
+{
+	struct filter f;
+	ASSERT(filter_init(&f, COUNT_KEYS) == 0, "failed to allocate the filter");
+	ASSERT(f.mask + 1 >= COUNT_KEYS * FILTER_SLOTS_PER_KEY,
+		"the filter is too small");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		ASSERT(!filter_maybe(&f, key_hash(i)), "empty filter has key %d", i);
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		filter_add(&f, key_hash(i));
+	// no false negatives
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		ASSERT(filter_maybe(&f, key_hash(i)), "key %d is missing", i);
+	// removing half of the keys keeps the others
+	for (uint32_t i = 0; i < COUNT_KEYS; i += 2)
+		filter_del(&f, key_hash(i));
+	for (uint32_t i = 1; i < COUNT_KEYS; i += 2)
+		ASSERT(filter_maybe(&f, key_hash(i)), "key %d is missing", i);
+	for (uint32_t i = 1; i < COUNT_KEYS; i += 2)
+		filter_del(&f, key_hash(i));
+	for (uint64_t s = 0; s <= f.mask; s++)
+		ASSERT(f.c[s] == 0, "counter %lu is not back to zero", s);
+
+	filter_add(&f, key_hash(1));
+	filter_clear(&f);
+	ASSERT(!filter_maybe(&f, key_hash(1)), "key survived a clear");
+	filter_free(&f);
+	return true;
+}
+
+/* both probes on one counter: it counts the key twice */
+bool test_same_slot(void)
+{
+	struct filter f;
+	ASSERT(filter_init(&f, 8) == 0, "failed to allocate the filter");
+	uint64_t h = probes(5, 5);
+	filter_add(&f, h);
+	ASSERT(f.c[5] == 2, "both probes should count (%d)", f.c[5]);
+	ASSERT(filter_maybe(&f, h), "key is missing");
+	// a key that shares one of the slots
+	filter_add(&f, probes(5, 6));
+	filter_del(&f, h);
+	ASSERT(filter_maybe(&f, probes(5, 6)), "shared slot was emptied");
+	ASSERT(f.c[5] == 1 && f.c[6] == 1, "wrong counters after delete");
+	filter_del(&f, probes(5, 6));
+	ASSERT(!filter_maybe(&f, h), "key still present after delete");
+	filter_free(&f);
+	return true;
+}
+
+/* a saturated counter stays saturated, so no key can go missing */
+bool test_saturation(void)
+{
+	struct filter f;
+	ASSERT(filter_init(&f, 8) == 0, "failed to allocate the filter");
+	uint64_t h = probes(3, 4);
+	for (int i = 0; i < 300; i++)
+		filter_add(&f, h);
+	ASSERT(f.c[3] == UINT8_MAX && f.c[4] == UINT8_MAX,
+		"counters should saturate");
+	for (int i = 0; i < 300; i++)
+		filter_del(&f, h);
+	ASSERT(f.c[3] == UINT8_MAX && f.c[4] == UINT8_MAX,
+		"saturated counters should not decrease");
+	ASSERT(filter_maybe(&f, h), "key with saturated counters is missing");
+	// a key sharing a saturated counter is still answered by the other
+	ASSERT(!filter_maybe(&f, probes(3, 7)), "absent key reported present");
+	filter_free(&f);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING FILTER\n"
+		"...........................................\n");
+	bool res;
+	test_fn suite[] = {test_add_del, test_same_slot, test_saturation,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
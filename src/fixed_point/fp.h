@@ -2,16 +2,30 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include "../prng/prng.h"
 
-// unsigned fix point arithmetic
+// unsigned fix point arithmetic. FP_BITS selects the width of fp_t: 32 bits
+// with 31 fraction bits (default) or 64 bits with 63 fraction bits, for
+// probabilities below 2^-31 (cardinalities past ~10^12 with small buffers).
+#ifndef FP_BITS
+#define FP_BITS 32
+#endif
 
+#if FP_BITS == 32
 typedef uint32_t fp_t;
 typedef uint64_t  __fp_d_t;
-
 #define FIX_FRACTION_BITS 31
-#define FP_SCALE (1LL << FIX_FRACTION_BITS)
+#elif FP_BITS == 64
+typedef uint64_t fp_t;
+typedef unsigned __int128 __fp_d_t;
+#define FIX_FRACTION_BITS 63
+#else
+#error "FP_BITS should be 32 or 64"
+#endif
+
+#define FP_SCALE ((fp_t)1 << FIX_FRACTION_BITS)
 #define FP_FRACTION_MASK ((FP_SCALE) - 1)
-#define FP_MAX_FRACTION_VALUE ((double)(0.9999999997671694))
+#define FP_MAX_FRACTION_VALUE ((double)FP_FRACTION_MASK / (double)FP_SCALE)
 #define FP_ONE FP_SCALE
 
 fp_t fp_add(fp_t a, fp_t b)
@@ -26,9 +40,8 @@ fp_t fp_sub(fp_t a, fp_t b)
 
 fp_t fp_mul(fp_t a, fp_t b)
 {
-	// Use 64-bit intermediate to prevent overflow
-	fp_t product = ( __fp_d_t)a * ( __fp_d_t)b;
-	// Scale back to the correct fixed-point format
+	// the product needs twice the bits, scale it back before narrowing
+	__fp_d_t product = (__fp_d_t)a * (__fp_d_t)b;
 	return (fp_t)(product >> FIX_FRACTION_BITS);
 }
 
@@ -41,24 +54,75 @@ fp_t fp_div(fp_t a, fp_t b)
 	return (fp_t)(numerator / b);
 }
 
-fp_t fp_from_float(float val)
+/* the integer n / d (rounded down), saturated to UINT64_MAX. With 32-bit
+ * fp_t it only needs a 64-bit division.
+ * */
+static __always_inline
+uint64_t fp_int_div(uint32_t n, fp_t d)
+{
+	if (d == 0)
+		return UINT64_MAX;
+	__fp_d_t q = ((__fp_d_t)n << FIX_FRACTION_BITS) / d;
+	return q > UINT64_MAX ? UINT64_MAX : (uint64_t)q;
+}
+
+/* the closest fixed point value below `val`, clamped to the range of fp_t */
+fp_t fp_from_float(double val)
 {
-	// TODO: to be implemented
-	assert(0);
-	return -1;
+	if (!(val > 0))
+		return 0;
+	double v = val * (double)FP_SCALE;
+	if (v >= (double)(fp_t)-1)
+		return (fp_t)-1;
+	return (fp_t)v;
 }
 
 double fp_to_float(fp_t val)
 {
-	__fp_d_t tmp = (__fp_d_t)val;
-	return (double)(tmp) / (double)FP_SCALE;
+	return (double)val / (double)FP_SCALE;
+}
+
+/* get a uniform random number [0, 1) from the generator
+ * */
+static __always_inline
+fp_t fp_random_r(struct prng *r)
+{
+	// the top bits of the output are the fraction
+	return (fp_t)(prng_next(r) >> (64 - FIX_FRACTION_BITS));
+}
+
+#define FP_RANDOM_BLOCK 64
+
+/* fill out with n uniform random numbers [0, 1), the same values n calls to
+ * fp_random_r() would return
+ * */
+void fp_random_batch(struct prng *r, fp_t *out, size_t n)
+{
+	uint64_t block[FP_RANDOM_BLOCK];
+	while (n > 0) {
+		size_t m = n < FP_RANDOM_BLOCK ? n : FP_RANDOM_BLOCK;
+		prng_fill(r, block, m);
+		for (size_t i = 0; i < m; i++)
+			out[i] = (fp_t)(block[i] >> (64 - FIX_FRACTION_BITS));
+		out += m;
+		n -= m;
+	}
+}
+
+// generator behind fp_random() (not thread safe, estimators own their state)
+static struct prng __fp_default_prng;
+static int __fp_default_seeded;
+
+void fp_seed(uint64_t seed)
+{
+	prng_seed(&__fp_default_prng, seed);
+	__fp_default_seeded = 1;
 }
 
 fp_t fp_random(void)
 {
 	// get a uniform random number [0, 1)
-	int32_t x = rand();
-	x &= FP_FRACTION_MASK; // make sure the integer part is zero
-	return x;
+	if (!__fp_default_seeded)
+		fp_seed(0);
+	return fp_random_r(&__fp_default_prng);
 }
-
@@ -0,0 +1,75 @@
+#pragma once
+/* *
+ * Seeded hash functions for deriving priorities from keys
+ *
+ * The mixer is the 64-bit finalizer of murmur3 (fmix64), which is a bijection
+ * with full avalanche.
+ *
+ * author: Farbod Shahinfar
+ * LICENSE: MIT
+ * */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+static __always_inline
+uint64_t hash_fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/* expand a user seed so that close seeds give unrelated hash functions */
+static __always_inline
+uint64_t hash_seed(uint64_t seed)
+{
+	return hash_fmix64(seed + 0x9e3779b97f4a7c15ULL);
+}
+
+/* hash of a 32-bit key (seed should come from hash_seed) */
+static __always_inline
+uint64_t hash_u32(uint32_t key, uint64_t seed)
+{
+	return hash_fmix64((uint64_t)key ^ seed);
+}
+
+static __always_inline
+uint64_t hash_u64(uint64_t key, uint64_t seed)
+{
+	return hash_fmix64(key ^ seed);
+}
+
+/* the high half goes through its own round so that the halves do not cancel */
+static __always_inline
+uint64_t hash_u128(unsigned __int128 key, uint64_t seed)
+{
+	return hash_fmix64((uint64_t)key ^ hash_fmix64((uint64_t)(key >> 64) ^ seed));
+}
+
+/* hash of a byte string, 8 bytes per round */
+static inline
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t w;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		h = hash_fmix64(h ^ w);
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, p, len);
+		h = hash_fmix64(h ^ w);
+	}
+	return hash_fmix64(h);
+}
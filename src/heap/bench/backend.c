@@ -0,0 +1,59 @@
+/* Per element cost of the CVM loop with the treap and with the heap as the
+ * buffer, over buffer sizes and the share of duplicates in the stream.
+ * */
+#include <stdio.h>
+
+#include "../../treap/treap.h"
+#include "../heap.h"
+#include "../../treap/bench/bench.h"
+
+#define ROUNDS (1 << 22)
+
+// the same CVM step for both data structures (random priorities)
+#define CVM_RUN(name, prefix, key_t) \
+static double name(uint32_t size, uint32_t universe) \
+{ \
+	key_t k; \
+	uint64_t seed = 7; \
+	uint32_t p = 1U << 31; \
+	struct prefix *t = prefix##_new_sized(size); \
+	uint64_t start = bench_now_ns(); \
+	for (uint32_t i = 0; i < ROUNDS; i++) { \
+		uint32_t v = bench_rand(&seed) % universe; \
+		uint32_t u = bench_rand(&seed); \
+		memcpy(k.data, &v, sizeof(v)); \
+		if (prefix##_upsert(t, &k, u, u < p) != -ENOSPC) \
+			continue; \
+		uint32_t top = prefix##_priority(t, prefix##_top(t)); \
+		if (u > top) { \
+			p = u; \
+			continue; \
+		} \
+		p = top; \
+		prefix##_replace_top(t, &k, u); \
+	} \
+	double ns = (double)(bench_now_ns() - start) / ROUNDS; \
+	prefix##_destroy(t); \
+	return ns; \
+}
+
+CVM_RUN(run_treap, treap, struct treap_key)
+CVM_RUN(run_heap, heap, struct heap_key)
+
+int main(int argc, char *argv[])
+{
+	// share of the stream that repeats a key seen before (about)
+	const double dups[] = {0.0, 0.5, 0.9, 0.99};
+	printf("%10s %6s %10s %10s\n", "size", "dups", "treap", "heap");
+	for (uint32_t size = 1 << 10; size <= (1 << 18); size <<= 2) {
+		for (int d = 0; d < sizeof(dups) / sizeof(dups[0]); d++) {
+			uint32_t universe = ROUNDS * (1 - dups[d]);
+			if (universe == 0)
+				universe = 1;
+			printf("%10u %6.2f %10.1f %10.1f\n", size, dups[d],
+				run_treap(size, universe),
+				run_heap(size, universe));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,476 @@
+#pragma once
+/* *
+ * Indexed 4-ary max-heap with a hash map from keys to entries
+ *
+ * An alternative to the treap for the CVM buffer with the same interface
+ * (find, insert, delete, upsert, top, replace_top). The keys are not kept in
+ * order: the heap orders the priorities and the hash map finds the keys.
+ * The heap array only holds (priority, handle) pairs, so the four children
+ * of an entry share a cache line; the keys stay in place in nodes[] and
+ * pos[] tracks where each handle is in the heap.
+ *
+ * author: Farbod Shahinfar
+ * LICENSE: MIT
+ * */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+#define HEAP_ARITY 4
+
+// Width of the priorities, 32 or 64 bits (like TREAP_PRIO_BITS)
+#ifndef HEAP_PRIO_BITS
+#define HEAP_PRIO_BITS 32
+#endif
+#if HEAP_PRIO_BITS == 32
+typedef uint32_t heap_prio_t;
+#elif HEAP_PRIO_BITS == 64
+typedef uint64_t heap_prio_t;
+#else
+#error "HEAP_PRIO_BITS should be 32 or 64"
+#endif
+
+// Keys are 4, 8 or 16 byte unsigned integers (HEAP_KEY_SIZE), or user
+// defined like for the treap (HEAP_CUSTOM_KEY)
+#ifndef HEAP_CUSTOM_KEY
+#ifndef HEAP_KEY_SIZE
+#define HEAP_KEY_SIZE 4
+#endif
+#if HEAP_KEY_SIZE == 4
+typedef uint32_t __heap_word_t;
+#elif HEAP_KEY_SIZE == 8
+typedef uint64_t __heap_word_t;
+#elif HEAP_KEY_SIZE == 16
+typedef unsigned __int128 __heap_word_t;
+#else
+#error "HEAP_KEY_SIZE should be 4, 8 or 16 (or define HEAP_CUSTOM_KEY)"
+#endif
+
+struct heap_key {
+	uint8_t data[HEAP_KEY_SIZE];
+};
+
+static __always_inline
+__heap_word_t __heap_key_load(const struct heap_key *a)
+{
+	__heap_word_t w;
+	memcpy(&w, a->data, sizeof(w));
+	return w;
+}
+
+static __always_inline
+int heap_key_less_than(struct heap_key *a, struct heap_key *b)
+{
+	return __heap_key_load(a) < __heap_key_load(b);
+}
+
+static __always_inline
+int heap_key_eq(struct heap_key *a, struct heap_key *b)
+{
+	return __heap_key_load(a) == __heap_key_load(b);
+}
+
+static __always_inline
+uint32_t heap_key_hash(struct heap_key *a)
+{
+	__heap_word_t w = __heap_key_load(a);
+#if HEAP_KEY_SIZE == 16
+	uint64_t x = (uint64_t)w ^ (uint64_t)(w >> 64);
+#else
+	uint64_t x = w;
+#endif
+	return (x * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static __always_inline
+void heap_key_set(struct heap_key *k, uint64_t v)
+{
+	__heap_word_t w = v;
+	memcpy(k->data, &w, sizeof(w));
+}
+
+static __always_inline
+uint64_t heap_key_get(struct heap_key *k)
+{
+	return (uint64_t)__heap_key_load(k);
+}
+#endif
+
+struct heap_node {
+	struct heap_key key;
+};
+
+struct __heap_entry {
+	heap_prio_t priority;
+	uint32_t handle; // index of the node in nodes[]
+};
+
+struct __heap_hslot {
+	uint32_t hash;
+	uint32_t ref; // handle + 1, zero when the slot is empty
+};
+
+// the arrays live in the same allocation as the struct
+struct heap {
+	uint32_t used;
+	uint32_t capacity;
+	struct __heap_entry *heap; // max-heap on the priority
+	uint32_t *pos; // position of each handle in heap[]
+	struct heap_node *nodes;
+	uint32_t *stack; // free handles
+	uint32_t hmask; // number of slots - 1 (a power of two)
+	struct __heap_hslot *hidx; // robin-hood table (key -> handle)
+};
+
+static void __heap_fill_stack(struct heap *h)
+{
+	for (uint32_t k = 0; k < h->capacity; k++)
+		h->stack[k] = h->capacity - k - 1;
+}
+
+/* allocate a heap that holds up to `capacity` keys */
+struct heap *heap_new_sized(uint32_t capacity)
+{
+	if (capacity == 0 || capacity > (1U << 30))
+		return NULL;
+	uint32_t slots = 8;
+	while (slots < 2 * capacity)
+		slots <<= 1;
+	size_t off_heap = (sizeof(struct heap) + 15) & ~(size_t)15;
+	size_t off_pos = off_heap + capacity * sizeof(struct __heap_entry);
+	size_t off_nodes = off_pos + capacity * sizeof(uint32_t);
+	size_t off_stack = (off_nodes + capacity * sizeof(struct heap_node) + 3)
+		& ~(size_t)3;
+	size_t off_hidx = off_stack + capacity * sizeof(uint32_t);
+	size_t total = off_hidx + slots * sizeof(struct __heap_hslot);
+	uint8_t *mem = calloc(1, total);
+	if (mem == NULL)
+		return NULL;
+	struct heap *h = (struct heap *)mem;
+	h->capacity = capacity;
+	h->heap = (struct __heap_entry *)(mem + off_heap);
+	h->pos = (uint32_t *)(mem + off_pos);
+	h->nodes = (struct heap_node *)(mem + off_nodes);
+	h->stack = (uint32_t *)(mem + off_stack);
+	h->hmask = slots - 1;
+	h->hidx = (struct __heap_hslot *)(mem + off_hidx);
+	__heap_fill_stack(h);
+	return h;
+}
+
+void heap_reset(struct heap *h)
+{
+	h->used = 0;
+	__heap_fill_stack(h);
+	memset(h->hidx, 0, ((size_t)h->hmask + 1) * sizeof(struct __heap_hslot));
+}
+
+void heap_destroy(struct heap *h)
+{
+	free(h);
+}
+
+static __always_inline
+uint32_t __heap_hdist(struct heap *h, uint32_t slot, uint32_t hash)
+{
+	return (slot - hash) & h->hmask;
+}
+
+/* the handle of the key or -1 */
+static inline int64_t __heap_hfind(struct heap *h, struct heap_key *key)
+{
+	uint32_t hash = heap_key_hash(key);
+	uint32_t i = hash & h->hmask;
+	for (uint32_t d = 0; d <= h->hmask; d++) {
+		struct __heap_hslot *s = &h->hidx[i];
+		if (s->ref == 0 || __heap_hdist(h, i, s->hash) < d)
+			return -1;
+		if (s->hash == hash && heap_key_eq(key, &h->nodes[s->ref - 1].key))
+			return s->ref - 1;
+		i = (i + 1) & h->hmask;
+	}
+	return -1;
+}
+
+static inline void __heap_hadd(struct heap *h, uint32_t handle)
+{
+	struct __heap_hslot cur = {heap_key_hash(&h->nodes[handle].key),
+		handle + 1};
+	uint32_t i = cur.hash & h->hmask;
+	uint32_t d = 0;
+	for (uint32_t k = 0; k <= h->hmask; k++) {
+		struct __heap_hslot *s = &h->hidx[i];
+		if (s->ref == 0) {
+			*s = cur;
+			return;
+		}
+		uint32_t sd = __heap_hdist(h, i, s->hash);
+		if (sd < d) {
+			struct __heap_hslot tmp = *s;
+			*s = cur;
+			cur = tmp;
+			d = sd;
+		}
+		i = (i + 1) & h->hmask;
+		d++;
+	}
+}
+
+static inline void __heap_hdel(struct heap *h, uint32_t handle)
+{
+	uint32_t i = heap_key_hash(&h->nodes[handle].key) & h->hmask;
+	uint32_t k;
+	for (k = 0; k <= h->hmask; k++) {
+		if (h->hidx[i].ref == handle + 1)
+			break;
+		i = (i + 1) & h->hmask;
+	}
+	for (k = 0; k <= h->hmask; k++) {
+		uint32_t j = (i + 1) & h->hmask;
+		struct __heap_hslot *s = &h->hidx[j];
+		if (s->ref == 0 || __heap_hdist(h, j, s->hash) == 0)
+			break;
+		h->hidx[i] = *s;
+		i = j;
+	}
+	h->hidx[i].ref = 0;
+}
+
+static __always_inline
+void __heap_set(struct heap *h, uint32_t i, struct __heap_entry e)
+{
+	h->heap[i] = e;
+	h->pos[e.handle] = i;
+}
+
+/* move the entry at `i` up until its parent has a higher priority */
+static inline void __heap_sift_up(struct heap *h, uint32_t i)
+{
+	struct __heap_entry e = h->heap[i];
+	while (i > 0) {
+		uint32_t parent = (i - 1) / HEAP_ARITY;
+		if (h->heap[parent].priority >= e.priority)
+			break;
+		__heap_set(h, i, h->heap[parent]);
+		i = parent;
+	}
+	__heap_set(h, i, e);
+}
+
+/* move the entry at `i` down until its children have lower priorities */
+static inline void __heap_sift_down(struct heap *h, uint32_t i)
+{
+	struct __heap_entry e = h->heap[i];
+	for (;;) {
+		uint32_t first = i * HEAP_ARITY + 1;
+		if (first >= h->used)
+			break;
+		uint32_t last = first + HEAP_ARITY;
+		if (last > h->used)
+			last = h->used;
+		uint32_t max = first;
+		for (uint32_t c = first + 1; c < last; c++)
+			if (h->heap[c].priority > h->heap[max].priority)
+				max = c;
+		if (h->heap[max].priority <= e.priority)
+			break;
+		__heap_set(h, i, h->heap[max]);
+		i = max;
+	}
+	__heap_set(h, i, e);
+}
+
+/* change the priority of the entry at `i` and restore the heap order */
+static __always_inline
+void __heap_update(struct heap *h, uint32_t i, heap_prio_t priority)
+{
+	heap_prio_t old = h->heap[i].priority;
+	h->heap[i].priority = priority;
+	if (priority > old)
+		__heap_sift_up(h, i);
+	else
+		__heap_sift_down(h, i);
+}
+
+static inline void __heap_remove_at(struct heap *h, uint32_t i)
+{
+	uint32_t handle = h->heap[i].handle;
+	__heap_hdel(h, handle);
+	h->stack[h->capacity - h->used] = handle;
+	h->used--;
+	if (i == h->used)
+		return;
+	// the last entry takes the hole
+	struct __heap_entry last = h->heap[h->used];
+	__heap_set(h, i, last);
+	if (i > 0 && h->heap[(i - 1) / HEAP_ARITY].priority < last.priority)
+		__heap_sift_up(h, i);
+	else
+		__heap_sift_down(h, i);
+}
+
+/* get the highest priority node */
+struct heap_node *heap_top(struct heap *h)
+{
+	if (h->used == 0)
+		return NULL;
+	return &h->nodes[h->heap[0].handle];
+}
+
+static __always_inline
+heap_prio_t heap_priority(struct heap *h, struct heap_node *n)
+{
+	return h->heap[h->pos[n - h->nodes]].priority;
+}
+
+struct heap_node *heap_find(struct heap *h, struct heap_key *key)
+{
+	int64_t handle = __heap_hfind(h, key);
+	return handle < 0 ? NULL : &h->nodes[handle];
+}
+
+static __always_inline
+uint8_t heap_has_space(struct heap *h)
+{
+	return h->used < h->capacity;
+}
+
+/* insert a key (it should not be in the heap already) */
+int heap_insert(struct heap *h, struct heap_key *k, heap_prio_t priority)
+{
+	if (h->used >= h->capacity)
+		return -ENOSPC;
+	uint32_t handle = h->stack[h->capacity - h->used - 1];
+	memcpy(&h->nodes[handle].key, k, sizeof(struct heap_key));
+	__heap_hadd(h, handle);
+	struct __heap_entry e = {priority, handle};
+	__heap_set(h, h->used, e);
+	h->used++;
+	__heap_sift_up(h, h->used - 1);
+	return 0;
+}
+
+/* return: zero on success, -1 if the key is not in the heap */
+int heap_delete(struct heap *h, struct heap_key *key)
+{
+	int64_t handle = __heap_hfind(h, key);
+	if (handle < 0)
+		return -1;
+	__heap_remove_at(h, h->pos[handle]);
+	return 0;
+}
+
+/* replace the key with the highest priority, never fails for lack of space */
+int heap_replace_top(struct heap *h, struct heap_key *key,
+		heap_prio_t priority)
+{
+	if (h->used == 0)
+		return -ENOENT;
+	uint32_t handle = h->heap[0].handle;
+	__heap_hdel(h, handle);
+	memcpy(&h->nodes[handle].key, key, sizeof(struct heap_key));
+	__heap_hadd(h, handle);
+	h->heap[0].priority = priority;
+	__heap_sift_down(h, 0);
+	return 0;
+}
+
+int heap_pop_top(struct heap *h)
+{
+	if (h->used == 0)
+		return -ENOENT;
+	__heap_remove_at(h, 0);
+	return 0;
+}
+
+enum heap_upsert_result {
+	HEAP_UPSERT_ABSENT = 0,
+	HEAP_UPSERT_DELETED,
+	HEAP_UPSERT_UPDATED,
+	HEAP_UPSERT_INSERTED,
+};
+
+/* same as treap_upsert: keep == 0 removes the key, otherwise its priority is
+ * set (inserting it if needed, -ENOSPC when there is no space)
+ * */
+int heap_upsert(struct heap *h, struct heap_key *key, heap_prio_t priority,
+		int keep)
+{
+	int64_t handle = __heap_hfind(h, key);
+	if (handle < 0) {
+		if (!keep)
+			return HEAP_UPSERT_ABSENT;
+		int ret = heap_insert(h, key, priority);
+		return ret < 0 ? ret : HEAP_UPSERT_INSERTED;
+	}
+	if (!keep) {
+		__heap_remove_at(h, h->pos[handle]);
+		return HEAP_UPSERT_DELETED;
+	}
+	__heap_update(h, h->pos[handle], priority);
+	return HEAP_UPSERT_UPDATED;
+}
+
+struct __heap_pair {
+	struct heap_key key;
+	heap_prio_t priority;
+};
+
+static int __heap_pair_cmp(const void *a, const void *b)
+{
+	struct heap_key *x = &((struct __heap_pair *)a)->key;
+	struct heap_key *y = &((struct __heap_pair *)b)->key;
+	return heap_key_less_than(x, y) ? -1 : heap_key_less_than(y, x);
+}
+
+/* write the keys and priorities in key order (sorted on the way out, in
+ * O(n log n)), the arrays should have space for h->used entries
+ * */
+int heap_export_sorted(struct heap *h, struct heap_key *keys,
+		heap_prio_t *prios)
+{
+	struct __heap_pair *pairs = malloc((h->used + 1) * sizeof(*pairs));
+	if (pairs == NULL)
+		return -ENOMEM;
+	for (uint32_t i = 0; i < h->used; i++) {
+		pairs[i].key = h->nodes[h->heap[i].handle].key;
+		pairs[i].priority = h->heap[i].priority;
+	}
+	qsort(pairs, h->used, sizeof(*pairs), __heap_pair_cmp);
+	for (uint32_t i = 0; i < h->used; i++) {
+		keys[i] = pairs[i].key;
+		prios[i] = pairs[i].priority;
+	}
+	free(pairs);
+	return 0;
+}
+
+/* Replace the content of the heap with `n` keys (distinct, in any order) in
+ * O(n) by sifting down the entries of the array from the last parent up.
+ * return: -ENOSPC if n is above the capacity
+ * */
+int heap_build_sorted(struct heap *h, struct heap_key *keys, heap_prio_t *prios,
+		uint32_t n)
+{
+	if (n > h->capacity)
+		return -ENOSPC;
+	heap_reset(h);
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t handle = h->stack[h->capacity - i - 1];
+		memcpy(&h->nodes[handle].key, &keys[i], sizeof(struct heap_key));
+		__heap_hadd(h, handle);
+		struct __heap_entry e = {prios[i], handle};
+		__heap_set(h, i, e);
+	}
+	h->used = n;
+	if (n > 1)
+		for (uint32_t i = (n - 2) / HEAP_ARITY + 1; i-- > 0;)
+			__heap_sift_down(h, i);
+	return 0;
+}
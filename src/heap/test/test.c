@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "../heap.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+#define CAPACITY 1000
+#define UNIVERSE 3000
+#define ROUNDS 200000
+
+typedef bool(*test_fn)(void);
+
+static struct heap_key mkkey(uint32_t v)
+{
+	struct heap_key k;
+	heap_key_set(&k, v);
+	return k;
+}
+
+/* heap order, positions and the hash map agree */
+static bool heap_valid(struct heap *h)
+{
+	for (uint32_t i = 0; i < h->used; i++) {
+		uint32_t handle = h->heap[i].handle;
+		if (h->pos[handle] != i)
+			return false;
+		if (i > 0 && h->heap[(i - 1) / HEAP_ARITY].priority <
+				h->heap[i].priority)
+			return false;
+		if (heap_find(h, &h->nodes[handle].key) != &h->nodes[handle])
+			return false;
+	}
+	return true;
+}
+
+bool test_basic(void)
+{
+	struct heap *h = heap_new_sized(4);
+	ASSERT(h != NULL, "failed to allocate the heap");
+	ASSERT(heap_top(h) == NULL, "new heap is not empty");
+	for (uint32_t i = 0; i < 4; i++) {
+		struct heap_key k = mkkey(i);
+		ASSERT(heap_insert(h, &k, 10 * i) == 0, "insert failed");
+	}
+	struct heap_key k = mkkey(9);
+	ASSERT(heap_insert(h, &k, 5) == -ENOSPC, "insert in a full heap");
+	ASSERT(heap_priority(h, heap_top(h)) == 30, "wrong top");
+	ASSERT(heap_replace_top(h, &k, 5) == 0, "replace top failed");
+	ASSERT(heap_priority(h, heap_top(h)) == 20, "wrong top after replace");
+	ASSERT(heap_find(h, &k) != NULL, "replaced key is not found");
+	k = mkkey(3);
+	ASSERT(heap_find(h, &k) == NULL, "old top is still found");
+	k = mkkey(1);
+	ASSERT(heap_delete(h, &k) == 0, "delete failed");
+	ASSERT(heap_delete(h, &k) == -1, "deleted twice");
+	ASSERT(heap_valid(h), "invalid heap");
+	heap_destroy(h);
+	return true;
+}
+
+/* random operations against a plain array */
+bool test_random(void)
+{
+	static int64_t ref[UNIVERSE];
+	uint64_t seed = 11;
+	uint32_t used = 0;
+	struct heap *h = heap_new_sized(CAPACITY);
+	ASSERT(h != NULL, "failed to allocate the heap");
+	for (uint32_t v = 0; v < UNIVERSE; v++)
+		ref[v] = -1;
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint32_t v = (seed >> 33) % UNIVERSE;
+		uint32_t prio = (seed >> 8) & 0xffffff;
+		int keep = (seed >> 40) & 1;
+		struct heap_key k = mkkey(v);
+		int ret = heap_upsert(h, &k, prio, keep);
+		if (!keep) {
+			ASSERT(ret == (ref[v] < 0 ? HEAP_UPSERT_ABSENT : HEAP_UPSERT_DELETED),
+				"unexpected result of a delete (%d)", ret);
+			used -= ref[v] >= 0;
+			ref[v] = -1;
+		} else if (ref[v] >= 0) {
+			ASSERT(ret == HEAP_UPSERT_UPDATED, "unexpected result of an update");
+			ref[v] = prio;
+		} else if (used < CAPACITY) {
+			ASSERT(ret == HEAP_UPSERT_INSERTED, "unexpected result of an insert");
+			ref[v] = prio;
+			used++;
+		} else {
+			ASSERT(ret == -ENOSPC, "insert in a full heap");
+			// evict the top like CVM does
+			uint32_t top = heap_key_get(&heap_top(h)->key);
+			ASSERT(heap_pop_top(h) == 0, "pop failed");
+			ref[top] = -1;
+			used--;
+		}
+		ASSERT(h->used == used, "wrong size %u != %u", h->used, used);
+	}
+	ASSERT(heap_valid(h), "invalid heap");
+	int64_t max = -1;
+	for (uint32_t v = 0; v < UNIVERSE; v++) {
+		struct heap_key k = mkkey(v);
+		struct heap_node *n = heap_find(h, &k);
+		ASSERT((n != NULL) == (ref[v] >= 0), "membership of %u is wrong", v);
+		if (n != NULL)
+			ASSERT(heap_priority(h, n) == ref[v], "priority of %u is wrong", v);
+		if (ref[v] > max)
+			max = ref[v];
+	}
+	ASSERT(heap_priority(h, heap_top(h)) == max, "top is not the maximum");
+
+	// export is sorted by key
+	struct heap_key keys[CAPACITY];
+	heap_prio_t prios[CAPACITY];
+	ASSERT(heap_export_sorted(h, keys, prios) == 0, "export failed");
+	for (uint32_t i = 1; i < h->used; i++)
+		ASSERT(heap_key_less_than(&keys[i - 1], &keys[i]), "export is not sorted");
+	heap_destroy(h);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING HEAP\n"
+		"...........................................\n");
+	bool res;
+	test_fn suite[] = {test_basic, test_random,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
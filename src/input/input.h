@@ -0,0 +1,392 @@
+#pragma once
+/* *
+ * Input stage for streams of integer keys
+ *
+ * Regular files are memory-mapped, pipes and stdin are read in large blocks.
+ * Keys are either decimal numbers separated by any non-digit character, or
+ * raw little-endian u32/u64 records. Lines of text (e.g. URLs) are returned
+ * as they are by input_read_lines. A mapped input can be split in views that
+ * are read by different threads.
+ *
+ * author: Farbod Shahinfar
+ * LICENSE: MIT
+ * */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+// the type the keys are parsed into (wider values are truncated)
+#ifndef INPUT_KEY_TYPE
+#define INPUT_KEY_TYPE uint64_t
+#endif
+
+// size of a block when the input can not be memory-mapped
+#ifndef INPUT_BLOCK_SIZE
+#define INPUT_BLOCK_SIZE (1 << 20)
+#endif
+
+// the SWAR parser loads 8 bytes at a time, the block buffer is padded so it
+// never reads past the allocation
+#define INPUT_PADDING 8
+// the decimal numbers are parsed in chunks of 8 digits, enough for u64 max
+// (20 digits) with leading zeros. Numbers of more digits than the chunks hold
+// and values above u64 max are rejected
+#define INPUT_MAX_DIGITS 20
+
+enum input_format {
+	INPUT_TEXT,
+	INPUT_U32,
+	INPUT_U64,
+	INPUT_LINES,
+};
+
+struct input {
+	int fd;
+	enum input_format fmt;
+	uint8_t mapped; // is the whole file mapped in memory
+	uint8_t eof; // nothing more to read from fd
+	const uint8_t *cur; // next byte to parse
+	const uint8_t *end; // end of the bytes available
+	uint8_t *map; // the mapped file
+	size_t map_sz;
+	uint8_t *buf; // block buffer (when not mapped)
+	uint64_t bytes; // number of bytes consumed so far
+};
+
+/* open the file at `path` ("-" for stdin)
+ * */
+int input_open(struct input *in, const char *path, enum input_format fmt)
+{
+	struct stat st;
+	memset(in, 0, sizeof(*in));
+	in->fmt = fmt;
+	if (strcmp(path, "-") == 0) {
+		in->fd = STDIN_FILENO;
+	} else {
+		in->fd = open(path, O_RDONLY);
+		if (in->fd < 0)
+			return -errno;
+	}
+	if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			in->mapped = 1;
+			in->eof = 1;
+			in->map = m;
+			in->map_sz = st.st_size;
+			in->cur = in->map;
+			in->end = in->map + in->map_sz;
+			return 0;
+		}
+	}
+	// fallback to reading blocks
+	in->buf = malloc(INPUT_BLOCK_SIZE + INPUT_PADDING);
+	if (in->buf == NULL) {
+		if (in->fd != STDIN_FILENO)
+			close(in->fd);
+		return -ENOMEM;
+	}
+	in->cur = in->end = in->buf;
+	return 0;
+}
+
+void input_close(struct input *in)
+{
+	// views do not own the mapping nor the file
+	if (in->map != NULL)
+		munmap(in->map, in->map_sz);
+	free(in->buf);
+	if (in->fd >= 0 && in->fd != STDIN_FILENO)
+		close(in->fd);
+}
+
+/* Split the mapped input in `parts` views of about the same size, views[i]
+ * reads the i-th range. Ranges start at a record or a number boundary so
+ * every key is read by exactly one view. The views share the mapping and must
+ * not outlive `in`.
+ * return: -EINVAL if the input is not mapped
+ * */
+int input_split(struct input *in, struct input *views, uint32_t parts)
+{
+	if (!in->mapped || parts == 0)
+		return -EINVAL;
+	const uint8_t *base = in->cur;
+	const size_t size = in->end - in->cur;
+	const size_t rec = in->fmt == INPUT_U32 ? 4 : 8;
+	size_t begin = 0;
+	for (uint32_t i = 0; i < parts; i++) {
+		size_t end = size;
+		if (i + 1 < parts) {
+			end = size / parts * (i + 1);
+			if (end < begin)
+				end = begin;
+			if (in->fmt == INPUT_TEXT) {
+				// do not cut a number in two
+				while (end < size && end > 0 &&
+						(uint8_t)(base[end - 1] - '0') < 10)
+					end++;
+			} else if (in->fmt == INPUT_LINES) {
+				while (end < size && end > 0 && base[end - 1] != '\n')
+					end++;
+			} else {
+				end -= end % rec;
+			}
+		}
+		memset(&views[i], 0, sizeof(struct input));
+		views[i].fd = -1;
+		views[i].fmt = in->fmt;
+		views[i].mapped = 1;
+		views[i].eof = 1;
+		views[i].cur = base + begin;
+		views[i].end = base + end;
+		begin = end;
+	}
+	return 0;
+}
+
+/* move the unparsed tail to the start of the block and read more bytes
+ * */
+static int __input_refill(struct input *in)
+{
+	size_t left = in->end - in->cur;
+	memmove(in->buf, in->cur, left);
+	in->cur = in->buf;
+	in->end = in->buf + left;
+	while (!in->eof && in->end < in->buf + INPUT_BLOCK_SIZE) {
+		ssize_t r = read(in->fd, (uint8_t *)in->end,
+				in->buf + INPUT_BLOCK_SIZE - in->end);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (r == 0) {
+			in->eof = 1;
+			break;
+		}
+		in->end += r;
+	}
+	return 0;
+}
+
+static __always_inline
+uint64_t __load_u64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return le64toh(x);
+}
+
+/* number of leading (in memory order) decimal digits in the 8 bytes of x
+ * */
+static __always_inline
+uint32_t __swar_count_digits(uint64_t x)
+{
+	// a byte is a digit if its high nibble is 3 and adding 6 does not move
+	// it out of the 0x30 block. Carries only come from non-digit bytes and
+	// only corrupt the bytes after them, which we do not look at.
+	uint64_t a = x & 0xF0F0F0F0F0F0F0F0ULL;
+	uint64_t b = (x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL;
+	uint64_t m = (a ^ 0x3030303030303030ULL) | (b ^ 0x3030303030303030ULL);
+	// set the high bit of every non-zero byte
+	m = (((m & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | m)
+		& 0x8080808080808080ULL;
+	if (m == 0)
+		return 8;
+	return __builtin_ctzll(m) >> 3;
+}
+
+/* value of the first `len` (1..8) digits stored in x
+ * */
+static __always_inline
+uint64_t __swar_parse_digits(uint64_t x, uint32_t len)
+{
+	x -= 0x3030303030303030ULL;
+	// drop the bytes after the number and align its last digit to the
+	// last byte (the missing leading digits become zeros)
+	x <<= (8 - len) * 8;
+	x = (x * 10 + (x >> 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x * 100 + (x >> 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x * 10000 + (x >> 32)) & 0x00000000FFFFFFFFULL;
+	return x;
+}
+
+static const uint64_t __pow10[9] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+/* parse decimal keys in [cur, limit), every number must be terminated before
+ * `limit` unless `last` is set. The 8 byte loads may read up to `safe` bytes.
+ * return: number of keys, -ERANGE when the next number does not fit in 64 bits
+ * */
+static ssize_t __input_parse_text(struct input *in, const uint8_t *limit,
+		const uint8_t *safe, int last, INPUT_KEY_TYPE *out, size_t n)
+{
+	const uint8_t *p = in->cur;
+	size_t count = 0;
+	while (count < n) {
+		// skip separators
+		while (p < limit && (uint8_t)(*p - '0') >= 10)
+			p++;
+		if (p >= limit)
+			break;
+		uint64_t v = 0;
+		const uint8_t *start = p;
+		uint32_t k;
+		int over = 0;
+		for (k = 0; k < (INPUT_MAX_DIGITS + 7) / 8; k++) {
+			uint32_t len;
+			if (p + 8 <= safe) {
+				uint64_t x = __load_u64(p);
+				len = __swar_count_digits(x);
+				if (p + len > limit)
+					len = limit - p;
+				if (len == 0)
+					break;
+				over |= __builtin_mul_overflow(v, __pow10[len], &v);
+				over |= __builtin_add_overflow(v,
+						__swar_parse_digits(x, len), &v);
+			} else {
+				// close to the end of the data, go byte by byte
+				len = 0;
+				while (len < 8 && p + len < limit &&
+						(uint8_t)(p[len] - '0') < 10) {
+					over |= __builtin_mul_overflow(v, 10, &v);
+					over |= __builtin_add_overflow(v,
+							p[len] - '0', &v);
+					len++;
+				}
+				if (len == 0)
+					break;
+			}
+			p += len;
+			if (len < 8)
+				break;
+		}
+		if (p >= limit && !last) {
+			// the number may continue in the next block
+			p = start;
+			break;
+		}
+		// more digits than the chunks hold
+		if (p < limit && (uint8_t)(*p - '0') < 10)
+			over = 1;
+		if (over) {
+			// stop at the number, the keys before it are returned
+			p = start;
+			if (count == 0)
+				return -ERANGE;
+			break;
+		}
+		out[count++] = (INPUT_KEY_TYPE)v;
+	}
+	in->bytes += p - in->cur;
+	in->cur = p;
+	return count;
+}
+
+static size_t __input_parse_binary(struct input *in, INPUT_KEY_TYPE *out, size_t n)
+{
+	const size_t rec = in->fmt == INPUT_U32 ? 4 : 8;
+	size_t avail = (in->end - in->cur) / rec;
+	if (avail < n)
+		n = avail;
+	const uint8_t *p = in->cur;
+	if (rec == 4) {
+		for (size_t i = 0; i < n; i++) {
+			uint32_t x;
+			memcpy(&x, p + i * 4, 4);
+			out[i] = (INPUT_KEY_TYPE)le32toh(x);
+		}
+	} else {
+		for (size_t i = 0; i < n; i++)
+			out[i] = (INPUT_KEY_TYPE)__load_u64(p + i * 8);
+	}
+	in->cur += n * rec;
+	in->bytes += n * rec;
+	return n;
+}
+
+/* read up to `n` keys into `out`.
+ * return: number of keys, zero at the end of the input, negative on error
+ * (-ERANGE for a decimal number above u64 max)
+ * */
+ssize_t input_read(struct input *in, INPUT_KEY_TYPE *out, size_t n)
+{
+	int ret;
+	ssize_t count;
+	for (;;) {
+		if (in->fmt == INPUT_TEXT) {
+			const uint8_t *safe = in->mapped ? in->end : in->end + INPUT_PADDING;
+			count = __input_parse_text(in, in->end, safe, in->eof, out, n);
+		} else {
+			count = __input_parse_binary(in, out, n);
+		}
+		if (count != 0)
+			return count;
+		if (in->eof) {
+			// a truncated binary record at the end of the input
+			if (in->cur != in->end && in->fmt != INPUT_TEXT)
+				return -EINVAL;
+			return 0;
+		}
+		ret = __input_refill(in);
+		if (ret != 0)
+			return ret;
+	}
+}
+
+/* Read up to `n` lines (without the line break, empty lines are skipped).
+ * The lines point into the input and are valid until the next read. A line
+ * longer than INPUT_BLOCK_SIZE is cut when the input is not mapped.
+ * return: number of lines, zero at the end of the input, negative on error
+ * */
+ssize_t input_read_lines(struct input *in, const uint8_t **lines,
+		uint32_t *lens, size_t n)
+{
+	int ret;
+	size_t count = 0;
+	for (;;) {
+		while (count < n && in->cur < in->end) {
+			const uint8_t *nl = memchr(in->cur, '\n', in->end - in->cur);
+			const uint8_t *next;
+			if (nl == NULL) {
+				int cut = !in->mapped && in->cur == in->buf &&
+					in->end == in->buf + INPUT_BLOCK_SIZE;
+				if (!in->eof && !cut)
+					break;
+				// the last line has no line break
+				nl = next = in->end;
+			} else {
+				next = nl + 1;
+			}
+			size_t len = nl - in->cur;
+			if (len > 0 && in->cur[len - 1] == '\r')
+				len--;
+			if (len > 0) {
+				lines[count] = in->cur;
+				lens[count] = len;
+				count++;
+			}
+			in->bytes += next - in->cur;
+			in->cur = next;
+		}
+		if (count > 0 || in->eof)
+			return count;
+		ret = __input_refill(in);
+		if (ret != 0)
+			return ret;
+	}
+}
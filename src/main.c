@@ -0,0 +1,283 @@
+/* Estimate the number of distinct elements in a stream of integers using the
+ * CVM library.
+ *
+ * With more than one thread every worker feeds its own sketch and the
+ * sketches are merged at the end. Mapped files are split in one range per
+ * worker, other inputs are shared and read a chunk at a time.
+ *
+ * @author: Farbod Shahinfar
+ * @date: March, 2025
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cvm.h"
+#define INPUT_KEY_TYPE cvm_key_t
+#include "input/input.h"
+
+// The buffer size we want to use for CVM (|B| in the Knuth's CVM paper)
+#define BUFFER_SIZE (1 << 10)
+// Defaults when sizing the buffer for an accuracy target
+#define DELTA 0.01
+#define STREAM_LEN 1000000000ULL
+// Number of keys parsed before handing them to the estimator
+#define CHUNK_SIZE 4096
+// Upper bound on the number of worker threads
+#define MAX_THREADS 256
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-f text|u32|u64|lines] [-s buffer_size]\n"
+		"       [-e epsilon [-d delta] [-m stream_len]] [-r seed] [-k seed]\n"
+		"       [-j threads] <file|->\n"
+		"  -f  format of the input: decimal text (default, numbers\n"
+		"      above 2^64 - 1 are an error), raw little-endian 32/64\n"
+		"      bit keys or one string per line (counted by their\n"
+		"      %d-bit fingerprint)\n"
+		"  -s  number of keys in the CVM buffer (default: %d)\n"
+		"  -e  size the buffer for a relative error of epsilon with\n"
+		"      probability 1 - delta (default: %g) on streams of up to\n"
+		"      stream_len elements (default: %g)\n"
+		"  -r  seed of the random stream (default: current time)\n"
+		"  -k  use a hash of the key (with this seed) as its priority\n"
+		"  -j  number of worker threads (default: 1), more than one\n"
+		"      implies -k so that the sketches can be merged\n",
+		prog, CVM_KEY_BITS, BUFFER_SIZE, DELTA, (double)STREAM_LEN);
+}
+
+struct worker {
+	pthread_t thread;
+	struct cvm_impl *cvm;
+	struct input *in;
+	// set when the input is shared with other workers
+	pthread_mutex_t *lock;
+	uint64_t count;
+	uint64_t parse_ns;
+	uint64_t cvm_ns;
+	int ret;
+};
+
+/* read up to `n` keys, lines are replaced by their fingerprint (before the
+ * next read moves them)
+ * */
+static ssize_t read_keys(struct input *in, cvm_key_t *keys, size_t n)
+{
+	const uint8_t *lines[CHUNK_SIZE];
+	uint32_t lens[CHUNK_SIZE];
+	if (in->fmt != INPUT_LINES)
+		return input_read(in, keys, n);
+	if (n > CHUNK_SIZE)
+		n = CHUNK_SIZE;
+	ssize_t count = input_read_lines(in, lines, lens, n);
+	for (ssize_t i = 0; i < count; i++)
+		keys[i] = cvm_fingerprint(lines[i], lens[i]);
+	return count;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	cvm_key_t *keys = malloc(CHUNK_SIZE * sizeof(cvm_key_t));
+	if (keys == NULL) {
+		fprintf(stderr, "failed to allocate the key buffer\n");
+		w->ret = -ENOMEM;
+		return NULL;
+	}
+	for (;;) {
+		uint64_t t0 = now_ns();
+		if (w->lock != NULL)
+			pthread_mutex_lock(w->lock);
+		ssize_t n = read_keys(w->in, keys, CHUNK_SIZE);
+		if (w->lock != NULL)
+			pthread_mutex_unlock(w->lock);
+		uint64_t t1 = now_ns();
+		w->parse_ns += t1 - t0;
+		if (n < 0) {
+			fprintf(stderr, "failed to read the input: %s\n", strerror(-n));
+			w->ret = n;
+			break;
+		}
+		if (n == 0)
+			break;
+		w->ret = cvm_add_batch(w->cvm, keys, n);
+		w->cvm_ns += now_ns() - t1;
+		if (w->ret != 0) {
+			fprintf(stderr, "failed to add keys: %d\n", w->ret);
+			break;
+		}
+		w->count += n;
+	}
+	free(keys);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	enum input_format fmt = INPUT_TEXT;
+	uint32_t buffer_size = BUFFER_SIZE;
+	double epsilon = 0, delta = DELTA;
+	uint64_t stream_len = STREAM_LEN;
+	uint64_t seed = time(0), hash_seed = 0;
+	int hashed = 0;
+	uint32_t threads = 1;
+	while ((opt = getopt(argc, argv, "f:s:e:d:m:r:k:j:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "text") == 0) {
+				fmt = INPUT_TEXT;
+			} else if (strcmp(optarg, "u32") == 0) {
+				fmt = INPUT_U32;
+			} else if (strcmp(optarg, "u64") == 0) {
+				fmt = INPUT_U64;
+			} else if (strcmp(optarg, "lines") == 0) {
+				fmt = INPUT_LINES;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			buffer_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			epsilon = strtod(optarg, NULL);
+			break;
+		case 'd':
+			delta = strtod(optarg, NULL);
+			break;
+		case 'm':
+			stream_len = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'k':
+			hashed = 1;
+			hash_seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 10);
+			if (threads == 0 || threads > MAX_THREADS) {
+				fprintf(stderr, "threads should be in [1, %d]\n",
+					MAX_THREADS);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (epsilon != 0) {
+		buffer_size = cvm_buffer_size(epsilon, delta, stream_len);
+		if (buffer_size == 0) {
+			fprintf(stderr, "invalid accuracy target\n");
+			return 1;
+		}
+	}
+
+	// random priorities can only be merged when the workers see disjoint
+	// keys, with split inputs the same key shows up in many workers
+	if (threads > 1 && !hashed) {
+		hashed = 1;
+		hash_seed = seed;
+	}
+
+	static struct worker workers[MAX_THREADS];
+	static struct cvm_impl *sketches[MAX_THREADS];
+	for (uint32_t i = 0; i < threads; i++) {
+		sketches[i] = cvm_new(buffer_size);
+		if (sketches[i] == NULL) {
+			fprintf(stderr, "failed to allocate the estimator\n");
+			return 1;
+		}
+		cvm_seed(sketches[i], seed + i);
+		if (hashed)
+			cvm_set_hash_priority(sketches[i], hash_seed);
+		workers[i].cvm = sketches[i];
+	}
+
+	struct input in;
+	static struct input views[MAX_THREADS];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret = input_open(&in, argv[optind], fmt);
+	if (ret != 0) {
+		fprintf(stderr, "failed to open the input: %s\n", strerror(-ret));
+		return 1;
+	}
+	int split = threads > 1 && input_split(&in, views, threads) == 0;
+	for (uint32_t i = 0; i < threads; i++) {
+		workers[i].in = split ? &views[i] : &in;
+		workers[i].lock = threads > 1 && !split ? &lock : NULL;
+	}
+
+	uint64_t start = now_ns();
+	if (threads == 1) {
+		worker_run(&workers[0]);
+	} else {
+		for (uint32_t i = 0; i < threads; i++) {
+			ret = pthread_create(&workers[i].thread, NULL, worker_run,
+					&workers[i]);
+			if (ret != 0) {
+				fprintf(stderr, "failed to start a worker: %s\n",
+					strerror(ret));
+				return 1;
+			}
+		}
+		for (uint32_t i = 0; i < threads; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	uint64_t merge_start = now_ns();
+	ret = cvm_merge_many(sketches, threads);
+	uint64_t finish = now_ns();
+	if (ret != 0) {
+		fprintf(stderr, "failed to merge the sketches: %d\n", ret);
+		return 1;
+	}
+
+	uint64_t count = 0, bytes = split ? 0 : in.bytes;
+	uint64_t parse_ns = 0, cvm_ns = 0;
+	for (uint32_t i = 0; i < threads; i++) {
+		if (workers[i].ret != 0)
+			return 1;
+		count += workers[i].count;
+		parse_ns += workers[i].parse_ns;
+		cvm_ns += workers[i].cvm_ns;
+		if (split)
+			bytes += views[i].bytes;
+	}
+
+	struct cvm_impl *cvm = sketches[0];
+	printf("|B|: %d   p: %f\n", cvm_buffer_used(cvm), cvm_probability(cvm));
+	printf("Estimate: %ld\n", cvm_estimate(cvm));
+	printf("keys: %lu\n", count);
+	// per thread rates
+	printf("parse:     %8.2f Mkeys/s  %8.2f MB/s\n",
+		count * 1e3 / (parse_ns ? parse_ns : 1),
+		bytes * 1e3 / (parse_ns ? parse_ns : 1));
+	printf("estimator: %8.2f Mkeys/s\n",
+		count * 1e3 / (cvm_ns ? cvm_ns : 1));
+	printf("threads: %u  total: %8.2f Mkeys/s  merge: %.3f ms\n", threads,
+		count * 1e3 / (finish - start), (finish - merge_start) / 1e6);
+	input_close(&in);
+	for (uint32_t i = 0; i < threads; i++)
+		cvm_destroy(sketches[i]);
+	return 0;
+}
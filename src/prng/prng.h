@@ -0,0 +1,210 @@
+#pragma once
+/* *
+ * Pseudo random number generators for the estimators
+ *
+ * The default engine is xoshiro256** run as PRNG_LANES independent lanes.
+ * Single draws and bulk fills return the same sequence, the bulk fill steps
+ * all the lanes at once (with AVX2 when it is available). Define PRNG_WYRAND
+ * to use wyrand instead (a single 64-bit counter, smaller state).
+ *
+ * The state is explicit so every estimator (or thread) owns its own
+ * generator and no lock is taken.
+ *
+ * author: Farbod Shahinfar
+ * LICENSE: MIT
+ * */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+/* splitmix64, used for expanding seeds */
+static __always_inline
+uint64_t prng_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+#ifndef PRNG_WYRAND
+
+#define PRNG_LANES 4
+
+struct prng {
+	uint64_t s[4][PRNG_LANES]; // s[j][lane] is word j of the lane's state
+	uint64_t buf[PRNG_LANES]; // outputs of the last step
+	uint32_t idx; // next unused output in buf
+};
+
+static __always_inline
+uint64_t __prng_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+/* advance every lane once and write one output per lane */
+static __always_inline
+void __prng_step(struct prng *r, uint64_t *out)
+{
+	for (int l = 0; l < PRNG_LANES; l++) {
+		uint64_t s0 = r->s[0][l], s1 = r->s[1][l];
+		uint64_t s2 = r->s[2][l], s3 = r->s[3][l];
+		out[l] = __prng_rotl(s1 * 5, 7) * 9;
+		uint64_t t = s1 << 17;
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = __prng_rotl(s3, 45);
+		r->s[0][l] = s0;
+		r->s[1][l] = s1;
+		r->s[2][l] = s2;
+		r->s[3][l] = s3;
+	}
+}
+
+void prng_seed(struct prng *r, uint64_t seed)
+{
+	for (int j = 0; j < 4; j++)
+		for (int l = 0; l < PRNG_LANES; l++)
+			r->s[j][l] = prng_splitmix64(&seed);
+	r->idx = PRNG_LANES;
+}
+
+static __always_inline
+uint64_t prng_next(struct prng *r)
+{
+	if (r->idx >= PRNG_LANES) {
+		__prng_step(r, r->buf);
+		r->idx = 0;
+	}
+	return r->buf[r->idx++];
+}
+
+#ifdef __AVX2__
+static __always_inline
+__m256i __prng_rotl_v(__m256i x, int k)
+{
+	return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+}
+
+/* whole steps written straight to out (n is a multiple of PRNG_LANES) */
+static void __prng_fill_steps(struct prng *r, uint64_t *out, size_t n)
+{
+	__m256i s0 = _mm256_loadu_si256((__m256i *)r->s[0]);
+	__m256i s1 = _mm256_loadu_si256((__m256i *)r->s[1]);
+	__m256i s2 = _mm256_loadu_si256((__m256i *)r->s[2]);
+	__m256i s3 = _mm256_loadu_si256((__m256i *)r->s[3]);
+	for (size_t i = 0; i < n; i += PRNG_LANES) {
+		// x * 5 and x * 9 as shifts and adds, AVX2 has no 64-bit mullo
+		__m256i x = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+		x = __prng_rotl_v(x, 7);
+		x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+		_mm256_storeu_si256((__m256i *)(out + i), x);
+		__m256i t = _mm256_slli_epi64(s1, 17);
+		s2 = _mm256_xor_si256(s2, s0);
+		s3 = _mm256_xor_si256(s3, s1);
+		s1 = _mm256_xor_si256(s1, s2);
+		s0 = _mm256_xor_si256(s0, s3);
+		s2 = _mm256_xor_si256(s2, t);
+		s3 = __prng_rotl_v(s3, 45);
+	}
+	_mm256_storeu_si256((__m256i *)r->s[0], s0);
+	_mm256_storeu_si256((__m256i *)r->s[1], s1);
+	_mm256_storeu_si256((__m256i *)r->s[2], s2);
+	_mm256_storeu_si256((__m256i *)r->s[3], s3);
+}
+#else
+static void __prng_fill_steps(struct prng *r, uint64_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i += PRNG_LANES)
+		__prng_step(r, out + i);
+}
+#endif
+
+/* fill out with the next n outputs (the same values n prng_next() calls
+ * would return)
+ * */
+void prng_fill(struct prng *r, uint64_t *out, size_t n)
+{
+	size_t i = 0;
+	// drain what is left from the last step
+	while (i < n && r->idx < PRNG_LANES)
+		out[i++] = r->buf[r->idx++];
+	size_t whole = (n - i) / PRNG_LANES * PRNG_LANES;
+	__prng_fill_steps(r, out + i, whole);
+	i += whole;
+	while (i < n)
+		out[i++] = prng_next(r);
+}
+
+// identifies the engine and the size of its saved state
+#define PRNG_ENGINE 0
+#define PRNG_STATE_WORDS (5 * PRNG_LANES + 1)
+
+/* copy the state to PRNG_STATE_WORDS plain words (e.g. for a checkpoint) */
+void prng_save(const struct prng *r, uint64_t *w)
+{
+	memcpy(w, r->s, sizeof(r->s));
+	memcpy(w + 4 * PRNG_LANES, r->buf, sizeof(r->buf));
+	w[5 * PRNG_LANES] = r->idx;
+}
+
+void prng_load(struct prng *r, const uint64_t *w)
+{
+	memcpy(r->s, w, sizeof(r->s));
+	memcpy(r->buf, w + 4 * PRNG_LANES, sizeof(r->buf));
+	r->idx = w[5 * PRNG_LANES] < PRNG_LANES ? w[5 * PRNG_LANES] : PRNG_LANES;
+}
+
+#else // PRNG_WYRAND
+
+struct prng {
+	uint64_t s;
+};
+
+void prng_seed(struct prng *r, uint64_t seed)
+{
+	r->s = prng_splitmix64(&seed);
+}
+
+static __always_inline
+uint64_t prng_next(struct prng *r)
+{
+	r->s += 0xa0761d6478bd642fULL;
+	__uint128_t m = (__uint128_t)r->s * (r->s ^ 0xe7037ed1a0b428dbULL);
+	return (uint64_t)(m >> 64) ^ (uint64_t)m;
+}
+
+/* every output only depends on the counter, the iterations are independent */
+void prng_fill(struct prng *r, uint64_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = prng_next(r);
+}
+
+#define PRNG_ENGINE 1
+#define PRNG_STATE_WORDS 1
+
+void prng_save(const struct prng *r, uint64_t *w)
+{
+	w[0] = r->s;
+}
+
+void prng_load(struct prng *r, const uint64_t *w)
+{
+	r->s = w[0];
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include "../../fixed_point/fp.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+typedef uint8_t bool;
+enum bool_values {
+	false = 0,
+	true = 1,
+};
+
+typedef bool(*test_fn)(void);
+
+#define COUNT 1000
+
+bool test_seed(void)
+{
+	struct prng a, b, c;
+	prng_seed(&a, 42);
+	prng_seed(&b, 42);
+	prng_seed(&c, 43);
+	int same_as_c = 0;
+	for (int i = 0; i < COUNT; i++) {
+		uint64_t x = prng_next(&a);
+		ASSERT(x == prng_next(&b), "same seed gave a different value (%d)", i);
+		same_as_c += x == prng_next(&c);
+	}
+	ASSERT(same_as_c == 0, "different seeds gave the same values");
+
+	// seeding again restarts the stream
+	prng_seed(&a, 42);
+	prng_seed(&b, 42);
+	prng_next(&b);
+	prng_seed(&b, 42);
+	for (int i = 0; i < COUNT; i++)
+		ASSERT(prng_next(&a) == prng_next(&b), "reseeding did not restart the stream");
+	return true;
+}
+
+bool test_fill(void)
+{
+	struct prng a, b;
+	uint64_t expected[COUNT], out[COUNT];
+	prng_seed(&a, 7);
+	prng_seed(&b, 7);
+	for (int i = 0; i < COUNT; i++)
+		expected[i] = prng_next(&a);
+
+	// mix single draws and fills of different sizes
+	size_t sizes[] = {1, 3, 0, 4, 17, 64, 2, 1, 250};
+	size_t i = 0, k = 0;
+	while (i < COUNT) {
+		size_t n = sizes[k++ % (sizeof(sizes) / sizeof(sizes[0]))];
+		if (n > COUNT - i)
+			n = COUNT - i;
+		if (n == 1) {
+			out[i] = prng_next(&b);
+		} else {
+			prng_fill(&b, out + i, n);
+		}
+		i += n;
+	}
+	for (i = 0; i < COUNT; i++)
+		ASSERT(out[i] == expected[i], "fill does not match single draws (%zu)", i);
+	return true;
+}
+
+bool test_fp_random(void)
+{
+	struct prng a, b;
+	fp_t out[COUNT];
+	double sum = 0;
+	prng_seed(&a, 99);
+	prng_seed(&b, 99);
+	fp_random_batch(&b, out, COUNT);
+	for (int i = 0; i < COUNT; i++) {
+		fp_t u = fp_random_r(&a);
+		ASSERT(u == out[i], "fp_random_batch does not match fp_random_r (%d)", i);
+		ASSERT(u < FP_ONE, "value out of [0, 1)");
+		sum += fp_to_float(u);
+	}
+	double mean = sum / COUNT;
+	ASSERT(mean > 0.45 && mean < 0.55, "mean is far from 0.5 (%f)", mean);
+	return true;
+}
+
+bool test_fp_arith(void)
+{
+	const fp_t half = FP_ONE / 2, quarter = FP_ONE / 4;
+	ASSERT(fp_mul(half, half) == quarter, "1/2 * 1/2 != 1/4");
+	// (1 - e)^2 = 1 - 2e + e^2, the product keeps every bit before
+	// scaling back
+	ASSERT(fp_mul(FP_ONE - 1, FP_ONE - 1) == FP_ONE - 2, "fp_mul truncates");
+	ASSERT(fp_div(quarter, half) == half, "1/4 / 1/2 != 1/2");
+	ASSERT(fp_from_float(0.5) == half, "wrong conversion of 0.5");
+	ASSERT(fp_from_float(-1) == 0 && fp_from_float(1e30) == (fp_t)-1,
+		"conversions are not clamped");
+	double x = fp_to_float(fp_from_float(0.3));
+	ASSERT(x <= 0.3 && 0.3 - x < 1.0 / FP_SCALE, "0.3 does not round trip");
+	ASSERT(fp_int_div(1000, quarter) == 4000, "1000 / 1/4 != 4000");
+	ASSERT(fp_int_div(7, 3 * (FP_ONE / 8)) == 18, "7 / 3/8 != 18");
+	ASSERT(fp_int_div(1, 0) == UINT64_MAX, "division by zero");
+	if (FP_BITS == 64)
+		ASSERT(fp_int_div(UINT32_MAX, 1) == UINT64_MAX,
+			"the quotient does not saturate");
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING\n"
+		"...........................................\n");
+	bool res;
+	test_fn suite[] = {test_seed, test_fill, test_fp_random, test_fp_arith,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
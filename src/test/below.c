@@ -0,0 +1,90 @@
+/* The vector paths of __cvm_below against the plain compare. The estimator
+ * is compiled in so that its static helpers can be called; build it with and
+ * without -mavx2 / -mavx512f and for both FP_BITS.
+ * */
+#include <stdbool.h>
+#include "../cvm.c"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+typedef bool(*test_fn)(void);
+
+static uint64_t scalar_below(const fp_t *u, fp_t p)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < CVM_BATCH; i++)
+		mask |= (uint64_t)(u[i] < p) << i;
+	return mask;
+}
+
+/* values around p, the top bit (signed compares get it wrong) and the
+ * padding of a short block
+ * */
+bool test_below(void)
+{
+	fp_t u[CVM_BATCH];
+	const fp_t ps[] = {1, 2, FP_ONE / 3, FP_ONE - 1, FP_ONE,
+		(fp_t)-1 >> 1, ((fp_t)-1 >> 1) + 1, (fp_t)-2, (fp_t)-1};
+	uint64_t seed = 99;
+	for (size_t k = 0; k < sizeof(ps) / sizeof(ps[0]); k++) {
+		fp_t p = ps[k];
+		for (int round = 0; round < 64; round++) {
+			for (int i = 0; i < CVM_BATCH; i++) {
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				switch ((seed >> 33) % 6) {
+				case 0: u[i] = p; break;
+				case 1: u[i] = p - 1; break;
+				case 2: u[i] = p + 1; break;
+				case 3: u[i] = (fp_t)-1; break;
+				case 4: u[i] = (fp_t)seed; break;
+				default: u[i] = (fp_t)(seed >> 11); break;
+				}
+			}
+			// the last block of a stream is padded
+			for (int i = CVM_BATCH - round % 8; i < CVM_BATCH; i++)
+				u[i] = (fp_t)-1;
+			uint64_t want = scalar_below(u, p);
+			uint64_t got = __cvm_below(u, p);
+			ASSERT(got == want, "p = %lu: mask %lx instead of %lx",
+				(uint64_t)p, got, want);
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING __cvm_below (FP_BITS %d)\n"
+		"...........................................\n", FP_BITS);
+#if defined(__AVX512F__)
+	if (!__builtin_cpu_supports("avx512f")) {
+		printf("no AVX-512 on this CPU, skipped\n");
+		return 0;
+	}
+#elif defined(__AVX2__)
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("no AVX2 on this CPU, skipped\n");
+		return 0;
+	}
+#endif
+	bool res;
+	test_fn suite[] = {test_below,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
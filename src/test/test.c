@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../cvm.h"
+
+#define ASSERT(cond, ...) \
+	if (!(cond)) { \
+		printf("@line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	}
+
+#define COUNT_KEYS 200000
+#define COUNT_DISTINCT 50000
+#define BUFFER_SIZE 1000
+#define SHARDS 7
+
+typedef bool(*test_fn)(void);
+
+/* a stream with repetitions of COUNT_DISTINCT distinct keys */
+static cvm_key_t stream_key(uint32_t i)
+{
+	return (i * 2654435761u) % COUNT_DISTINCT;
+}
+
+static struct cvm_impl *new_sketch(uint32_t size, int hashed)
+{
+	struct cvm_impl *c = cvm_new(size);
+	if (c == NULL)
+		return NULL;
+	cvm_seed(c, 42);
+	if (hashed)
+		cvm_set_hash_priority(c, 7);
+	return c;
+}
+
+static bool same_state(struct cvm_impl *a, struct cvm_impl *b)
+{
+	return cvm_buffer_used(a) == cvm_buffer_used(b) &&
+		cvm_probability(a) == cvm_probability(b) &&
+		cvm_estimate(a) == cvm_estimate(b);
+}
+
+bool test_batch(void)
+{
+	static cvm_key_t keys[COUNT_KEYS];
+	struct cvm_impl *a = new_sketch(BUFFER_SIZE, 0);
+	struct cvm_impl *b = new_sketch(BUFFER_SIZE, 0);
+	ASSERT(a != NULL && b != NULL, "failed to allocate the sketches");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		keys[i] = stream_key(i);
+		cvm_add(a, keys[i]);
+	}
+	cvm_add_batch(b, keys, COUNT_KEYS);
+	ASSERT(same_state(a, b), "batch and one by one insertion do not match");
+	cvm_destroy(a);
+	cvm_destroy(b);
+	return true;
+}
+
+bool test_hash_order(void)
+{
+	struct cvm_impl *a = new_sketch(BUFFER_SIZE, 1);
+	struct cvm_impl *b = new_sketch(BUFFER_SIZE, 1);
+	ASSERT(a != NULL && b != NULL, "failed to allocate the sketches");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		cvm_add(a, stream_key(i));
+		cvm_add(b, stream_key(COUNT_KEYS - 1 - i));
+	}
+	ASSERT(same_state(a, b), "hashed priorities depend on the stream order");
+	cvm_destroy(a);
+	cvm_destroy(b);
+	return true;
+}
+
+bool test_merge(void)
+{
+	struct cvm_impl *whole = new_sketch(BUFFER_SIZE, 1);
+	struct cvm_impl *shards[SHARDS];
+	ASSERT(whole != NULL, "failed to allocate the sketch");
+	for (int s = 0; s < SHARDS; s++) {
+		shards[s] = new_sketch(BUFFER_SIZE, 1);
+		ASSERT(shards[s] != NULL, "failed to allocate the shard");
+	}
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		cvm_add(whole, stream_key(i));
+		cvm_add(shards[i % SHARDS], stream_key(i));
+	}
+	ASSERT(cvm_merge(shards[0], shards[1]) == 0, "failed to merge");
+	ASSERT(cvm_merge_many(shards, SHARDS) == 0, "failed to merge many");
+	ASSERT(same_state(whole, shards[0]),
+		"merged shards do not match a single sketch (%lu != %lu)",
+		cvm_estimate(shards[0]), cvm_estimate(whole));
+
+	// priorities of different hash seeds are not comparable
+	struct cvm_impl *other = cvm_new(BUFFER_SIZE);
+	cvm_set_hash_priority(other, 8);
+	ASSERT(cvm_merge(whole, other) == -EINVAL, "merged different hash seeds");
+
+	cvm_destroy(other);
+	cvm_destroy(whole);
+	for (int s = 0; s < SHARDS; s++)
+		cvm_destroy(shards[s]);
+	return true;
+}
+
+bool test_merge_random(void)
+{
+	struct cvm_impl *shards[SHARDS];
+	for (int s = 0; s < SHARDS; s++) {
+		shards[s] = cvm_new(BUFFER_SIZE);
+		ASSERT(shards[s] != NULL, "failed to allocate the shard");
+		cvm_seed(shards[s], s + 1);
+	}
+	// random priorities need the shards to see disjoint keys
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		cvm_add(shards[stream_key(i) % SHARDS], stream_key(i));
+	ASSERT(cvm_merge_many(shards, SHARDS) == 0, "failed to merge many");
+	double err = fabs((double)cvm_estimate(shards[0]) - COUNT_DISTINCT) /
+		COUNT_DISTINCT;
+	ASSERT(err < 0.2, "merged estimate is too far (%lu)",
+		cvm_estimate(shards[0]));
+	for (int s = 0; s < SHARDS; s++)
+		cvm_destroy(shards[s]);
+	return true;
+}
+
+static void *produce(void *arg)
+{
+	struct cvm_producer *w = arg;
+	cvm_key_t keys[100];
+	// every thread sees the whole stream, in a different order
+	uint32_t off = (uintptr_t)w % COUNT_KEYS;
+	for (uint32_t i = 0; i < COUNT_KEYS; i += 100) {
+		for (uint32_t j = 0; j < 100; j++)
+			keys[j] = stream_key((off + i + j) % COUNT_KEYS);
+		cvm_producer_add_batch(w, keys, 100);
+	}
+	return NULL;
+}
+
+bool test_shared(void)
+{
+	pthread_t threads[SHARDS];
+	struct cvm_producer *producers[SHARDS];
+	struct cvm_impl *whole = new_sketch(BUFFER_SIZE, 1);
+	struct cvm_shared *s = cvm_shared_new(BUFFER_SIZE, 7);
+	ASSERT(whole != NULL && s != NULL, "failed to allocate the sketches");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		cvm_add(whole, stream_key(i));
+	for (int i = 0; i < SHARDS; i++) {
+		producers[i] = cvm_producer_new(s);
+		ASSERT(producers[i] != NULL, "failed to allocate a producer");
+		pthread_create(&threads[i], NULL, produce, producers[i]);
+	}
+	for (int i = 0; i < SHARDS; i++) {
+		pthread_join(threads[i], NULL);
+		cvm_producer_destroy(producers[i]);
+	}
+	ASSERT(cvm_shared_estimate(s) == cvm_estimate(whole),
+		"shared sketch does not match a single sketch (%lu != %lu)",
+		cvm_shared_estimate(s), cvm_estimate(whole));
+	cvm_shared_destroy(s);
+	cvm_destroy(whole);
+	return true;
+}
+
+bool test_bytes(void)
+{
+	char s[32];
+	struct cvm_impl *c = cvm_new(2 * COUNT_DISTINCT);
+	ASSERT(c != NULL, "failed to allocate the sketch");
+	ASSERT(cvm_fingerprint("abc", 3) == cvm_fingerprint("abc", 3),
+		"fingerprint is not deterministic");
+	ASSERT(cvm_fingerprint("abc", 3) != cvm_fingerprint("abd", 3),
+		"fingerprint ignores the last byte");
+	// the buffer is large enough to count exactly
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		int len = snprintf(s, sizeof(s), "/path/%u",
+			(uint32_t)stream_key(i));
+		cvm_add_bytes(c, s, len);
+	}
+	// 32-bit fingerprints of 50K strings have a small chance to collide
+	ASSERT(cvm_estimate(c) <= COUNT_DISTINCT &&
+		cvm_estimate(c) >= COUNT_DISTINCT - 2 * (CVM_KEY_BITS == 32),
+		"wrong count of strings (%lu)", cvm_estimate(c));
+	cvm_destroy(c);
+	return true;
+}
+
+#define GROUPS 20000
+#define LARGE_GROUPS 3
+
+static void count_group(uint64_t group, uint64_t estimate, void *arg)
+{
+	(*(uint64_t *)arg)++;
+}
+
+bool test_table(void)
+{
+	struct cvm_table *tb = cvm_table_new(BUFFER_SIZE);
+	ASSERT(tb != NULL, "failed to allocate the table");
+	// small groups: group g has 1 + g % 50 distinct keys, each seen 3 times
+	for (int r = 0; r < 3; r++)
+		for (uint64_t g = 0; g < GROUPS; g++)
+			for (uint32_t k = 0; k <= g % 50; k++)
+				ASSERT(cvm_table_add(tb, g, k * 7919) == 0, "add failed");
+	// large groups go through every stage up to an estimator
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		for (uint64_t g = GROUPS; g < GROUPS + LARGE_GROUPS; g++)
+			cvm_table_add(tb, g, stream_key(i));
+	for (uint64_t g = 0; g < GROUPS; g++)
+		ASSERT(cvm_table_estimate(tb, g) == 1 + g % 50,
+			"group %lu counts %lu", g, cvm_table_estimate(tb, g));
+	for (uint64_t g = GROUPS; g < GROUPS + LARGE_GROUPS; g++) {
+		double err = fabs((double)cvm_table_estimate(tb, g) -
+			COUNT_DISTINCT) / COUNT_DISTINCT;
+		ASSERT(err < 0.2, "large group estimate is too far (%lu)",
+			cvm_table_estimate(tb, g));
+	}
+	uint64_t seen = 0;
+	cvm_table_foreach(tb, count_group, &seen);
+	ASSERT(seen == GROUPS + LARGE_GROUPS && cvm_table_groups(tb) == seen,
+		"wrong number of groups (%lu)", seen);
+
+	// remove every other group and the large ones, the rest stay as they
+	// were and new groups reuse the memory
+	for (uint64_t g = 0; g < GROUPS + LARGE_GROUPS; g++)
+		if (g % 2 == 0 || g >= GROUPS)
+			ASSERT(cvm_table_remove(tb, g) == 0, "remove failed");
+	ASSERT(cvm_table_remove(tb, 0) == -ENOENT, "removed twice");
+	ASSERT(cvm_table_groups(tb) == GROUPS / 2, "wrong number of groups");
+	for (uint64_t g = 0; g < GROUPS; g++)
+		ASSERT(cvm_table_estimate(tb, g) == (g % 2 ? 1 + g % 50 : 0),
+			"group %lu changed after removals", g);
+	for (uint32_t k = 0; k < 2 * BUFFER_SIZE; k++)
+		cvm_table_add(tb, GROUPS, k);
+	ASSERT(cvm_table_estimate(tb, GROUPS) > BUFFER_SIZE,
+		"recycled estimator did not start empty");
+	cvm_table_destroy(tb);
+	return true;
+}
+
+bool test_serialize(void)
+{
+	for (int hashed = 0; hashed < 2; hashed++) {
+		struct cvm_impl *a = new_sketch(BUFFER_SIZE, hashed);
+		ASSERT(a != NULL, "failed to allocate the sketch");
+		for (uint32_t i = 0; i < COUNT_KEYS / 2; i++)
+			cvm_add(a, stream_key(i));
+		size_t size = cvm_serialized_size(a);
+		uint8_t *buf = malloc(size);
+		ASSERT(buf != NULL, "failed to allocate the buffer");
+		ASSERT(cvm_serialize(a, buf, size - 1) == -ENOSPC,
+			"wrote past the buffer");
+		ssize_t len = cvm_serialize(a, buf, size);
+		ASSERT(len > 0, "failed to serialize (%ld)", len);
+		ASSERT(cvm_deserialize(buf, len - 1) == NULL,
+			"accepted a truncated sketch");
+		struct cvm_impl *b = cvm_deserialize(buf, len);
+		ASSERT(b != NULL, "failed to deserialize");
+		ASSERT(same_state(a, b), "restored sketch differs");
+		// the restored sketch continues the same random stream
+		for (uint32_t i = COUNT_KEYS / 2; i < COUNT_KEYS; i++) {
+			cvm_add(a, stream_key(i));
+			cvm_add(b, stream_key(i));
+		}
+		ASSERT(same_state(a, b), "restored sketch diverges");
+		free(buf);
+		cvm_destroy(a);
+		cvm_destroy(b);
+	}
+
+	// the image of an empty sketch with a buffer of one, then with a
+	// buffer above the limit and with more keys than the image holds
+	uint8_t img[1024], bad[1024];
+	struct cvm_impl *c = new_sketch(1, 1);
+	ASSERT(c != NULL && cvm_serialized_size(c) <= sizeof(img),
+		"failed to allocate the sketch");
+	ssize_t len = cvm_serialize(c, img, sizeof(img));
+	ASSERT(len > 7 && img[7] == 1 && img[len - 1] == 0,
+		"unexpected layout of the image");
+	cvm_destroy(c);
+	memcpy(bad, img, 7);
+	uint32_t cap = CVM_SER_MAX_CAPACITY + 1, o = 7;
+	for (; cap >= 0x80; cap >>= 7)
+		bad[o++] = (uint8_t)cap | 0x80;
+	bad[o++] = cap;
+	memcpy(bad + o, img + 8, len - 8);
+	ASSERT(cvm_deserialize(bad, o + len - 8) == NULL,
+		"accepted a buffer above CVM_SER_MAX_CAPACITY");
+	memcpy(bad, img, len);
+	bad[7] = 100;
+	bad[len - 1] = 90;
+	ASSERT(cvm_deserialize(bad, len) == NULL,
+		"accepted more keys than the image holds");
+	bad[len - 1] = 0;
+	c = cvm_deserialize(bad, len);
+	ASSERT(c != NULL, "failed to deserialize an empty sketch");
+	cvm_destroy(c);
+	return true;
+}
+
+/* a hashed image (seed 7) with a buffer of `cap` and the sorted `keys`, all
+ * with the priority `u` (every value should fit one varint byte)
+ * */
+static ssize_t tie_image(uint8_t *out, uint8_t cap, const uint8_t *keys,
+		uint8_t n, uint8_t u)
+{
+	uint8_t img[1024];
+	struct cvm_impl *c = new_sketch(1, 1);
+	if (c == NULL || cvm_serialized_size(c) > sizeof(img))
+		return -1;
+	// header, capacity, p, seed and n of an empty sketch
+	ssize_t len = cvm_serialize(c, img, sizeof(img));
+	cvm_destroy(c);
+	memcpy(out, img, len - 1);
+	out[7] = cap;
+	out[len - 1] = n;
+	for (uint8_t i = 0; i < n; i++) {
+		out[len + i] = i == 0 ? keys[0] : keys[i] - keys[i - 1] - 1;
+		out[len + n + i] = u;
+	}
+	return len + 2 * n;
+}
+
+bool test_serialize_merged(void)
+{
+	uint8_t img[1024];
+	const uint8_t k1[] = {1, 2}, k2[] = {3};
+	// three keys with the same priority for a buffer of two: the merge
+	// keeps two of them and lowers p to their priority
+	ssize_t len = tie_image(img, 2, k1, 2, 5);
+	struct cvm_impl *a = cvm_deserialize(img, len);
+	len = tie_image(img, 1, k2, 1, 5);
+	struct cvm_impl *b = cvm_deserialize(img, len);
+	ASSERT(a != NULL && b != NULL, "failed to read the images");
+	ASSERT(cvm_merge(a, b) == 0, "failed to merge");
+	ASSERT(cvm_buffer_used(a) == 2, "wrong number of buffered keys");
+	len = cvm_serialize(a, img, sizeof(img));
+	ASSERT(len > 0, "failed to serialize (%ld)", len);
+	struct cvm_impl *c = cvm_deserialize(img, len);
+	ASSERT(c != NULL, "merged sketch with ties does not round-trip");
+	ASSERT(same_state(a, c), "restored sketch differs");
+	cvm_destroy(a);
+	cvm_destroy(b);
+	cvm_destroy(c);
+
+	// and a merge of two streams
+	a = new_sketch(BUFFER_SIZE, 1);
+	b = new_sketch(BUFFER_SIZE / 2, 1);
+	ASSERT(a != NULL && b != NULL, "failed to allocate the sketches");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++)
+		cvm_add(i % 3 ? a : b, stream_key(i));
+	ASSERT(cvm_merge(a, b) == 0, "failed to merge");
+	size_t size = cvm_serialized_size(a);
+	uint8_t *buf = malloc(size);
+	ASSERT(buf != NULL, "failed to allocate the buffer");
+	len = cvm_serialize(a, buf, size);
+	c = cvm_deserialize(buf, len);
+	ASSERT(c != NULL && same_state(a, c), "merged sketch does not round-trip");
+	free(buf);
+	cvm_destroy(a);
+	cvm_destroy(b);
+	cvm_destroy(c);
+	return true;
+}
+
+bool test_window(void)
+{
+	const uint32_t intervals = 5, per_interval = 3000;
+	struct cvm_window *w = cvm_window_new(BUFFER_SIZE, intervals, 7);
+	ASSERT(w != NULL, "failed to allocate the window");
+	for (uint32_t i = 0; i < 4 * intervals + 2; i++) {
+		// the streams of neighbour intervals overlap
+		for (uint32_t k = 0; k < per_interval; k++)
+			cvm_window_add(w, i * per_interval / 2 + k);
+		// same as a sketch of the intervals still in the window
+		struct cvm_impl *c = new_sketch(BUFFER_SIZE, 1);
+		ASSERT(c != NULL, "failed to allocate the sketch");
+		uint32_t first = i + 1 >= intervals ? i + 1 - intervals : 0;
+		for (uint32_t j = first; j <= i; j++)
+			for (uint32_t k = 0; k < per_interval; k++)
+				cvm_add(c, j * per_interval / 2 + k);
+		uint64_t estimate;
+		ASSERT(cvm_window_estimate(w, &estimate) == 0,
+			"failed to estimate at %d", i);
+		ASSERT(estimate == cvm_estimate(c),
+			"wrong window estimate at %d (%lu != %lu)", i,
+			estimate, cvm_estimate(c));
+		cvm_destroy(c);
+		ASSERT(cvm_window_advance(w) == 0, "failed to advance");
+	}
+	cvm_window_destroy(w);
+	return true;
+}
+
+bool test_stats(void)
+{
+	struct cvm_stats st;
+	for (int hashed = 0; hashed < 2; hashed++) {
+		struct cvm_impl *c = new_sketch(BUFFER_SIZE, hashed);
+		ASSERT(c != NULL, "failed to allocate the sketch");
+		for (uint32_t i = 0; i < COUNT_KEYS; i++)
+			cvm_add(c, stream_key(i));
+		if (cvm_get_stats(c, &st) == -ENOTSUP) {
+			cvm_destroy(c);
+			return true;
+		}
+		// every element takes exactly one of the paths
+		ASSERT(st.seen == COUNT_KEYS, "wrong number of elements");
+		ASSERT(st.rejected + st.hits + st.inserts + st.replace_tops ==
+			st.seen, "paths do not add up");
+		ASSERT(st.filtered <= st.rejected && st.deletes <= st.hits,
+			"inconsistent counters");
+		ASSERT(st.inserts - st.deletes == cvm_buffer_used(c),
+			"wrong number of buffered elements");
+		cvm_destroy(c);
+	}
+
+	// with hashed priorities the batch path takes the same paths as one
+	// element at a time (the walks that warm the cache for large buffers
+	// are not counted)
+	static cvm_key_t stream[COUNT_KEYS];
+	struct cvm_stats sa, sb;
+	struct cvm_impl *a = new_sketch(BUFFER_SIZE, 1);
+	struct cvm_impl *b = new_sketch(BUFFER_SIZE, 1);
+	ASSERT(a != NULL && b != NULL, "failed to allocate the sketches");
+	for (uint32_t i = 0; i < COUNT_KEYS; i++) {
+		stream[i] = stream_key(i);
+		cvm_add(a, stream[i]);
+	}
+	cvm_add_batch(b, stream, COUNT_KEYS);
+	cvm_get_stats(a, &sa);
+	cvm_get_stats(b, &sb);
+	ASSERT(sb.rejected == sa.rejected && sb.hits == sa.hits &&
+		sb.inserts == sa.inserts && sb.replace_tops == sa.replace_tops,
+		"batch paths differ from one at a time");
+	ASSERT(sb.searches == sa.searches && sb.search_steps == sa.search_steps,
+		"batch walks %lu nodes in %lu searches instead of %lu in %lu",
+		sb.search_steps, sb.searches, sa.search_steps, sa.searches);
+	ASSERT(cvm_estimate(a) == cvm_estimate(b), "the estimates differ");
+	cvm_destroy(a);
+	cvm_destroy(b);
+
+	// a shared sketch: two producers, one element at a time and in batches
+	static cvm_key_t keys[COUNT_KEYS / 2];
+	struct cvm_shared *s = cvm_shared_new(BUFFER_SIZE, 7);
+	struct cvm_producer *pa = s ? cvm_producer_new(s) : NULL;
+	struct cvm_producer *pb = s ? cvm_producer_new(s) : NULL;
+	ASSERT(pa != NULL && pb != NULL, "failed to allocate the producers");
+	for (uint32_t i = 0; i < COUNT_KEYS / 2; i++) {
+		cvm_producer_add(pa, stream_key(2 * i));
+		keys[i] = stream_key(2 * i + 1);
+	}
+	cvm_producer_add_batch(pb, keys, COUNT_KEYS / 2);
+	cvm_producer_destroy(pa);
+	cvm_producer_destroy(pb);
+	ASSERT(cvm_shared_get_stats(s, &st) == 0, "failed to read the counters");
+	ASSERT(st.seen == COUNT_KEYS, "wrong number of elements (%lu)", st.seen);
+	ASSERT(st.rejected + st.hits + st.inserts + st.replace_tops ==
+		st.seen, "paths do not add up");
+	cvm_shared_destroy(s);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("\n\n"
+		"===========================================\n"
+		"\t\tTESTING CVM\n"
+		"...........................................\n");
+	bool res;
+	test_fn suite[] = {test_batch, test_hash_order, test_merge,
+		test_merge_random, test_shared, test_bytes, test_table,
+		test_serialize, test_serialize_merged, test_window, test_stats,};
+	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
+	for (int i = 0; i < count_tests; i++) {
+		res = suite[i]();
+		if (!res) {
+			printf("Test %d failed\n", i+1);
+			return -1;
+		}
+	}
+	printf("Test passed\n");
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* Per key cost of searching a batch of keys one by one (treap_find) and with
+ * the interleaved walks of treap_find_batch, for treaps from 1K to 1M nodes.
+ * Half of the keys are in the treap. Build it with different TREAP_LAYOUT
+ * and TREAP_FIND_LANES values to compare them.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../treap.h"
+#include "bench.h"
+
+#define MAX_SIZE (1 << 20)
+
+#define ROUNDS (1 << 22)
+// keys per call of treap_find_batch
+#define BATCH 64
+
+static const char *layout_names[] = {"ptr", "idx", "soa"};
+
+static struct treap_key keys[ROUNDS];
+static struct treap_node *out[BATCH];
+
+static int run(uint32_t size, double *ns_single, double *ns_batch)
+{
+	struct treap_key k;
+	uint64_t seed = 7, found_single = 0, found_batch = 0;
+	struct treap *t = treap_new_sized(size);
+	if (t == NULL)
+		return -ENOMEM;
+	// the even keys of the universe, then half of the searches miss
+	for (uint32_t i = 0; i < size; i++) {
+		treap_key_set(&k, 2 * (uint64_t)i);
+		treap_insert(t, &k, bench_rand(&seed));
+	}
+	for (uint32_t i = 0; i < ROUNDS; i++)
+		treap_key_set(&keys[i], bench_rand(&seed) % (2 * size));
+
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < ROUNDS; i++)
+		found_single += treap_find(t, &keys[i]) != NULL;
+	*ns_single = (double)(bench_now_ns() - start) / ROUNDS;
+
+	start = bench_now_ns();
+	for (uint32_t i = 0; i < ROUNDS; i += BATCH) {
+		treap_find_batch(t, &keys[i], out, BATCH);
+		for (uint32_t j = 0; j < BATCH; j++)
+			found_batch += out[j] != NULL;
+	}
+	*ns_batch = (double)(bench_now_ns() - start) / ROUNDS;
+	treap_destroy(t);
+	return found_single == found_batch ? 0 : -EINVAL;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("layout: %s  node: %zu bytes  lanes: %d  batch: %d\n",
+		layout_names[TREAP_LAYOUT], sizeof(struct treap_node),
+		TREAP_FIND_LANES, BATCH);
+	printf("%10s %10s %10s %10s\n", "size", "find", "batch", "speedup");
+	for (uint32_t size = 1 << 10; size <= MAX_SIZE; size <<= 2) {
+		double single, batch;
+		if (run(size, &single, &batch) != 0) {
+			fprintf(stderr, "failed to run size %u\n", size);
+			return 1;
+		}
+		printf("%10u %10.1f %10.1f %9.2fx\n", size, single, batch,
+			single / batch);
+	}
+	return 0;
+}
@@ -0,0 +1,88 @@
+/* Per element cost of the CVM search path (treap_upsert) for a node layout,
+ * build it with different TREAP_LAYOUT values (and with or without
+ * TREAP_HASH_INDEX) to compare them. The second column is the cost of
+ * treap_delete on keys that are in the treap.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../treap.h"
+#include "bench.h"
+
+#define MAX_SIZE (1 << 20)
+
+#define ROUNDS (1 << 22)
+
+static const char *layout_names[] = {"ptr", "idx", "soa"};
+
+#ifdef TREAP_HASH_INDEX
+#define HASH_INDEX "yes"
+#else
+#define HASH_INDEX "no"
+#endif
+
+static double run(uint32_t size)
+{
+	struct treap_key k;
+	uint64_t seed = 7;
+	struct treap *t = treap_new_sized(size);
+	// fill the treap with half of the universe, then most lookups miss
+	// and half of them insert/remove a key
+	for (uint32_t i = 0; i < size; i++) {
+		treap_key_set(&k, bench_rand(&seed) % (4 * size));
+		treap_upsert(t, &k, bench_rand(&seed), 1);
+	}
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < ROUNDS; i++) {
+		treap_key_set(&k, bench_rand(&seed) % (4 * size));
+		uint32_t prio = bench_rand(&seed);
+		treap_upsert(t, &k, prio, prio < (1U << 30));
+	}
+	double ns = (double)(bench_now_ns() - start) / ROUNDS;
+	treap_destroy(t);
+	return ns;
+}
+
+static double run_delete(uint32_t size)
+{
+	struct treap_key k;
+	uint64_t seed = 11;
+	uint64_t ns = 0;
+	struct treap *t = treap_new_sized(size);
+	uint32_t *keys = malloc(size * sizeof(uint32_t));
+	// every round fills the treap and deletes its keys in a random order
+	uint32_t rounds = ROUNDS / 4 / size + 1;
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < size; i++) {
+			keys[i] = i * 4 + r % 4;
+			treap_key_set(&k, keys[i]);
+			treap_insert(t, &k, bench_rand(&seed));
+		}
+		for (uint32_t i = size - 1; i > 0; i--) {
+			uint32_t j = bench_rand(&seed) % (i + 1);
+			uint32_t tmp = keys[i];
+			keys[i] = keys[j];
+			keys[j] = tmp;
+		}
+		uint64_t start = bench_now_ns();
+		for (uint32_t i = 0; i < size; i++) {
+			treap_key_set(&k, keys[i]);
+			treap_delete(t, &k);
+		}
+		ns += bench_now_ns() - start;
+	}
+	free(keys);
+	treap_destroy(t);
+	return (double)ns / ((uint64_t)rounds * size);
+}
+
+int main(int argc, char *argv[])
+{
+	printf("layout: %s (index bits: %d)  node: %zu bytes  hash index: %s\n",
+		layout_names[TREAP_LAYOUT], TREAP_INDEX_BITS,
+		sizeof(struct treap_node), HASH_INDEX);
+	printf("%10s %10s %10s\n", "size", "ns/op", "delete hit");
+	for (uint32_t size = 1 << 10; size <= MAX_SIZE; size <<= 2)
+		printf("%10u %10.1f %10.1f\n", size, run(size), run_delete(size));
+	return 0;
+}
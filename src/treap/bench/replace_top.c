@@ -0,0 +1,79 @@
+/* Compare the full-buffer path of CVM: treap_delete + treap_insert of the top
+ * node versus treap_replace_top.
+ * */
+#include <stdio.h>
+
+#include "../treap.h"
+#include "bench.h"
+
+#define MAX_SIZE (1 << 16)
+
+// total number of replacements per size
+#define ROUNDS (1 << 20)
+// replacements before refilling the treap, the top priority shrinks with each
+// replacement (like p in CVM), refilling keeps it away from zero
+#define ROUNDS_PER_FILL(size) (4 * (size))
+
+static struct treap *fill(uint32_t size, uint64_t seed)
+{
+	struct treap_key k;
+	struct treap *t = treap_new_sized(size);
+	while (treap_has_space(t)) {
+		treap_key_set(&k, bench_rand(&seed));
+		if (treap_find(t, &k) != NULL)
+			continue;
+		if (treap_insert(t, &k, bench_rand(&seed)) != 0) {
+			fprintf(stderr, "failed to fill the treap\n");
+			exit(1);
+		}
+	}
+	return t;
+}
+
+/* the new priority is always below the top, like the CVM steady state */
+static uint64_t run(struct treap *t, int use_replace, uint64_t *seed_p,
+		uint32_t rounds)
+{
+	struct treap_key k;
+	uint64_t seed = *seed_p;
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < rounds; i++) {
+		struct treap_node *top = treap_top(t);
+		treap_key_set(&k, bench_rand(&seed));
+		uint32_t prio = bench_rand(&seed) % (treap_priority(t, top) + 1);
+		if (use_replace) {
+			treap_replace_top(t, &k, prio);
+		} else {
+			if (treap_delete(t, &top->key) != 0 ||
+					treap_insert(t, &k, prio) != 0) {
+				fprintf(stderr, "delete + insert failed\n");
+				exit(1);
+			}
+		}
+	}
+	*seed_p = seed;
+	return bench_now_ns() - start;
+}
+
+static double measure(uint32_t size, int use_replace)
+{
+	uint64_t seed = 7, elapsed = 0, done = 0, fill_seed = 42;
+	while (done < ROUNDS) {
+		struct treap *t = fill(size, fill_seed++);
+		elapsed += run(t, use_replace, &seed, ROUNDS_PER_FILL(size));
+		done += ROUNDS_PER_FILL(size);
+		treap_destroy(t);
+	}
+	return (double)elapsed / done;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("%10s %18s %18s %8s\n", "size", "delete+insert ns", "replace_top ns", "speedup");
+	for (uint32_t size = 1 << 8; size <= MAX_SIZE; size <<= 2) {
+		double old_ns = measure(size, 0);
+		double new_ns = measure(size, 1);
+		printf("%10u %18.1f %18.1f %7.2fx\n", size, old_ns, new_ns, old_ns / new_ns);
+	}
+	return 0;
+}
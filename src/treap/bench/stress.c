@@ -0,0 +1,74 @@
+/* Run the CVM steady state on a treap for many operations and track the
+ * depth of every walk (the counters of TREAP_STATS). The treap operations do
+ * not depend on a height bound, this reports how often the old bound
+ * (treap_height_bound) would have been exceeded. There is nothing to rebuild
+ * either: inserts and deletes never fail on height, so the rebuild count is
+ * zero by construction.
+ *
+ * usage: stress [operations] [capacity]
+ * */
+#include <stdio.h>
+
+#define TREAP_STATS
+#include "../treap.h"
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : (1ULL << 26);
+	uint32_t capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : (1 << 16);
+	struct treap *t = treap_new_sized(capacity);
+	if (t == NULL)
+		return 1;
+
+	struct treap_key k;
+	uint64_t seed = 31415;
+	uint32_t p = 1U << 31;
+	const uint32_t bound = treap_height_bound(capacity);
+	uint32_t max_depth = 0;
+	uint64_t max_split = 0, max_merge = 0;
+	uint64_t over_bound = 0, replaced = 0, errors = 0;
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < ops; i++) {
+		uint64_t split = t->stats.split_steps;
+		uint64_t merge = t->stats.merge_steps;
+		// the deepest node reached by the walks of this operation
+		t->stats.max_depth = 0;
+		treap_key_set(&k, bench_rand(&seed) ^ (bench_rand(&seed) << 1));
+		uint32_t u = bench_rand(&seed);
+		int ret = treap_upsert(t, &k, u, u < p);
+		if (ret == -ENOSPC) {
+			struct treap_node *top = treap_top(t);
+			if (u > treap_priority(t, top)) {
+				p = u;
+			} else {
+				p = treap_priority(t, top);
+				ret = treap_replace_top(t, &k, u);
+				replaced++;
+			}
+		}
+		if (ret < 0 && ret != -ENOSPC)
+			errors++;
+		if (t->stats.max_depth > max_depth)
+			max_depth = t->stats.max_depth;
+		if (t->stats.max_depth > bound)
+			over_bound++;
+		if (t->stats.split_steps - split > max_split)
+			max_split = t->stats.split_steps - split;
+		if (t->stats.merge_steps - merge > max_merge)
+			max_merge = t->stats.merge_steps - merge;
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+
+	printf("{\"operations\": %lu, \"capacity\": %u, \"ns_per_op\": %.1f, "
+		"\"replace_top\": %lu, \"errors\": %lu, \"rebuilds\": 0, "
+		"\"rebuilds_note\": \"no rebuild path, nothing depends on the height\", "
+		"\"walks\": %lu, \"height_bound\": %u, \"max_depth\": %u, "
+		"\"ops_over_bound\": %lu, \"max_split_steps\": %lu, "
+		"\"max_merge_steps\": %lu}\n",
+		ops, capacity, (double)elapsed / ops, replaced, errors,
+		t->stats.searches, bound, max_depth, over_bound, max_split,
+		max_merge);
+	treap_destroy(t);
+	return errors != 0;
+}
@@ -0,0 +1,50 @@
+/* Compare the per element work of CVM on a high-duplicate stream:
+ * treap_delete followed by treap_insert versus a single treap_upsert.
+ * */
+#include <stdio.h>
+
+#include "../treap.h"
+#include "bench.h"
+
+#define MAX_SIZE (1 << 16)
+
+#define ROUNDS (1 << 22)
+
+/* keys come from a universe of `universe` keys and survive sampling with
+ * probability 1/2, like a CVM instance with p = 1/2 that is not full
+ * */
+static double run(uint32_t size, uint32_t universe, int use_upsert)
+{
+	struct treap_key k;
+	uint64_t seed = 7;
+	struct treap *t = treap_new_sized(size);
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < ROUNDS; i++) {
+		treap_key_set(&k, bench_rand(&seed) % universe);
+		uint32_t prio = bench_rand(&seed);
+		int keep = prio < (1U << 30);
+		if (use_upsert) {
+			treap_upsert(t, &k, prio, keep);
+		} else {
+			treap_delete(t, &k);
+			if (keep && treap_has_space(t))
+				treap_insert(t, &k, prio);
+		}
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+	treap_destroy(t);
+	return (double)elapsed / ROUNDS;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("%10s %18s %18s %8s\n", "size", "delete+insert ns", "upsert ns", "speedup");
+	for (uint32_t size = 1 << 8; size <= MAX_SIZE; size <<= 2) {
+		// as many keys as the buffer size, with p = 1/2 about half of
+		// the elements are already in the buffer
+		double old_ns = run(size, size, 0);
+		double new_ns = run(size, size, 1);
+		printf("%10u %18.1f %18.1f %7.2fx\n", size, old_ns, new_ns, old_ns / new_ns);
+	}
+	return 0;
+}
@@ -9,6 +9,9 @@
 		return false; \
 	}
 
+// the node a reference points to (the treap is always called t)
+#define NODE(r) treap_node(t, (r))
+
 typedef bool(*test_fn)(void);
 
 bool test_basic(void)
@@ -17,58 +20,58 @@ bool test_basic(void)
 	struct treap_key K = {};
 	struct treap *t = treap_new();
 	ASSERT(t != NULL, "failed to allocate a treap");
-	ASSERT(t->root == NULL, "newly allocated treap has non-NULL value as root pointer");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_top(t) == NULL, "newly allocated treap has non-NULL value as root pointer");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
-	*(uint32_t *)(&K.data) = 123;
+	treap_key_set(&K, 123);
 	treap_insert(t, &K, 100);
-	struct treap_node *root = t->root;
+	struct treap_node *root = treap_top(t);
 	ASSERT(root != NULL, "root pointer is null after insrting a value");
-	ASSERT(treap_key_eq(&t->root->key, &K), "key inside the root does not match the key we inserted");
-	ASSERT(root->priority == 100, "priority does not match what we inserted (%d != %d)", root->priority, 100);
-	ASSERT(root->left == NULL, "the left child is not null, we have inserted only one node");
-	ASSERT(root->right == NULL, "the right child is not null, we have inserted only one node");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_key_eq(&treap_top(t)->key, &K), "key inside the root does not match the key we inserted");
+	ASSERT(treap_priority(t, root) == 100, "priority does not match what we inserted (%d != %d)", treap_priority(t, root), 100);
+	ASSERT(NODE(root->left) == NULL, "the left child is not null, we have inserted only one node");
+	ASSERT(NODE(root->right) == NULL, "the right child is not null, we have inserted only one node");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	// This node should become the right child of the current
-	*(uint32_t *)(&K.data) = 321;
+	treap_key_set(&K, 321);
 	treap_insert(t, &K, 50);
-	ASSERT(t->root == root, "the root pointer changed althoug it should have not");
-	ASSERT(root->left == NULL, "the left child should be null");
-	struct treap_node *right = root->right;
+	ASSERT(treap_top(t) == root, "the root pointer changed althoug it should have not");
+	ASSERT(NODE(root->left) == NULL, "the left child should be null");
+	struct treap_node *right = NODE(root->right);
 	ASSERT(right != NULL, "the right child should not be null");
-	ASSERT(right->priority == 50, "wrong priority");
+	ASSERT(treap_priority(t, right) == 50, "wrong priority");
 	ASSERT(treap_key_eq(&right->key, &K), "key did not matched");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	// This should become the left child of the right child
-	*(uint32_t *)(&K.data) = 200;
+	treap_key_set(&K, 200);
 	treap_insert(t, &K, 38);
-	ASSERT(t->root == root, "the root pointer changed althoug it should have not");
-	ASSERT(root->left == NULL, "the left child should be null");
-	ASSERT(root->right == right, "right node should have not changed");
-	ASSERT(right->right == NULL, "the node should be null");
-	struct treap_node *left = right->left;
+	ASSERT(treap_top(t) == root, "the root pointer changed althoug it should have not");
+	ASSERT(NODE(root->left) == NULL, "the left child should be null");
+	ASSERT(NODE(root->right) == right, "right node should have not changed");
+	ASSERT(NODE(right->right) == NULL, "the node should be null");
+	struct treap_node *left = NODE(right->left);
 	ASSERT(left != NULL, "the child is not set!");
-	ASSERT(left->priority == 38, "the priority value is wrong");
+	ASSERT(treap_priority(t, left) == 38, "the priority value is wrong");
 	ASSERT(treap_key_eq(&left->key, &K), "the key did not match");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
-	// This should first become the right child of the right child :)
-	// but then it should cause two left rotations and become the root
-	*(uint32_t *)(&K.data) = 512;
+	// the highest priority so far, the insert stops at the root and
+	// splits the whole treap around the new key
+	treap_key_set(&K, 512);
 	treap_insert(t, &K, 120);
-	struct treap_node *rr = t->root;
-	ASSERT(t->root != root, "root should have changed");
-	ASSERT(rr->left != NULL, "the left child should not be null" );
-	ASSERT(rr->left == root, "the left child should be the old root");
-	ASSERT(rr->right == NULL, "the right child should be null");
-	ASSERT(root->right == right, "The right child should correctly be moved with root after rotations");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
-
-	*(uint32_t *)(&K.data) = 322;
+	struct treap_node *rr = treap_top(t);
+	ASSERT(treap_top(t) != root, "root should have changed");
+	ASSERT(NODE(rr->left) != NULL, "the left child should not be null" );
+	ASSERT(NODE(rr->left) == root, "the left child should be the old root");
+	ASSERT(NODE(rr->right) == NULL, "the right child should be null");
+	ASSERT(NODE(root->right) == right, "the right child should stay under the old root after the split");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+
+	treap_key_set(&K, 322);
 	treap_insert(t, &K, 37);
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	// check the inorder walk
 	int expected_arr[8];
@@ -83,16 +86,16 @@ bool test_basic(void)
 
 
 	// test deleting a node that does not exists
-	*(uint32_t*)(&K.data) = 111;
+	treap_key_set(&K, 111);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == -1, "treap_delete should have failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	// test deleting a node (the current root is being removed)
-	*(uint32_t*)(&K.data) = 321;
+	treap_key_set(&K, 321);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == 0, "treap_delete failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	treap_report_priority_in_order(t, &arr, &arr_sz);
 	ASSERT(arr_sz == 4, "number of nodes are wrong");
@@ -102,34 +105,37 @@ bool test_basic(void)
 	}
 	free(arr);
 
-	ASSERT(t->root->right == NULL, "[missing description]");
-	ASSERT(*(uint32_t *)t->root->key.data == 512, "[missing description]");
-	ASSERT(t->root->left != NULL,"[missing description]");
-	ASSERT(*(uint32_t *)t->root->left->key.data == 123, "[missing description]");
-	ASSERT(t->root->left->left == NULL,"[missing description]");
-	ASSERT(t->root->left->right != NULL,"[missing description]");
-	ASSERT(*(uint32_t *)t->root->left->right->key.data == 200, "[missing description]");
-	ASSERT(t->root->left->right->left == NULL,"[missing description]");
-	ASSERT(t->root->left->right->right != NULL,"[missing description]");
-	ASSERT(*(uint32_t *)t->root->left->right->right->key.data == 322, "[missing description]");
+	root = treap_top(t);
+	ASSERT(NODE(root->right) == NULL, "[missing description]");
+	ASSERT(treap_key_get(&root->key) == 512, "[missing description]");
+	left = NODE(root->left);
+	ASSERT(left != NULL,"[missing description]");
+	ASSERT(treap_key_get(&left->key) == 123, "[missing description]");
+	ASSERT(NODE(left->left) == NULL,"[missing description]");
+	right = NODE(left->right);
+	ASSERT(right != NULL,"[missing description]");
+	ASSERT(treap_key_get(&right->key) == 200, "[missing description]");
+	ASSERT(NODE(right->left) == NULL,"[missing description]");
+	ASSERT(NODE(right->right) != NULL,"[missing description]");
+	ASSERT(treap_key_get(&NODE(right->right)->key) == 322, "[missing description]");
 
 	//
-	*(uint32_t*)(&K.data) = 512;
+	treap_key_set(&K, 512);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == 0, "treap_delete failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
-	*(uint32_t*)(&K.data) = 200;
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+	treap_key_set(&K, 200);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == 0, "treap_delete failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
-	*(uint32_t*)(&K.data) = 123;
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+	treap_key_set(&K, 123);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == 0, "treap_delete failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
-	*(uint32_t*)(&K.data) = 322;
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+	treap_key_set(&K, 322);
 	ret = treap_delete(t, &K);
 	ASSERT(ret == 0, "treap_delete failed");
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 	ASSERT(t->used == 0, "treap should be empty now");
 
 	treap_destroy(t);
@@ -146,17 +152,248 @@ bool test_delete(void)
 	size_t count_test_keys = sizeof(test_keys) / sizeof(test_keys[0]);
 
 	for (int i = 0; i < count_test_keys; i++) {
-		*(uint32_t *)K.data = test_keys[i];
+		treap_key_set(&K, test_keys[i]);
 		treap_insert(t, &K, i+1);
 	}
-	ASSERT(treap_valid(t->root) == 1, "check validity of treap");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
 	for (int i = 0; i < count_test_keys; i++) {
-		*(uint32_t *)K.data = test_keys[count_test_keys - i - 1];
+		treap_key_set(&K, test_keys[count_test_keys - i - 1]);
 		treap_delete(t, &K);
-		ASSERT(treap_valid(t->root) == 1, "check validity of treap (delete: %d)", i);
+		ASSERT(treap_valid(t, t->root) == 1, "check validity of treap (delete: %d)", i);
+	}
+
+	return true;
+}
+
+bool test_replace_top(void)
+{
+	int ret;
+	struct treap_key K = {}, old = {};
+	struct treap *t = treap_new();
+	const uint32_t count_nodes = 64;
+
+	ret = treap_replace_top(t, &K, 1);
+	ASSERT(ret == -ENOENT, "replacing the top of an empty treap should fail");
+
+	srand(31415);
+	for (uint32_t i = 0; i < count_nodes; i++) {
+		treap_key_set(&K, i * 7);
+		ret = treap_insert(t, &K, rand());
+		ASSERT(ret == 0, "failed to insert (%d)", ret);
+	}
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+
+	for (uint32_t i = 0; i < 1000; i++) {
+		struct treap_node *top = treap_top(t);
+		memcpy(&old, &top->key, sizeof(old));
+		// keys 7k+1 are not in the treap
+		treap_key_set(&K, (rand() % count_nodes) * 7 + 1 + i * 7 * count_nodes);
+		uint32_t prio = rand() % (treap_priority(t, top) + 1);
+		ret = treap_replace_top(t, &K, prio);
+		ASSERT(ret == 0, "treap_replace_top failed (%d)", ret);
+		ASSERT(treap_valid(t, t->root) == 1, "check validity of treap (replace: %d)", i);
+		ASSERT(t->used == count_nodes, "number of nodes changed");
+		ASSERT(treap_find(t, &old) == NULL, "old top is still in the treap");
+		struct treap_node *n = treap_find(t, &K);
+		ASSERT(n != NULL, "new key is not in the treap");
+		ASSERT(treap_priority(t, n) == prio, "new key has a wrong priority");
+	}
+
+	treap_destroy(t);
+	return true;
+}
+
+bool test_upsert(void)
+{
+	int ret, expected;
+	struct treap_key K = {};
+	const uint32_t count_keys = 100;
+	const uint32_t capacity = 64;
+	struct treap *t = treap_new_sized(capacity);
+	uint8_t present[100] = {};
+	uint32_t prio[100] = {};
+	uint32_t used = 0;
+
+	ASSERT(t != NULL, "failed to allocate a treap");
+	srand(27182);
+	for (uint32_t i = 0; i < 5000; i++) {
+		uint32_t key = rand() % count_keys;
+		uint32_t p = rand() % 1000;
+		int keep = rand() % 3 != 0;
+		treap_key_set(&K, key);
+
+		if (!keep) {
+			expected = present[key] ? TREAP_UPSERT_DELETED : TREAP_UPSERT_ABSENT;
+			if (present[key])
+				used--;
+			present[key] = 0;
+		} else if (present[key]) {
+			expected = TREAP_UPSERT_UPDATED;
+			prio[key] = p;
+		} else if (used < capacity) {
+			expected = TREAP_UPSERT_INSERTED;
+			present[key] = 1;
+			prio[key] = p;
+			used++;
+		} else {
+			expected = -ENOSPC;
+		}
+
+		ret = treap_upsert(t, &K, p, keep);
+		ASSERT(ret == expected, "unexpected result %d != %d (op: %d)", ret, expected, i);
+		ASSERT(treap_valid(t, t->root) == 1, "check validity of treap (op: %d)", i);
+		ASSERT(t->used == used, "wrong number of nodes (op: %d)", i);
+		struct treap_node *n = treap_find(t, &K);
+		if (present[key]) {
+			ASSERT(n != NULL, "key is not in the treap (op: %d)", i);
+			ASSERT(treap_priority(t, n) == prio[key], "wrong priority (op: %d)", i);
+		} else {
+			ASSERT(n == NULL, "key should not be in the treap (op: %d)", i);
+		}
+	}
+
+	treap_destroy(t);
+	return true;
+}
+
+bool test_degenerate_height(void)
+{
+	int ret;
+	struct treap_key K = {};
+	const uint32_t count_nodes = 4096;
+	struct treap *t = treap_new_sized(count_nodes);
+	ASSERT(t != NULL, "failed to allocate a treap");
+
+	// increasing keys with increasing priorities make a single chain, far
+	// deeper than treap_height_bound()
+	for (uint32_t i = 0; i < count_nodes; i++) {
+		treap_key_set(&K, i);
+		ret = treap_insert(t, &K, i);
+		ASSERT(ret == 0, "failed to insert at depth %d (%d)", i, ret);
+	}
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+	treap_key_set(&K, 0);
+	ASSERT(treap_find(t, &K) != NULL, "the deepest key is not found");
+
+	treap_key_set(&K, 1);
+	ret = treap_upsert(t, &K, count_nodes, 1);
+	ASSERT(ret == TREAP_UPSERT_UPDATED, "failed to move a deep node up (%d)", ret);
+	ASSERT(treap_top(t) == treap_find(t, &K), "the node should be the root");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+
+	for (uint32_t i = 0; i < count_nodes; i++) {
+		treap_key_set(&K, i);
+		ret = treap_delete(t, &K);
+		ASSERT(ret == 0, "failed to delete %d (%d)", i, ret);
+	}
+	ASSERT(t->used == 0, "treap should be empty now");
+
+	treap_destroy(t);
+	return true;
+}
+
+bool test_build_sorted(void)
+{
+	int ret;
+	struct treap_key K = {};
+	const uint32_t count_keys = 5000;
+	struct treap *t = treap_new_sized(count_keys + 1);
+	struct treap_key *keys = calloc(count_keys, sizeof(struct treap_key));
+	struct treap_key *out_keys = calloc(count_keys, sizeof(struct treap_key));
+	treap_prio_t *prios = calloc(count_keys, sizeof(treap_prio_t));
+	treap_prio_t *out_prios = calloc(count_keys, sizeof(treap_prio_t));
+	ASSERT(t != NULL && keys != NULL && out_keys != NULL && prios != NULL &&
+		out_prios != NULL, "failed to allocate");
+
+	srand(31415);
+	uint32_t key = 0;
+	for (uint32_t i = 0; i < count_keys; i++) {
+		key += 1 + rand() % 10;
+		treap_key_set(&keys[i], key);
+		// a few equal priorities on the way
+		prios[i] = rand() % (count_keys * 4);
 	}
+	ret = treap_build_sorted(t, keys, prios, count_keys);
+	ASSERT(ret == 0, "failed to build the treap (%d)", ret);
+	ASSERT(t->used == count_keys, "wrong number of nodes");
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
+
+	// the in-order export gives the input back
+	ret = treap_export_sorted(t, out_keys, out_prios);
+	ASSERT(ret == 0, "failed to export the treap (%d)", ret);
+	for (uint32_t i = 0; i < count_keys; i++) {
+		ASSERT(treap_key_eq(&keys[i], &out_keys[i]) &&
+			prios[i] == out_prios[i], "wrong pair at %d", i);
+		struct treap_node *n = treap_find(t, &keys[i]);
+		ASSERT(n != NULL && treap_priority(t, n) == prios[i],
+			"key %d is not found", i);
+	}
+
+	// the treap is usable after the build
+	treap_key_set(&K, key + 1);
+	ASSERT(treap_insert(t, &K, count_keys * 4) == 0, "failed to insert");
+	ASSERT(treap_top(t) == treap_find(t, &K), "the node should be the root");
+	for (uint32_t i = 0; i < count_keys; i += 2)
+		ASSERT(treap_delete(t, &keys[i]) == 0, "failed to delete %d", i);
+	ASSERT(treap_valid(t, t->root) == 1, "check validity of treap");
 
+	ASSERT(treap_build_sorted(t, keys, prios, count_keys + 2) == -ENOSPC,
+		"built past the capacity");
+	keys[1] = keys[0];
+	ASSERT(treap_build_sorted(t, keys, prios, count_keys) == -EINVAL,
+		"built from unsorted keys");
+
+	free(keys);
+	free(out_keys);
+	free(prios);
+	free(out_prios);
+	treap_destroy(t);
+	return true;
+}
+
+bool test_find_batch(void)
+{
+	const uint32_t count_keys = 3000;
+	// every other key is in the treap
+	const uint32_t count_search = 2 * count_keys + 7;
+	struct treap *t = treap_new_sized(count_keys);
+	struct treap_key *keys = calloc(count_search, sizeof(struct treap_key));
+	struct treap_node **out = calloc(count_search, sizeof(struct treap_node *));
+	ASSERT(t != NULL && keys != NULL && out != NULL, "failed to allocate");
+
+	srand(2718);
+	for (uint32_t i = 0; i < count_keys; i++) {
+		treap_key_set(&keys[0], 2 * i);
+		ASSERT(treap_insert(t, &keys[0], rand()) == 0, "failed to insert");
+	}
+	// in a shuffled order, so the walks in flight end at different depths
+	for (uint32_t i = 0; i < count_search; i++)
+		treap_key_set(&keys[i], (i * 2654435761u) % count_search);
+	treap_find_batch(t, keys, out, count_search);
+	for (uint32_t i = 0; i < count_search; i++) {
+		ASSERT(out[i] == treap_find(t, &keys[i]),
+			"wrong node for key %lu", treap_key_get(&keys[i]));
+		ASSERT((out[i] != NULL) == (treap_key_get(&keys[i]) % 2 == 0 &&
+			treap_key_get(&keys[i]) < 2 * count_keys),
+			"key %lu found in the wrong treap", treap_key_get(&keys[i]));
+	}
+
+	// batches smaller than the lanes and an empty treap
+	out[0] = out[1] = NULL;
+	treap_key_set(&keys[0], 4);
+	treap_key_set(&keys[1], 5);
+	treap_find_batch(t, keys, out, 2);
+	ASSERT(out[0] != NULL && treap_key_get(&out[0]->key) == 4 &&
+		out[1] == NULL, "wrong result of a short batch");
+	treap_reset(t);
+	treap_find_batch(t, keys, out, 2);
+	ASSERT(out[0] == NULL && out[1] == NULL, "found a key in an empty treap");
+	treap_find_batch(t, keys, out, 0);
+
+	free(keys);
+	free(out);
+	treap_destroy(t);
 	return true;
 }
 
@@ -167,7 +404,9 @@ int main(int argc, char *argv[])
 		"\t\tTESTING\n"
 		"...........................................\n");
 	bool res;
-	test_fn suite[] = {test_basic, test_delete,};
+	test_fn suite[] = {test_basic, test_delete, test_replace_top,
+		test_upsert, test_degenerate_height, test_build_sorted,
+		test_find_batch,};
 	const size_t count_tests = sizeof(suite)/sizeof(suite[0]);
 	for (int i = 0; i < count_tests; i++) {
 		res = suite[i]();
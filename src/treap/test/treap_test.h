@@ -10,48 +10,68 @@ enum bool_values {
 };
 #endif
 
-static bool treap_valid(struct treap_node *ptr)
+static bool treap_valid(struct treap *t, treap_ref_t ref)
 {
+	struct treap_node *ptr = treap_node(t, ref);
 	if (ptr == NULL)
 		return true;
 
 	// check the left and right subtree to be valid
-	if (!treap_valid(ptr->left) || !treap_valid(ptr->right)) {
+	if (!treap_valid(t, ptr->left) || !treap_valid(t, ptr->right)) {
 		return false; // there was an issue
 	}
 
-	if (ptr->left != NULL) {
+	struct treap_node *left = treap_node(t, ptr->left);
+	struct treap_node *right = treap_node(t, ptr->right);
+	if (left != NULL) {
 		// every left child should be strictly smaller than its parent
-		if (!treap_key_less_than(&ptr->left->key, &ptr->key)) {
-			fprintf(stderr, "%d < %d\n", *(uint32_t *)ptr->left->key.data,
-					*(uint32_t *)ptr->key.data);
+		if (!treap_key_less_than(&left->key, &ptr->key)) {
+			fprintf(stderr, "%lu < %lu\n", treap_key_get(&left->key),
+					treap_key_get(&ptr->key));
 			return false;
 		}
 
 		// parent should have a higher or equal priority
-		if (ptr->priority < ptr->left->priority) {
+		if (treap_priority(t, ptr) < treap_priority(t, left)) {
 			fprintf(stderr, "priority violation (1)\n");
 			return false;
 		}
 	}
 
-	if (ptr->right != NULL) {
+	if (right != NULL) {
 		// every right parent should be less or equal to the right child
-		if (!treap_key_less_than(&ptr->key, &ptr->right->key))
-			if (!treap_key_eq(&ptr->key, &ptr->right->key)) {
-				fprintf(stderr, "%d < %d",
-					*(uint32_t *)ptr->key.data,
-					*(uint32_t *)ptr->right->key.data);
+		if (!treap_key_less_than(&ptr->key, &right->key))
+			if (!treap_key_eq(&ptr->key, &right->key)) {
+				fprintf(stderr, "%lu < %lu",
+					treap_key_get(&ptr->key),
+					treap_key_get(&right->key));
 				return false;
 			}
 
 		// parent should have a higher or equal priority
-		if (ptr->priority < ptr->right->priority) {
+		if (treap_priority(t, ptr) < treap_priority(t, right)) {
 			fprintf(stderr, "priority violation (2)\n");
 			return false;
 		}
 	}
 
+#ifdef TREAP_HASH_INDEX
+	// the index should point to the node
+	if (treap_find(t, &ptr->key) == NULL) {
+		fprintf(stderr, "key %lu is not in the index\n",
+				treap_key_get(&ptr->key));
+		return false;
+	}
+	// and the children to their parent
+	if ((left != NULL && left->parent != ref) ||
+			(right != NULL && right->parent != ref) ||
+			(ref == t->root && ptr->parent != TREAP_NIL)) {
+		fprintf(stderr, "wrong parent link at %lu\n",
+				treap_key_get(&ptr->key));
+		return false;
+	}
+#endif
+
 	// found no issue (note: an empty treap is also valid)
 	return true;
 }
@@ -71,24 +91,28 @@ static int treap_report_priority_in_order(struct treap *t, int **out, uint32_t *
 	if (count_nodes == 0)
 		return 0;
 
-	struct treap_node *stack[TREAP_MAX_HEIGHT] = {};
+	// the stack is as deep as the treap, the walk of any path fits
+	treap_ref_t *stack = calloc(count_nodes, sizeof(treap_ref_t));
+	if (stack == NULL)
+		return -ENOMEM;
 	size_t stack_sz = 0;
 
-	struct treap_node *cur = t->root;
+	struct treap_node *cur = treap_node(t, t->root);
 	while (stack_sz > 0 || cur != NULL) {
 		if (cur != NULL) {
 			// stack:push
-			stack[stack_sz++] = cur;
-			cur = cur->left;
+			stack[stack_sz++] = __ref(t, cur);
+			cur = treap_node(t, cur->left);
 		} else {
 			// stack:pop
 			stack_sz--;
-			cur = stack[stack_sz];
+			cur = treap_node(t, stack[stack_sz]);
 			// visit
-			arr[arr_index++] = cur->priority;
-			cur = cur->right;
+			arr[arr_index++] = treap_priority(t, cur);
+			cur = treap_node(t, cur->right);
 		}
 	}
 
+	free(stack);
 	return 0;
 }
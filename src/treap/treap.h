@@ -12,68 +12,456 @@
 #include <errno.h>
 #include <assert.h>
 
-#define __packed __attribute__((packed))
 #ifndef __always_inline
 #define __always_inline __attribute__((always_inline))
 #endif
 
 
+// the capacity of a treap made with treap_new() (see treap_new_sized)
 #ifndef TREAP_MAX_SIZE
 #define TREAP_MAX_SIZE 128
 #endif
 
-#ifndef TREAP_MAX_HEIGHT
-// the max height is used to make while loops, ... bounded
-#define TREAP_MAX_HEIGHT 16
+// How nodes are linked and stored (select by defining TREAP_LAYOUT):
+//  PTR: nodes point to their children (24 bytes per node)
+//  IDX: children are TREAP_INDEX_BITS indices into nodes[] (12 or 16 bytes)
+//  SOA: like IDX but the priorities are in a separate array, so the search
+//       loop only touches keys and children (8 or 12 bytes + 4)
+#define TREAP_LAYOUT_PTR 0
+#define TREAP_LAYOUT_IDX 1
+#define TREAP_LAYOUT_SOA 2
+
+#ifndef TREAP_LAYOUT
+#define TREAP_LAYOUT TREAP_LAYOUT_PTR
 #endif
 
-// user can define its own key by defining the key size and following functions
-// and struct (NOTE: it looks ugly do something better later)
+#ifndef TREAP_INDEX_BITS
+#define TREAP_INDEX_BITS 32
+#endif
+
+// Keys are 4, 8 or 16 byte unsigned integers (TREAP_KEY_SIZE). A user can
+// define its own key by defining TREAP_CUSTOM_KEY, TREAP_KEY_SIZE, the struct
+// and the treap_key_* functions below.
+#ifndef TREAP_CUSTOM_KEY
 #ifndef TREAP_KEY_SIZE
 #define TREAP_KEY_SIZE 4
+#endif
+#if TREAP_KEY_SIZE == 4
+typedef uint32_t __treap_word_t;
+#elif TREAP_KEY_SIZE == 8
+typedef uint64_t __treap_word_t;
+#elif TREAP_KEY_SIZE == 16
+typedef unsigned __int128 __treap_word_t;
+#else
+#error "TREAP_KEY_SIZE should be 4, 8 or 16 (or define TREAP_CUSTOM_KEY)"
+#endif
+
+// the key is kept as bytes so it adds no alignment to the node, it is read
+// with memcpy (a plain load, without type punning)
 struct treap_key {
 	uint8_t data[TREAP_KEY_SIZE];
-} __packed;
+};
+
+static __always_inline
+__treap_word_t __treap_key_load(const struct treap_key *a)
+{
+	__treap_word_t w;
+	memcpy(&w, a->data, sizeof(w));
+	return w;
+}
 
 static __always_inline
 int treap_key_less_than(struct treap_key *a, struct treap_key *b)
 {
-	return *((uint32_t *)&a->data) < *((uint32_t *)&b->data);
+	return __treap_key_load(a) < __treap_key_load(b);
 }
 
 static __always_inline
 int treap_key_eq(struct treap_key *a, struct treap_key *b)
 {
-	return *((uint32_t *)&a->data) == *((uint32_t *)&b->data);
+	return __treap_key_load(a) == __treap_key_load(b);
+}
+
+// only needed with TREAP_HASH_INDEX (fibonacci hashing)
+static __always_inline
+uint32_t treap_key_hash(struct treap_key *a)
+{
+	__treap_word_t w = __treap_key_load(a);
+#if TREAP_KEY_SIZE == 16
+	uint64_t x = (uint64_t)w ^ (uint64_t)(w >> 64);
+#else
+	uint64_t x = w;
+#endif
+	return (x * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* set the key to an integer value (the higher bytes of wide keys are zero) */
+static __always_inline
+void treap_key_set(struct treap_key *k, uint64_t v)
+{
+	__treap_word_t w = v;
+	memcpy(k->data, &w, sizeof(w));
 }
+
+/* the value of the key (truncated to 64 bits) */
+static __always_inline
+uint64_t treap_key_get(struct treap_key *k)
+{
+	return (uint64_t)__treap_key_load(k);
+}
+#endif
+
+// Define TREAP_HASH_INDEX to keep a hash table from keys to nodes next to the
+// treap. Looking up a key that is absent (the common case for CVM) costs a
+// single probe instead of a descent. Nodes also keep their parent, so that a
+// node found in the table is unlinked without walking down to it.
+
+// a reference to a node
+#if TREAP_LAYOUT == TREAP_LAYOUT_PTR
+typedef struct treap_node *treap_ref_t;
+#define TREAP_NIL NULL
+// the first slot of nodes[] that is used
+#define __TREAP_FIRST_SLOT 0
+#else
+#if TREAP_INDEX_BITS == 16
+typedef uint16_t treap_ref_t;
+#elif TREAP_INDEX_BITS == 32
+typedef uint32_t treap_ref_t;
+#else
+#error "TREAP_INDEX_BITS should be 16 or 32"
+#endif
+// index zero is never allocated, it plays the role of NULL
+#define TREAP_NIL 0
+#define __TREAP_FIRST_SLOT 1
+#endif
+
+#ifdef TREAP_HASH_INDEX
+struct __treap_hslot {
+	uint32_t hash; // hash of the key
+	treap_ref_t ref; // TREAP_NIL when the slot is empty
+};
+#endif
+
+// Width of the priorities, 32 or 64 bits (e.g. to hold 64-bit fixed point
+// probabilities)
+#ifndef TREAP_PRIO_BITS
+#define TREAP_PRIO_BITS 32
+#endif
+#if TREAP_PRIO_BITS == 32
+typedef uint32_t treap_prio_t;
+#elif TREAP_PRIO_BITS == 64
+typedef uint64_t treap_prio_t;
+#else
+#error "TREAP_PRIO_BITS should be 32 or 64"
 #endif
 
 struct treap_node {
 	struct treap_key key;
-	uint32_t priority;
-	struct treap_node *left;
-	struct treap_node *right;
+#if TREAP_LAYOUT != TREAP_LAYOUT_SOA
+	treap_prio_t priority;
+#endif
+	treap_ref_t left;
+	treap_ref_t right;
+#ifdef TREAP_HASH_INDEX
+	treap_ref_t parent; // TREAP_NIL for the root
+#endif
 };
 
+// The arrays are sized at runtime and live in the same allocation as the
+// struct (see treap_new_sized)
+// Counters of the walks in the treap, compiled in with TREAP_STATS. The treap
+// has no rotations: an insert splits the sub-tree below its place and a
+// delete merges the two sub-trees of the node, each step re-links one node.
+#ifdef TREAP_STATS
+struct treap_stats {
+	uint64_t searches; // walks down from the root
+	uint64_t search_steps; // nodes visited by them
+	uint64_t split_steps; // nodes re-linked by the splits of inserts
+	uint64_t merge_steps; // nodes re-linked by the merges of deletes
+	uint32_t max_depth; // deepest node reached by a walk
+};
+#define __treap_stat(t, field, v) ((t)->stats.field += (v))
+#define __treap_stat_walk(t, depth) do { \
+		(t)->stats.searches++; \
+		(t)->stats.search_steps += (depth); \
+		if ((depth) > (t)->stats.max_depth) \
+			(t)->stats.max_depth = (depth); \
+	} while (0)
+#else
+#define __treap_stat(t, field, v) do {} while (0)
+#define __treap_stat_walk(t, depth) do {} while (0)
+#endif
+
 struct treap {
-	struct treap_node *root;
-	struct treap_node nodes[TREAP_MAX_SIZE];
-	uint32_t used; // number of nodes in the treap --> Top of the stack (TREAP_MAX_SIZE - used - 1)
-	struct treap_node *stack[TREAP_MAX_SIZE]; // stack of free nodes
+	treap_ref_t root;
+	uint32_t used; // number of nodes in the treap --> Top of the stack (capacity - used - 1)
+	uint32_t capacity; // number of nodes the treap can hold
+	struct treap_node *nodes; // capacity + __TREAP_FIRST_SLOT nodes
+#if TREAP_LAYOUT == TREAP_LAYOUT_SOA
+	treap_prio_t *prio;
+#endif
+	treap_ref_t *stack; // stack of free nodes
+#ifdef TREAP_HASH_INDEX
+	uint32_t hmask; // number of slots - 1 (a power of two)
+	struct __treap_hslot *hidx; // robin-hood table (key -> node)
+#endif
+#ifdef TREAP_STATS
+	struct treap_stats stats;
+#endif
 };
 
-struct treap *treap_new(void)
+// converting between nodes and references
+#if TREAP_LAYOUT == TREAP_LAYOUT_PTR
+#define __node(t, r) (r)
+#define __ref(t, n) (n)
+#else
+#define __node(t, r) (&(t)->nodes[(r)])
+#define __ref(t, n) ((treap_ref_t)((n) - (t)->nodes))
+#endif
+
+#if TREAP_LAYOUT == TREAP_LAYOUT_SOA
+#define __prio(t, n) ((t)->prio[__ref(t, n)])
+#else
+#define __prio(t, n) ((n)->priority)
+#endif
+
+/* the node a reference points to (NULL for TREAP_NIL)
+ * */
+static __always_inline
+struct treap_node *treap_node(struct treap *t, treap_ref_t r)
+{
+	(void)t; // a pointer is the node itself
+	return r == TREAP_NIL ? NULL : __node(t, r);
+}
+
+static __always_inline
+treap_prio_t treap_priority(struct treap *t, struct treap_node *n)
+{
+	(void)t; // only the SOA layout keeps the priorities apart
+	return __prio(t, n);
+}
+
+#ifdef TREAP_HASH_INDEX
+/* distance of a slot from the home slot of the hash it holds */
+static __always_inline
+uint32_t __treap_hdist(struct treap *t, uint32_t slot, uint32_t hash)
+{
+	return (slot - hash) & t->hmask;
+}
+
+static inline
+struct treap_node *__treap_hidx_find(struct treap *t, struct treap_key *key)
+{
+	uint32_t hash = treap_key_hash(key);
+	uint32_t i = hash & t->hmask;
+	for (uint32_t d = 0; d <= t->hmask; d++) {
+		struct __treap_hslot *s = &t->hidx[i];
+		// the entries are ordered by distance from home, the key would
+		// have taken the place of an entry that is closer to its home
+		if (s->ref == TREAP_NIL || __treap_hdist(t, i, s->hash) < d)
+			return NULL;
+		if (s->hash == hash && treap_key_eq(key, &__node(t, s->ref)->key))
+			return __node(t, s->ref);
+		i = (i + 1) & t->hmask;
+	}
+	return NULL;
+}
+
+static inline void __treap_hidx_add(struct treap *t, struct treap_node *n)
+{
+	struct __treap_hslot cur = {treap_key_hash(&n->key), __ref(t, n)};
+	uint32_t i = cur.hash & t->hmask;
+	uint32_t d = 0;
+	// the table has more slots than the treap has nodes, there is always
+	// an empty slot
+	for (uint32_t k = 0; k <= t->hmask; k++) {
+		struct __treap_hslot *s = &t->hidx[i];
+		if (s->ref == TREAP_NIL) {
+			*s = cur;
+			return;
+		}
+		uint32_t sd = __treap_hdist(t, i, s->hash);
+		if (sd < d) {
+			// take the slot from an entry closer to its home
+			struct __treap_hslot tmp = *s;
+			*s = cur;
+			cur = tmp;
+			d = sd;
+		}
+		i = (i + 1) & t->hmask;
+		d++;
+	}
+}
+
+static inline void __treap_hidx_del(struct treap *t, struct treap_node *n)
+{
+	treap_ref_t ref = __ref(t, n);
+	uint32_t i = treap_key_hash(&n->key) & t->hmask;
+	uint32_t k;
+	for (k = 0; k <= t->hmask; k++) {
+		if (t->hidx[i].ref == ref)
+			break;
+		i = (i + 1) & t->hmask;
+	}
+	// shift the following entries back until one is at its home
+	for (k = 0; k <= t->hmask; k++) {
+		uint32_t j = (i + 1) & t->hmask;
+		struct __treap_hslot *s = &t->hidx[j];
+		if (s->ref == TREAP_NIL || __treap_hdist(t, j, s->hash) == 0)
+			break;
+		t->hidx[i] = *s;
+		i = j;
+	}
+	t->hidx[i].ref = TREAP_NIL;
+}
+
+/* the node that holds a link (TREAP_NIL for the root link) */
+static __always_inline
+treap_ref_t __treap_link_owner(struct treap *t, treap_ref_t *link)
+{
+	if (link == &t->root)
+		return TREAP_NIL;
+	size_t i = ((uint8_t *)link - (uint8_t *)t->nodes) /
+		sizeof(struct treap_node);
+	return __ref(t, &t->nodes[i]);
+}
+
+/* point a link to `r` and make its owner the parent of `r` */
+static __always_inline
+void __treap_set_link(struct treap *t, treap_ref_t *link, treap_ref_t r)
+{
+	*link = r;
+	if (r != TREAP_NIL)
+		__node(t, r)->parent = __treap_link_owner(t, link);
+}
+
+/* the link that points to a node */
+static __always_inline
+treap_ref_t *__treap_parent_link(struct treap *t, struct treap_node *n)
+{
+	if (n->parent == TREAP_NIL)
+		return &t->root;
+	struct treap_node *p = __node(t, n->parent);
+	return p->left == __ref(t, n) ? &p->left : &p->right;
+}
+
+/* slots of the table for a treap of `capacity` nodes (load <= 1/2) */
+static __always_inline
+uint32_t __treap_hslots(uint32_t capacity)
+{
+	uint32_t slots = 8;
+	while (slots < 2 * (uint64_t)capacity)
+		slots <<= 1;
+	return slots;
+}
+#else
+static __always_inline
+void __treap_hidx_add(struct treap *t, struct treap_node *n)
+{
+	(void)t;
+	(void)n;
+}
+static __always_inline
+void __treap_hidx_del(struct treap *t, struct treap_node *n)
+{
+	(void)t;
+	(void)n;
+}
+// without the table no node needs its parent
+#define __treap_set_link(t, link, r) (*(link) = (r))
+#endif
+
+static void __treap_fill_stack(struct treap *t)
 {
+	for (uint32_t k = 0; k < t->capacity; k++)
+		t->stack[t->capacity - k - 1] =
+			__ref(t, &t->nodes[__TREAP_FIRST_SLOT + k]);
+}
+
+/* The expected bound on the height of a treap with `capacity` nodes. The
+ * height of a random BST (and a treap) is about 4.311 ln(n) ~= 3 log2(n), we
+ * add some slack for small trees. The treap operations do not depend on it,
+ * a deeper treap is still handled correctly.
+ * */
+static __always_inline
+uint32_t treap_height_bound(uint32_t capacity)
+{
+	uint32_t log2 = 32 - __builtin_clz(capacity | 1);
+	return 3 * log2 + 8;
+}
+
+static __always_inline
+size_t __align_up(size_t x, size_t a)
+{
+	return (x + a - 1) & ~(a - 1);
+}
+
+/* allocate a treap that holds up to `capacity` nodes. The struct, the nodes
+ * and the free stack are a single allocation.
+ * */
+struct treap *treap_new_sized(uint32_t capacity)
+{
+	if (capacity == 0)
+		return NULL;
+#if TREAP_LAYOUT != TREAP_LAYOUT_PTR && TREAP_INDEX_BITS < 32
+	if ((uint64_t)capacity >= (1ULL << TREAP_INDEX_BITS))
+		return NULL;
+#endif
+	const size_t slots = (size_t)capacity + __TREAP_FIRST_SLOT;
+	size_t off_nodes = __align_up(sizeof(struct treap), 16);
+	size_t off_prio = __align_up(off_nodes + slots * sizeof(struct treap_node),
+			sizeof(treap_prio_t));
+	size_t off_stack = off_prio;
+#if TREAP_LAYOUT == TREAP_LAYOUT_SOA
+	off_stack += slots * sizeof(treap_prio_t);
+#endif
+	off_stack = __align_up(off_stack, sizeof(treap_ref_t));
+	size_t total = off_stack + capacity * sizeof(treap_ref_t);
+#ifdef TREAP_HASH_INDEX
+	if (capacity > (1U << 31))
+		return NULL;
+	size_t off_hidx = __align_up(total, sizeof(struct __treap_hslot));
+	total = off_hidx + (size_t)__treap_hslots(capacity) *
+		sizeof(struct __treap_hslot);
+#endif
+
 	// calloc will initialize the left and rgith pointers to be NULL, which is
 	// good
-	struct treap *t = calloc(1, sizeof(struct treap));
-	if (t == NULL)
+	uint8_t *mem = calloc(1, total);
+	if (mem == NULL)
 		return NULL;
-	for (uint32_t k = 0; k < TREAP_MAX_SIZE; k++)
-		t->stack[TREAP_MAX_SIZE - k - 1] = &t->nodes[k];
+	struct treap *t = (struct treap *)mem;
+	t->capacity = capacity;
+	t->nodes = (struct treap_node *)(mem + off_nodes);
+#if TREAP_LAYOUT == TREAP_LAYOUT_SOA
+	t->prio = (treap_prio_t *)(mem + off_prio);
+#endif
+	t->stack = (treap_ref_t *)(mem + off_stack);
+#ifdef TREAP_HASH_INDEX
+	t->hmask = __treap_hslots(capacity) - 1;
+	t->hidx = (struct __treap_hslot *)(mem + off_hidx);
+#endif
+	__treap_fill_stack(t);
 	return t;
 }
 
+struct treap *treap_new(void)
+{
+	return treap_new_sized(TREAP_MAX_SIZE);
+}
+
+/* remove every node from the treap (the capacity is not changed)
+ * */
+void treap_reset(struct treap *t)
+{
+	t->root = TREAP_NIL;
+	t->used = 0;
+	__treap_fill_stack(t);
+#ifdef TREAP_HASH_INDEX
+	memset(t->hidx, 0, ((size_t)t->hmask + 1) * sizeof(struct __treap_hslot));
+#endif
+}
+
 void treap_destroy(struct treap *t)
 {
 	free(t);
@@ -82,43 +470,47 @@ void treap_destroy(struct treap *t)
 /* get the highest priority node (a.k.a. root)
  * */
 struct treap_node *treap_top(struct treap *t) {
-	return t->root;
+	return treap_node(t, t->root);
 }
 
-static void __treap_find(struct treap *t, struct treap_key *key,
+static inline void __treap_find(struct treap *t, struct treap_key *key,
 		struct treap_node **node_out,
-		struct treap_node ***node_parent_link)
+		treap_ref_t **node_parent_link)
 {
 	*node_out = NULL;
 	*node_parent_link = NULL;
 
-	struct treap_node *ptr = t->root;
-	struct treap_node **link = &t->root;
+	treap_ref_t ptr = t->root;
+	treap_ref_t *link = &t->root;
 	uint32_t k;
-	for (k = 0; k < TREAP_MAX_HEIGHT; k++) {
-		if (ptr == NULL) {
+	// no path is longer than the number of nodes, so the bound never cuts
+	// a search short
+	for (k = 0; k <= t->capacity; k++) {
+		if (ptr == TREAP_NIL) {
 			// key does not exists in the treap (or there is a bug in
 			// implementation of the treap)
+			__treap_stat_walk(t, k);
 			return;
 		}
+		struct treap_node *n = __node(t, ptr);
 		// TODO: maybe I could optimize it with having only one comparison
-		if (treap_key_less_than(key, &ptr->key)) {
+		if (treap_key_less_than(key, &n->key)) {
 			// less
-			link = &ptr->left;
-			ptr = ptr->left;
+			link = &n->left;
+			ptr = n->left;
 		} else {
 			// greater or equal
-			if (treap_key_eq(key, &ptr->key)) {
+			if (treap_key_eq(key, &n->key)) {
 				// found it
+				__treap_stat_walk(t, k + 1);
 				*node_parent_link = link;
-				*node_out = ptr;
+				*node_out = n;
 				return;
 			}
-			link = &ptr->right;
-			ptr = ptr->right;
+			link = &n->right;
+			ptr = n->right;
 		}
 	}
-	// did not found the result in the bounded height
 	return;
 }
 
@@ -126,82 +518,104 @@ static void __treap_find(struct treap *t, struct treap_key *key,
  * */
 struct treap_node *treap_find(struct treap *t, struct treap_key *key)
 {
+#ifdef TREAP_HASH_INDEX
+	return __treap_hidx_find(t, key);
+#else
 	struct treap_node *n;
-	struct treap_node **link;
+	treap_ref_t *link;
 	__treap_find(t, key, &n, &link);
 	return n;
+#endif
 }
 
-enum ROTATE_DIR {
-	LEFT,
-	RIGHT,
-};
+// number of searches in flight in treap_find_batch
+#ifndef TREAP_FIND_LANES
+#define TREAP_FIND_LANES 8
+#endif
 
+/* Search `n` keys, out[i] is set to the node of keys[i] (NULL if absent).
+ * Up to TREAP_FIND_LANES walks advance in turn, one level each, and every
+ * step prefetches the child its walk goes to: the cache misses of the walks
+ * overlap instead of stalling one after the other. A finished walk hands its
+ * lane to the next key (asynchronous memory access chaining), so short and
+ * long paths do not wait for each other.
+ * */
 static __always_inline
-struct treap_node ** __get_parent_link(struct treap_node *p, struct treap_node *n)
+void __treap_find_batch(struct treap *t, struct treap_key *keys,
+		struct treap_node **out, size_t n, int stats)
 {
-	if (p->left == n) {
-		return &p->left;
-	} else if (p->right == n) {
-		return &p->right;
+	struct {
+		treap_ref_t ptr;
+		uint32_t depth;
+		size_t i; // the key searched, n once the lane is idle
+	} lane[TREAP_FIND_LANES];
+	size_t next = 0;
+	int active = 0;
+	for (int l = 0; l < TREAP_FIND_LANES; l++) {
+		lane[l].ptr = t->root;
+		lane[l].depth = 0;
+		lane[l].i = next < n ? next++ : n;
+		active += lane[l].i < n;
+	}
+	while (active > 0) {
+		for (int l = 0; l < TREAP_FIND_LANES; l++) {
+			size_t i = lane[l].i;
+			treap_ref_t ptr = lane[l].ptr;
+			struct treap_node *found = NULL;
+			if (i == n)
+				continue;
+			// the same bound as __treap_find
+			if (ptr != TREAP_NIL && lane[l].depth <= t->capacity) {
+				struct treap_node *nd = __node(t, ptr);
+				lane[l].depth++;
+				if (!treap_key_eq(&keys[i], &nd->key)) {
+					ptr = treap_key_less_than(&keys[i], &nd->key) ?
+						nd->left : nd->right;
+					// a prefetch of TREAP_NIL does not fault
+					__builtin_prefetch(__node(t, ptr));
+					lane[l].ptr = ptr;
+					continue;
+				}
+				found = nd;
+			}
+			if (stats)
+				__treap_stat_walk(t, lane[l].depth);
+			if (out != NULL)
+				out[i] = found;
+			lane[l].ptr = t->root;
+			lane[l].depth = 0;
+			lane[l].i = next < n ? next++ : n;
+			active -= lane[l].i == n;
+		}
 	}
-	return NULL;
 }
 
-static __always_inline
-void __rotate(struct treap_node **link, enum ROTATE_DIR dir)
+void treap_find_batch(struct treap *t, struct treap_key *keys,
+		struct treap_node **out, size_t n)
 {
-	// these names represents the initial state, after rotation the parent will
-	// become the child and child will be the parent
-	struct treap_node *parent, *child;
-
-	parent = *link;
-	/* printf("rotate %s on node with prio=%d\n", */
-	/* 		dir == LEFT ? "left": "right", */
-	/* 		parent == NULL ? -1 : parent->priority); */
-
-	if (parent == NULL) {
-		// nothing to do
-		return;
-	}
-
-	if (dir == RIGHT) {
-		child = parent->left;
-		if (child == NULL) {
-			// nothing to do
-			return;
-		}
-
-		*link = child;
-		struct treap_node *left_right = child->right;
-		child->right = parent;
-		parent->left = left_right;
-	} else if (dir == LEFT) {
-		child = parent->right;
-		if (child == NULL) {
-			// nothing to do
-			return;
-		}
+	__treap_find_batch(t, keys, out, n, 1);
+}
 
-		*link = child;
-		struct treap_node *right_left = child->left;
-		child->left = parent;
-		parent->right = right_left;
-	}
+/* walk the paths of `n` keys to bring them into the cache before they are
+ * updated (the walks are not counted in the stats)
+ * */
+void treap_prefetch_batch(struct treap *t, struct treap_key *keys, size_t n)
+{
+	__treap_find_batch(t, keys, NULL, n, 0);
 }
 
 static __always_inline
 struct treap_node * __treap_alloc_node(struct treap *t)
 {
-	if (t->used >= TREAP_MAX_SIZE) {
+	if (t->used >= t->capacity) {
 		// pool of nodes has been exausted
 		return NULL;
 	}
-	uint32_t top_stack = TREAP_MAX_SIZE - t->used -1;
+	uint32_t top_stack = t->capacity - t->used -1;
 	t->used++;
-	struct treap_node *new = t->stack[top_stack];
+	struct treap_node *new = __node(t, t->stack[top_stack]);
 	// initialize
-	new->left = new->right = NULL;
+	new->left = new->right = TREAP_NIL;
 	return new;
 }
 
@@ -216,253 +630,367 @@ void __treap_free_node(struct treap *t, struct treap_node *n)
 	}
 
 	t->used--;
-	uint32_t top_stack = TREAP_MAX_SIZE - t->used - 1;
-	t->stack[top_stack] = n;
+	uint32_t top_stack = t->capacity - t->used - 1;
+	t->stack[top_stack] = __ref(t, n);
 }
 
-int treap_insert(struct treap *t, struct treap_key *k, uint32_t priority)
+/* merge two sub-trees where every key in `l` is less than (or equal) the keys
+ * in `r` and link the result at `link`. It walks down the right spine of `l`
+ * and the left spine of `r`, no rotations are needed.
+ * */
+static __always_inline
+void __treap_merge(struct treap *t, treap_ref_t *link, treap_ref_t l,
+		treap_ref_t r)
 {
-	// get a node
-	struct treap_node *n = __treap_alloc_node(t);
-	if (n == NULL) {
-		return -ENOSPC;
-	}
-	memcpy(&n->key, k, sizeof(struct treap_key));
-	n->priority = priority;
-
-	// find the right place on the binary tree
-	struct treap_node *ptr = t->root;
-	struct treap_node **link = &t->root;
-
-	uint32_t i; // path len
-	struct treap_node *path[TREAP_MAX_HEIGHT] = {};
-
-	// I want a bounded loop since I am planing to use it in eBPF
-	for (i = 0; i < TREAP_MAX_HEIGHT; i++) {
-		if (ptr == NULL)
-			break;
-		path[i] = ptr;
-		if (treap_key_less_than(k, &ptr->key)) {
-			link = &ptr->left;
-			ptr = ptr->left;
+	uint32_t k;
+	// each iteration consumes a node, so the loop always terminates in the
+	// bound
+	for (k = 0; k <= t->capacity; k++) {
+		if (l == TREAP_NIL) {
+			__treap_set_link(t, link, r);
+			return;
+		}
+		if (r == TREAP_NIL) {
+			__treap_set_link(t, link, l);
+			return;
+		}
+		struct treap_node *ln = __node(t, l);
+		struct treap_node *rn = __node(t, r);
+		__treap_stat(t, merge_steps, 1);
+		if (__prio(t, ln) >= __prio(t, rn)) {
+			__treap_set_link(t, link, l);
+			link = &ln->right;
+			l = ln->right;
 		} else {
-			link = &ptr->right;
-			ptr = ptr->right;
+			__treap_set_link(t, link, r);
+			link = &rn->left;
+			r = rn->left;
 		}
 	}
-	// did not found the empty space in the bounded height
-	if (i >= TREAP_MAX_HEIGHT) {
-		printf("%d > %d\n", i, TREAP_MAX_HEIGHT);
-		t->used--; // free the node we reserved
-		return -2;
-	}
-
-	// assign the node to the empty place we found
-	*link = n;
-
-	/* if (i == 0) { */
-	/* 	// The treap was empty and we just set the root */
-	/* 	// The heap property is valid */
-	/* 	return 0; */
-	/* } */
+}
 
-	int parent_index = i;
-	for (uint32_t k = 0; k < TREAP_MAX_HEIGHT; k++) {
-		if (parent_index <= 0) {
-			// we reached the root (rotate the node to the root)
+/* split the sub-tree `n` into the nodes with keys less than `key` (linked at
+ * `l_link`) and the rest (linked at `r_link`)
+ * */
+static __always_inline
+void __treap_split(struct treap *t, treap_ref_t n, struct treap_key *key,
+		treap_ref_t *l_link, treap_ref_t *r_link)
+{
+	uint32_t k;
+	for (k = 0; k <= t->capacity; k++) {
+		if (n == TREAP_NIL)
 			break;
-		}
-		parent_index--;
-		struct treap_node *p = path[parent_index];
-		struct treap_node **grand_p_link = NULL;
-		if (n->priority > p->priority) {
-			// do rotation
-			if (parent_index > 0)
-				grand_p_link = __get_parent_link(path[parent_index - 1], p);
-			else
-				grand_p_link = &t->root;
-			if (p->left == n) {
-				// do a right rotation rooted at parent
-				__rotate(grand_p_link, RIGHT);
-			} else {
-				// do a left rotation rooted at parent
-				__rotate(grand_p_link, LEFT);
-			}
+		struct treap_node *nn = __node(t, n);
+		__treap_stat(t, split_steps, 1);
+		if (treap_key_less_than(&nn->key, key)) {
+			__treap_set_link(t, l_link, n);
+			l_link = &nn->right;
+			n = nn->right;
+		} else {
+			__treap_set_link(t, r_link, n);
+			r_link = &nn->left;
+			n = nn->left;
 		}
 	}
-	return 0;
+	*l_link = TREAP_NIL;
+	*r_link = TREAP_NIL;
 }
 
-struct treap_node *__get_imidiate_succesor(struct treap_node *n,
-		struct treap_node ***out_link)
+/* link the detached node `n` in the sub-tree at `link`: walk down until we
+ * reach a node with lower priority, `n` takes its place and that sub-tree is
+ * split between the children of `n`
+ * */
+static __always_inline
+void __treap_place(struct treap *t, treap_ref_t *link, struct treap_node *n)
 {
-	struct treap_node *leaf = n->right;
-	struct treap_node **link = &n->right;
+	treap_ref_t ptr = *link;
+	treap_prio_t priority = __prio(t, n);
 	uint32_t k;
-	if (n->right == NULL)
-		return NULL;
-	for (k = 0; k < TREAP_MAX_HEIGHT; k++) {
-		if (leaf->left == NULL)
+	for (k = 0; k <= t->capacity; k++) {
+		if (ptr == TREAP_NIL)
 			break;
-		link = &leaf->left;
-		leaf = leaf->left;
-	}
-	if (k >= TREAP_MAX_HEIGHT) {
-		// failed to do it in a bounded size
-		return NULL;
+		struct treap_node *pn = __node(t, ptr);
+		if (__prio(t, pn) < priority)
+			break;
+		if (treap_key_less_than(&n->key, &pn->key))
+			link = &pn->left;
+		else
+			link = &pn->right;
+		ptr = *link;
 	}
-	*out_link = link;
-	return leaf;
+	__treap_stat_walk(t, k);
+	__treap_split(t, ptr, &n->key, &n->left, &n->right);
+	__treap_set_link(t, link, __ref(t, n));
 }
 
-// Bubble down the node fixing the heap property
-int __fix_sub_tree_heap_property_down(struct treap_node *ptr, struct treap_node **ptr_link)
+/* Insert a key. The node is placed top-down: walk down to the first node with
+ * a lower priority and split its sub-tree between the children of the new
+ * node. Unlike rotating up from a leaf it needs no path, so it never fails
+ * because of the height of the treap.
+ * */
+int treap_insert(struct treap *t, struct treap_key *k, treap_prio_t priority)
 {
-	// The state of the treap is as follows:
-	//   * the binary search property is valid
-	//   * the heap property is possiblly not, because we moved replace a node
-	//     with its next successor
-
-	// How to fix the heap property ?
-	// Each left and right sub-tree of replaced node are valid treaps.
-	// 1. If the node priority is more than both, we are good
-	// 2. Otherwise, rotate the node toward the sub-tree with lower priority
-	//    e.g., if the priority for the top of sub-tree is 5 and for the right is 8, we rotate left.
-	// 3. Goto 1! [Repeat until we exit at step 1].
-
-	// Why it works? at each rotation, the node with higher priority will
-	// bubble up ... (not 100% sure actually)
-
-
-	uint32_t p = ptr->priority;
-	uint32_t k;
-	// we do not need to update the ptr, the ptr is the node we want to
-	// buble down.
-	for (k = 0; k < TREAP_MAX_HEIGHT; k++) {
-		uint32_t left_p, right_p;
-		if (ptr->left == NULL) {
-			if (ptr->right == NULL) {
-				// we are good
-				break;
-			} else if (p >= ptr->right->priority) {
-				// we are good
-				break;
-			} else {
-					__rotate(ptr_link, LEFT);
-					ptr_link = &((*ptr_link)->left);
-			}
-		} else if (ptr->right == NULL) {
-			// NOTE: we know the left is not null
-			left_p = ptr->left->priority;
-			if (p >= ptr->left->priority) {
-				// we are good
-				break;
-			} else {
-					__rotate(ptr_link, RIGHT);
-					ptr_link = &((*ptr_link)->right);
-			}
-		} else {
-			left_p = ptr->left->priority;
-			right_p = ptr->right->priority;
-			if (p >= left_p) {
-				if (p >= right_p) {
-					// we are good
-					break;
-				} else {
-					// right_p > left_p --> rotate to the side with lower priority (LEFT)
-					__rotate(ptr_link, LEFT);
-					ptr_link = &((*ptr_link)->left);
-				}
-			} else {
-				// left_p > p
-				if (left_p <= right_p) {
-					__rotate(ptr_link, LEFT);
-					ptr_link = &((*ptr_link)->left);
-				} else {
-					__rotate(ptr_link, RIGHT);
-					ptr_link = &((*ptr_link)->right);
-				}
-			}
-		}
-
-		/* if ((ptr->right != NULL) && */
-		/* 		(ptr->priority < ptr->right->priority)) { */
-		/* 	__rotate(ptr_link, LEFT); */
-		/* 	ptr_link = &((*ptr_link)->left); */
-		/* } else if ((ptr->left != NULL) && */
-		/* 		(ptr->priority < ptr->left->priority)) { */
-		/* 	__rotate(ptr_link, RIGHT); */
-		/* 	ptr_link = &((*ptr_link)->right); */
-		/* } else { */
-		/* 	// everything is good */
-		/* 	break; */
-		/* } */
-	}
-	if (k >= TREAP_MAX_HEIGHT) {
-		fprintf(stderr, "error: could not fix tree in the bounded number of iterations\n");
-		return -1;
+	// get a node
+	struct treap_node *n = __treap_alloc_node(t);
+	if (n == NULL) {
+		return -ENOSPC;
 	}
+	memcpy(&n->key, k, sizeof(struct treap_key));
+	__prio(t, n) = priority;
+	__treap_place(t, &t->root, n);
+	__treap_hidx_add(t, n);
 	return 0;
 }
 
+/* Remove a key, its sub-trees are merged in its place.
+ * return: zero on success, -1 if the key is not in the treap
+ * */
 int treap_delete(struct treap *t, struct treap_key *key)
 {
-	int ret;
 	struct treap_node *n;
-	struct treap_node **link;
+	treap_ref_t *link;
+#ifdef TREAP_HASH_INDEX
+	// the parent of the node gives its link
+	n = __treap_hidx_find(t, key);
+	if (n != NULL)
+		link = __treap_parent_link(t, n);
+#else
+	// the link to the node is only known by walking down to it
 	__treap_find(t, key, &n, &link);
+#endif
 	if (n == NULL) {
 		// key does not exist
 		return -1;
 	}
-	if (n->left == NULL) {
-		if (n->right == NULL) {
-			// it is a leaf, just remove the node
-			*link = NULL;
+	__treap_hidx_del(t, n);
+	__treap_merge(t, link, n->left, n->right);
+	// return the node to the stack of free nodes :)
+	__treap_free_node(t, n);
+	return 0;
+}
+
+/* remove the top node and insert a new key in its place. The node of the old
+ * top is reused, so it never fails for lack of space.
+ * */
+int treap_replace_top(struct treap *t, struct treap_key *key,
+		treap_prio_t priority)
+{
+	struct treap_node *n = treap_top(t);
+	if (n == NULL)
+		return -ENOENT;
+	// unlink the root, its sub-trees become the new treap
+	__treap_merge(t, &t->root, n->left, n->right);
+	__treap_hidx_del(t, n);
+
+	memcpy(&n->key, key, sizeof(struct treap_key));
+	__prio(t, n) = priority;
+	__treap_place(t, &t->root, n);
+	__treap_hidx_add(t, n);
+	return 0;
+}
+
+/* remove the top node
+ * */
+int treap_pop_top(struct treap *t)
+{
+	struct treap_node *n = treap_top(t);
+	if (n == NULL)
+		return -ENOENT;
+	__treap_merge(t, &t->root, n->left, n->right);
+	__treap_hidx_del(t, n);
+	__treap_free_node(t, n);
+	return 0;
+}
+
+enum treap_upsert_result {
+	TREAP_UPSERT_ABSENT = 0, // the key was not in the treap, nothing changed
+	TREAP_UPSERT_DELETED,
+	TREAP_UPSERT_UPDATED,
+	TREAP_UPSERT_INSERTED,
+};
+
+/* search the key once and then
+ *   keep == 0: remove it (if it is in the treap)
+ *   keep != 0: set its priority, inserting it if it is not in the treap
+ *              (returns -ENOSPC when it is not and there is no space)
+ * return: one of treap_upsert_result or a negative error
+ * */
+int treap_upsert(struct treap *t, struct treap_key *key, treap_prio_t priority,
+		int keep)
+{
+	treap_ref_t ptr = t->root;
+	treap_ref_t *link = &t->root;
+	// the link of the first node on the path with a lower priority than
+	// the new one (where the key would sit with the new priority)
+	treap_ref_t *place_link = NULL;
+	struct treap_node *n = NULL;
+	uint32_t k;
+#ifdef TREAP_HASH_INDEX
+	// only an insert walks down, the node of a key in the table is reached
+	// from its parent
+	n = __treap_hidx_find(t, key);
+	if (n == NULL && !keep)
+		return TREAP_UPSERT_ABSENT;
+	if (n != NULL) {
+		link = __treap_parent_link(t, n);
+		if (!keep) {
+			__treap_hidx_del(t, n);
+			__treap_merge(t, link, n->left, n->right);
+			__treap_free_node(t, n);
+			return TREAP_UPSERT_DELETED;
+		}
+		if (priority < __prio(t, n)) {
+			// it moves down
+			__treap_merge(t, link, n->left, n->right);
+			__prio(t, n) = priority;
+			__treap_place(t, link, n);
+			return TREAP_UPSERT_UPDATED;
+		}
+		// it moves up, below the last ancestor with a higher priority
+		treap_ref_t *place = link;
+		struct treap_node *p = treap_node(t, n->parent);
+		while (p != NULL && __prio(t, p) < priority) {
+			place = __treap_parent_link(t, p);
+			p = treap_node(t, p->parent);
+		}
+		if (place != link) {
+			__treap_merge(t, link, n->left, n->right);
+			__prio(t, n) = priority;
+			__treap_place(t, place, n);
+		} else {
+			__prio(t, n) = priority;
+		}
+		return TREAP_UPSERT_UPDATED;
+	}
+#endif
+	for (k = 0; k <= t->capacity; k++) {
+		if (ptr == TREAP_NIL)
+			break;
+		n = __node(t, ptr);
+		if (place_link == NULL && __prio(t, n) < priority)
+			place_link = link;
+		if (treap_key_less_than(key, &n->key)) {
+			link = &n->left;
 		} else {
-			// has one child (the right child)
-			*link = n->right;
+			if (treap_key_eq(key, &n->key))
+				break;
+			link = &n->right;
 		}
-	} else {
-		// has left child
-		if (n->right == NULL) {
-			// has one child (the left child)
-			*link = n->left;
+		ptr = *link;
+	}
+	__treap_stat_walk(t, k);
+
+	if (ptr == TREAP_NIL) {
+		// the key is not in the treap
+		if (!keep)
+			return TREAP_UPSERT_ABSENT;
+		n = __treap_alloc_node(t);
+		if (n == NULL)
+			return -ENOSPC;
+		memcpy(&n->key, key, sizeof(struct treap_key));
+		__prio(t, n) = priority;
+		if (place_link == NULL) {
+			// it is a new leaf
+			__treap_set_link(t, link, __ref(t, n));
 		} else {
-			// We need to move the node down, find the imidiate
-			// successor (the left most left node of the right
-			// sub-tree)
-			struct treap_node **leaf_link = NULL;
-			struct treap_node *leaf = __get_imidiate_succesor(n, &leaf_link);
-			if (leaf == NULL) {
-				// failed to do it in a bounded size
-				return -2;
-			}
+			__treap_split(t, *place_link, key, &n->left, &n->right);
+			__treap_set_link(t, place_link, __ref(t, n));
+		}
+		__treap_hidx_add(t, n);
+		return TREAP_UPSERT_INSERTED;
+	}
 
-			// swap the node with the leaf and then remove the node
-			// .. we know leaf does not have a left, if it does not
-			// have a right then just remove the node. if it has a
-			// right child then put the right child in place of
-			// leaf.
-			*leaf_link = leaf->right;
-			leaf->right = n->right;
-			leaf->left = n->left;
-			*link = leaf;
-			// node has been removed and everything is almost okay
-			// except that moving leaf to the nodes position may
-			// have disturbed the heap property
-			ret = __fix_sub_tree_heap_property_down(leaf, link);
-			assert(ret == 0);
+	if (!keep) {
+		__treap_hidx_del(t, n);
+		__treap_merge(t, link, n->left, n->right);
+		__treap_free_node(t, n);
+		return TREAP_UPSERT_DELETED;
+	}
+
+	if (place_link == link || __prio(t, n) == priority) {
+		// the ancestors still have higher priorities and the children
+		// have lower ones, the node stays where it is
+		__prio(t, n) = priority;
+		return TREAP_UPSERT_UPDATED;
+	}
+	// unlink the node and place it again, moving up (place_link is one of
+	// the ancestors) or down (below its current link)
+	__treap_merge(t, link, n->left, n->right);
+	__prio(t, n) = priority;
+	__treap_place(t, place_link != NULL ? place_link : link, n);
+	return TREAP_UPSERT_UPDATED;
+}
+
+/* write the keys and priorities of the treap in key order, the arrays should
+ * have space for t->used entries
+ * */
+int treap_export_sorted(struct treap *t, struct treap_key *keys,
+		treap_prio_t *prios)
+{
+	// the walk stack is at most as deep as the number of nodes
+	treap_ref_t *stack = malloc((t->used + 1) * sizeof(treap_ref_t));
+	if (stack == NULL)
+		return -ENOMEM;
+	uint32_t sz = 0, i = 0;
+	treap_ref_t cur = t->root;
+	while (sz > 0 || cur != TREAP_NIL) {
+		if (cur != TREAP_NIL) {
+			stack[sz++] = cur;
+			cur = __node(t, cur)->left;
+		} else {
+			struct treap_node *n = __node(t, stack[--sz]);
+			memcpy(&keys[i], &n->key, sizeof(struct treap_key));
+			prios[i++] = __prio(t, n);
+			cur = n->right;
 		}
 	}
+	free(stack);
+	return 0;
+}
 
-	// return the node to the stack of free nodes :)
-	__treap_free_node(t, n);
+/* Replace the content of the treap with `n` keys given in strictly increasing
+ * order, in O(n): every node is pushed on a stack holding the right spine of
+ * the tree so far, and the nodes of the spine with lower priorities become
+ * its left sub-tree (a Cartesian tree). The bulk load of cvm_deserialize() and
+ * cvm_merge(), paired with treap_export_sorted().
+ * return: -ENOSPC if n is above the capacity, -EINVAL if the keys are not
+ * sorted
+ * */
+int treap_build_sorted(struct treap *t, struct treap_key *keys,
+		treap_prio_t *prios, uint32_t n)
+{
+	if (n > t->capacity)
+		return -ENOSPC;
+	for (uint32_t i = 1; i < n; i++)
+		if (!treap_key_less_than(&keys[i - 1], &keys[i]))
+			return -EINVAL;
+	treap_ref_t *spine = malloc((n + 1) * sizeof(treap_ref_t));
+	if (spine == NULL)
+		return -ENOMEM;
+	treap_reset(t);
+	uint32_t sz = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		struct treap_node *nn = __treap_alloc_node(t);
+		memcpy(&nn->key, &keys[i], sizeof(struct treap_key));
+		__prio(t, nn) = prios[i];
+		treap_ref_t last = TREAP_NIL;
+		while (sz > 0 && __prio(t, __node(t, spine[sz - 1])) < prios[i])
+			last = spine[--sz];
+		__treap_set_link(t, &nn->left, last);
+		if (sz > 0)
+			__treap_set_link(t, &__node(t, spine[sz - 1])->right,
+					__ref(t, nn));
+		else
+			__treap_set_link(t, &t->root, __ref(t, nn));
+		spine[sz++] = __ref(t, nn);
+		__treap_hidx_add(t, nn);
+	}
+	free(spine);
 	return 0;
 }
 
 static __always_inline
 uint8_t treap_has_space(struct treap *t)
 {
-	return t->used < TREAP_MAX_SIZE;
+	return t->used < t->capacity;
 }